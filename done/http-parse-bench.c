@@ -0,0 +1,76 @@
+/*
+ * @file http-parse-bench.c
+ * @brief Measures HTTP parser throughput for each scanner implementation
+ *
+ * Usage: http-parse-bench [iterations]
+ */
+
+#include "error.h"
+#include "util.h"
+#include "http_prot.h"
+#include "http_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 1000000
+
+// Headers sent by a current desktop browser when loading a thumbnail
+static const char request[] =
+    "GET /imgfs/read?res=thumb&img_id=papillon.jpg HTTP/1.1" HTTP_LINE_DELIM
+    "Host: localhost:8000" HTTP_LINE_DELIM
+    "Connection: keep-alive" HTTP_LINE_DELIM
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"" HTTP_LINE_DELIM
+    "sec-ch-ua-mobile: ?0" HTTP_LINE_DELIM
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36" HTTP_LINE_DELIM
+    "sec-ch-ua-platform: \"Linux\"" HTTP_LINE_DELIM
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8" HTTP_LINE_DELIM
+    "Sec-Fetch-Site: same-origin" HTTP_LINE_DELIM
+    "Sec-Fetch-Mode: no-cors" HTTP_LINE_DELIM
+    "Sec-Fetch-Dest: image" HTTP_LINE_DELIM
+    "Referer: http://localhost:8000/index.html" HTTP_LINE_DELIM
+    "Accept-Encoding: gzip, deflate, br, zstd" HTTP_LINE_DELIM
+    "Accept-Language: fr-CH,fr;q=0.9,en-US;q=0.8,en;q=0.7" HTTP_LINE_DELIM
+    "Cookie: _ga=GA1.1.1234567890.1700000000; session=0123456789abcdef0123456789abcdef" HTTP_HDR_END_DELIM;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+    const size_t len = strlen(request);
+    static const enum http_scan_impl impls[] = { HTTP_SCAN_SCALAR, HTTP_SCAN_SSE42, HTTP_SCAN_AVX2 };
+
+    printf("request size: " SIZE_T_FMT " bytes, %lu iterations\n", len, iterations);
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        if (http_scan_select(impls[i]) != ERR_NONE) {
+            continue; // not supported by this CPU
+        }
+
+        struct http_message msg;
+        int content_len = 0;
+        size_t nb_headers = 0;
+        const double start = now_s();
+        for (unsigned long it = 0; it < iterations; ++it) {
+            if (http_parse_message(request, len, &msg, &content_len) != 1) {
+                fprintf(stderr, "parse error with %s\n", http_scan_impl_name());
+                return ERR_RUNTIME;
+            }
+            nb_headers += msg.num_headers;
+        }
+        const double elapsed = now_s() - start;
+
+        printf("%-8s %12.0f requests/s %8.1f MB/s (" SIZE_T_FMT " headers)\n",
+               http_scan_impl_name(), (double) iterations / elapsed,
+               (double) iterations * (double) len / elapsed / 1e6, nb_headers / iterations);
+    }
+    return ERR_NONE;
+}
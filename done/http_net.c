@@ -8,129 +8,512 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <strings.h> // strncasecmp
+#include <time.h>
 #include <pthread.h>
 
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
+#include "thread_pool.h"
+#include "recv_buffer.h"
 #include "error.h"
 
 // Maximum size of an image in bytes
-static const MAX_IMAGE_BYTES = 5000 * 1000; //taken from index
-// Buffer size to accommodate headers and image data
-static const BUFFER_SIZE = MAX_HEADER_SIZE + MAX_IMAGE_BYTES + 1;
+static const size_t MAX_IMAGE_BYTES = 5000 * 1000; //taken from index
+// Number of readiness events handled per epoll_wait() call
+#define MAX_EVENTS 64
 // Passive socket descriptor
 static int passive_socket = -1;
+// epoll instance watching the connections waiting for a request
+static int epoll_fd = -1;
+// Written by http_close() to stop the poller
+static int stop_fd = -1;
+static pthread_t poller;
+static int poller_started = 0;
 // Event callback function pointer
 static EventCallback cb;
+// Tells which worker queue a parsed request goes to (all cheap when NULL)
+static ClassifyCallback classify;
 
-// Macro to define error codes as static variables
-#define MK_OUR_ERR(X) \
-static int our_ ## X = X
+static ExpectCallback expect;
+// Number of workers of the pool, 0 meaning two per online CPU
+static size_t nb_workers = 0;
 
-MK_OUR_ERR(ERR_NONE);
-MK_OUR_ERR(ERR_INVALID_ARGUMENT);
-MK_OUR_ERR(ERR_OUT_OF_MEMORY);
-MK_OUR_ERR(ERR_IO);
+/*
+ * State of a client connection. It is owned by exactly one party at a time:
+ * the poller while waiting for data, or the worker running one of its jobs.
+ * The receive buffer is only held while a request is being received, or
+ * when it still contains the beginning of pipelined requests.
+ */
+struct http_connection {
+    int socket;
+    struct recv_buffer buffer;
+    size_t bytes_received;
+    struct http_parser parser;
+    struct http_message msg;
+    int body_asked; // whether the body of msg was asked for, if it had to
+    // Links in the list of connections waiting for data, oldest first
+    struct http_connection *prev;
+    struct http_connection *next;
+    int waiting;
+    uint64_t deadline_ms;
+};
+
+// Connections waiting for data; as they all get the same timeout, the
+// list is sorted by deadline
+static struct http_connection *waiting_head = NULL;
+static struct http_connection *waiting_tail = NULL;
+static pthread_mutex_t waiting_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void serve_connection(void *arg);
+static void process_buffer(struct http_connection *conn);
 
 /*******************************************************************
- * Handle connection
- * This function handles the connection with the client.
+ * Monotonic clock in milliseconds
  */
-static void *handle_connection(void *arg) {
-    // Block SIGINT and SIGTERM signals for this thread
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGTERM);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000u + (uint64_t) ts.tv_nsec / 1000000u;
+}
 
-    if (arg == NULL) {
-        return &our_ERR_INVALID_ARGUMENT;
+/*******************************************************************
+ * Waiting list, to be called with waiting_lock held
+ */
+static void waiting_append(struct http_connection *conn) {
+    conn->deadline_ms = now_ms() + HTTP_IDLE_TIMEOUT;
+    conn->next = NULL;
+    conn->prev = waiting_tail;
+    if (waiting_tail != NULL) {
+        waiting_tail->next = conn;
+    } else {
+        waiting_head = conn;
     }
+    waiting_tail = conn;
+    conn->waiting = 1;
+}
 
+static void waiting_remove(struct http_connection *conn) {
+    if (!conn->waiting) return;
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        waiting_head = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    } else {
+        waiting_tail = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+    conn->waiting = 0;
+}
 
-    int *active_socket = (int *) arg;
-    char *buffer = calloc(1, BUFFER_SIZE);  // Allocate buffer
-    if (buffer == NULL) {
-        close(active_socket);
-        free(active_socket);
-        return &our_ERR_OUT_OF_MEMORY;
+/*******************************************************************
+ * Close connection
+ * Closes the socket (which also removes it from epoll) and frees the state.
+ */
+static void close_connection(struct http_connection *conn) {
+    close(conn->socket);
+    recv_buffer_release(&conn->buffer);
+    free(conn);
+}
+
+/*******************************************************************
+ * Drop connection
+ * Releases the connection of a job that will not run.
+ */
+static void drop_connection(void *arg) {
+    close_connection(arg);
+}
+
+/*******************************************************************
+ * Reject connection
+ * When the worker pool cannot take it: tells the client so if its socket
+ * can take the reply right away, and closes it. The poller must never
+ * block on a slow client.
+ */
+static void reject_connection(struct http_connection *conn) {
+    static const char unavailable[] = HTTP_PROTOCOL_ID HTTP_UNAVAILABLE HTTP_LINE_DELIM
+                                      "Content-Length: 0" HTTP_LINE_DELIM
+                                      "Connection: close" HTTP_HDR_END_DELIM;
+    (void) send(conn->socket, unavailable, strlen(unavailable), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close_connection(conn);
+}
+
+/*******************************************************************
+ * Wait for the next request
+ * Hands the connection back to the poller until data is available or
+ * until it has been idle for HTTP_IDLE_TIMEOUT.
+ */
+static void wait_for_data(struct http_connection *conn, int op) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+
+    pthread_mutex_lock(&waiting_lock);
+    waiting_append(conn);
+    pthread_mutex_unlock(&waiting_lock);
+
+    if (epoll_ctl(epoll_fd, op, conn->socket, &event) == -1) {
+        perror("epoll_ctl() in wait_for_data()");
+        pthread_mutex_lock(&waiting_lock);
+        waiting_remove(conn);
+        pthread_mutex_unlock(&waiting_lock);
+        close_connection(conn);
     }
+}
 
-    int bytes_received = 0;
-    int content_len = 0;
-    struct http_message msg;
-    memset(&msg, 0, sizeof(msg));
+/*******************************************************************
+ * Make room in the receive buffer
+ * Before the headers are complete the buffer may grow up to MAX_HEADER_SIZE;
+ * once they announce a body, it grows to fit exactly the whole request.
+ */
+static int reserve_buffer(struct http_connection *conn) {
+    struct recv_buffer *buf = &conn->buffer;
+    if (buf->data == NULL) {
+        return recv_buffer_acquire(buf);
+    }
 
-    while (1) {
-        // Read data from the socket
-        int n = tcp_read(*active_socket, &buffer[bytes_received],
-                         BUFFER_SIZE - bytes_received);
-        if (n <= 0) {
-            close(active_socket);
-            free(buffer);
-            free(active_socket);
-            return &our_ERR_IO;
+    if (conn->parser.state == HTTP_PARSE_BODY) {
+        if (conn->parser.content_len > MAX_IMAGE_BYTES) {
+            return ERR_INVALID_ARGUMENT;
         }
+        const size_t needed = conn->parser.headers_len + conn->parser.content_len + 1;
+        return recv_buffer_reserve(buf, needed, conn->bytes_received + 1);
+    }
+
+    if (conn->bytes_received + 1 < buf->capacity) {
+        return ERR_NONE;
+    }
+    if (buf->capacity > MAX_HEADER_SIZE) {
+        return ERR_INVALID_ARGUMENT; // headers too long
+    }
+    return recv_buffer_reserve(buf, MAX_HEADER_SIZE + 1, conn->bytes_received + 1);
+}
+
+/*******************************************************************
+ * Tells whether the client asked to close the connection after this request
+ */
+static int wants_close(const struct http_message *msg) {
+    const struct http_string *connection = http_get_header(msg, "Connection");
+    return connection != NULL && connection->len == strlen("close")
+           && !strncasecmp(connection->val, "close", connection->len);
+}
+
+/*******************************************************************
+ * Tells whether the client waits for our go before sending the body
+ */
+static int expects_continue(const struct http_message *msg) {
+    const struct http_string *expectation = http_get_header(msg, "Expect");
+    return expectation != NULL && expectation->len == strlen("100-continue")
+           && !strncasecmp(expectation->val, "100-continue", expectation->len);
+}
+
+/*******************************************************************
+ * Ask for the body
+ * The client of a request with "Expect: 100-continue" waits for our go
+ * before sending its body, unless the request is answered without it.
+ * Returns 1 if the body will follow, 0 if the connection was closed.
+ */
+static int ask_for_body(struct http_connection *conn) {
+    conn->body_asked = 1;
+    if (!expects_continue(&conn->msg)) {
+        return 1;
+    }
+
+    if (expect != NULL && expect(&conn->msg, conn->socket)) {
+        close_connection(conn);
+        return 0;
+    }
 
-        bytes_received += n;
-        buffer[bytes_received] = '\0';
+    const char continue_msg[] = HTTP_PROTOCOL_ID HTTP_CONTINUE HTTP_HDR_END_DELIM;
+    if (tcp_send(conn->socket, continue_msg, strlen(continue_msg)) != (ssize_t) strlen(continue_msg)) {
+        close_connection(conn);
+        return 0;
+    }
+    return 1;
+}
+
+/*******************************************************************
+ * Answer request
+ * Runs the callback on a fully received message. The bytes that follow it
+ * (pipelined requests) are moved to the beginning of the buffer.
+ * Returns 1 if they have to be processed, 0 if the connection was handed
+ * back to the poller or closed.
+ */
+static int answer_request(struct http_connection *conn) {
+    if (cb != NULL) {
+        cb(&conn->msg, conn->socket);
+    } else {
+        http_reply(conn->socket, HTTP_OK, "", "", 0);
+    }
+
+    if (wants_close(&conn->msg)) {
+        close_connection(conn);
+        return 0;
+    }
+
+    const size_t consumed = conn->parser.headers_len + conn->parser.content_len;
+    const size_t leftover = conn->bytes_received - consumed;
+    http_parser_init(&conn->parser);
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->body_asked = 0;
+
+    if (leftover == 0) {
+        // An idle connection does not keep any receive buffer
+        conn->bytes_received = 0;
+        recv_buffer_release(&conn->buffer);
+        wait_for_data(conn, EPOLL_CTL_MOD);
+        return 0;
+    }
 
-        // Try to parse the message
-        int parse_result = http_parse_message(buffer, bytes_received, &msg, &content_len);
+    memmove(conn->buffer.data, &conn->buffer.data[consumed], leftover);
+    conn->bytes_received = leftover;
+    conn->buffer.data[leftover] = '\0';
+    return 1;
+}
+
+/*******************************************************************
+ * Serve request
+ * Job answering an expensive request, then the ones pipelined after it.
+ */
+static void serve_request(void *arg) {
+    struct http_connection *conn = arg;
+    if (answer_request(conn)) {
+        process_buffer(conn);
+    }
+}
+
+/*******************************************************************
+ * Serve expectation
+ * Job answering the headers of an expensive request sent with
+ * "Expect: 100-continue", then reading its body if still needed.
+ */
+static void serve_expectation(void *arg) {
+    struct http_connection *conn = arg;
+    if (ask_for_body(conn)) {
+        process_buffer(conn);
+    }
+}
+
+/*******************************************************************
+ * Process buffer
+ * Answers, in order, the complete requests present in the buffer, then
+ * waits for more data.
+ */
+static void process_buffer(struct http_connection *conn) {
+    while (1) {
+        // Resume parsing where the previous read stopped
+        int parse_result = http_parser_feed(&conn->parser, conn->buffer.data,
+                                            conn->bytes_received, &conn->msg);
         if (parse_result < 0) {
-            close(active_socket);
-            free(buffer);
-            free(active_socket);
-            return &parse_result;   // Returning a pointer to an int declared in the same function
+            close_connection(conn);
+            return;
         }
 
-        if (parse_result == 1) {
-            // Call the HTTP message handler
-            cb(&msg, *active_socket);
+        if (parse_result == 0) {
+            if (conn->parser.state == HTTP_PARSE_BODY && !conn->body_asked) {
+                // Answering from the headers may take as long as the request
+                const enum job_class job_class = classify != NULL && expects_continue(&conn->msg)
+                                                 ? classify(&conn->msg) : JOB_CHEAP;
+                if (job_class != JOB_CHEAP) {
+                    if (thread_pool_submit(job_class, serve_expectation, conn) != ERR_NONE) {
+                        reject_connection(conn);
+                    }
+                    return;
+                }
+                if (!ask_for_body(conn)) {
+                    return;
+                }
+            }
+            // If message is incomplete, grow the buffer if needed and continue reading
+            if (reserve_buffer(conn) != ERR_NONE) {
+                close_connection(conn);
+                return;
+            }
+            wait_for_data(conn, EPOLL_CTL_MOD);
+            return;
+        }
 
-            // empties values for new message
-            bytes_received = 0;
-            content_len = 0;
-            memset(buffer, 0, sizeof(*buffer));
-            memset(&msg, 0, sizeof(msg));
+        // Requests of a connection are answered one at a time, hence in order
+        const enum job_class job_class = classify != NULL ? classify(&conn->msg) : JOB_CHEAP;
+        if (job_class != JOB_CHEAP) {
+            if (thread_pool_submit(job_class, serve_request, conn) != ERR_NONE) {
+                reject_connection(conn);
+            }
+            return;
         }
 
-        // If message is incomplete, continue reading
-        if (bytes_received >= BUFFER_SIZE) {
-            close(active_socket);
-            free(buffer);
-            free(active_socket);
-            return &our_ERR_INVALID_ARGUMENT;
+        if (!answer_request(conn)) {
+            return;
         }
     }
+}
 
-    // Clean up resources
-    close(active_socket);
-    free(buffer);
-    free(active_socket);
-    return &our_ERR_NONE;
+/*******************************************************************
+ * Serve connection
+ * Reads what is available on the socket (the poller saw it readable, so
+ * this does not block) and processes the requests it completes.
+ */
+static void serve_connection(void *arg) {
+    struct http_connection *conn = arg;
+
+    if (reserve_buffer(conn) != ERR_NONE) {
+        close_connection(conn);
+        return;
+    }
+
+    // Read data from the socket, keeping room for the final '\0'
+    char *buffer = conn->buffer.data;
+    ssize_t n = tcp_read(conn->socket, &buffer[conn->bytes_received],
+                         conn->buffer.capacity - conn->bytes_received - 1);
+    if (n <= 0) {
+        close_connection(conn);
+        return;
+    }
+
+    conn->bytes_received += (size_t) n;
+    buffer[conn->bytes_received] = '\0';
+
+    process_buffer(conn);
+}
+
+/*******************************************************************
+ * Close the connections that have been idle for too long
+ * Returns the delay in ms until the next one expires, -1 if none waits.
+ */
+static int expire_idle_connections(void) {
+    const uint64_t now = now_ms();
+    int timeout = -1;
+
+    pthread_mutex_lock(&waiting_lock);
+    while (waiting_head != NULL && waiting_head->deadline_ms <= now) {
+        struct http_connection *conn = waiting_head;
+        waiting_remove(conn);
+        close_connection(conn);
+    }
+    if (waiting_head != NULL) {
+        timeout = (int) (waiting_head->deadline_ms - now);
+    }
+    pthread_mutex_unlock(&waiting_lock);
+
+    return timeout;
+}
+
+/*******************************************************************
+ * Poller
+ * Turns readable connections into jobs for the worker pool and closes
+ * the idle ones.
+ */
+static void *poll_connections(void *unused) {
+    (void) unused;
+
+    // Block SIGINT and SIGTERM signals for this thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        const int timeout = expire_idle_connections();
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait() in poll_connections()");
+            return NULL;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            struct http_connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                return NULL; // stop_fd: the others stay in the waiting list
+            }
+            pthread_mutex_lock(&waiting_lock);
+            waiting_remove(conn);
+            pthread_mutex_unlock(&waiting_lock);
+
+            if (thread_pool_submit(JOB_CHEAP, serve_connection, conn) != ERR_NONE) {
+                reject_connection(conn);
+            }
+        }
+    }
+    return NULL;
 }
 
 
 /*******************************************************************
  * Init connection
- * Initializes the HTTP server and sets the callback function.
+ * Initializes the HTTP server, its worker pool and sets the callback function.
  */
 int http_init(uint16_t port, EventCallback callback) {
     passive_socket = tcp_server_init(port);
+    if (passive_socket < 0) {
+        return passive_socket;
+    }
     cb = callback;
+
+    if (nb_workers == 0) {
+        const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_workers = nb_cpus > 0 ? 2 * (size_t) nb_cpus : 8;
+    }
+    int err = thread_pool_init(nb_workers);
+    if (err != ERR_NONE) {
+        http_close();
+        return err;
+    }
+
+    epoll_fd = epoll_create1(0);
+    stop_fd = eventfd(0, 0);
+    if (epoll_fd == -1 || stop_fd == -1) {
+        http_close(); // undoes whatever was started, in reverse order
+        return ERR_IO;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // no connection
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) == -1
+        || pthread_create(&poller, NULL, poll_connections, NULL)) {
+        http_close();
+        return ERR_THREADING;
+    }
+    poller_started = 1;
+
     return passive_socket;
 }
 
+/*******************************************************************
+ * Pool configuration
+ */
+void http_set_nb_workers(size_t workers) {
+    nb_workers = workers;
+}
+
+void http_set_expect_handler(ExpectCallback callback) {
+    expect = callback;
+}
+
+void http_set_classifier(ClassifyCallback callback) {
+    classify = callback;
+}
+
 /*******************************************************************
  * Close connection
- * Closes the passive socket.
+ * Closes the passive socket, stops the poller, then the worker pool, and
+ * closes the connections left waiting for data.
  */
 void http_close(void) {
     if (passive_socket > 0) {
@@ -139,40 +522,60 @@ void http_close(void) {
         else
             passive_socket = -1;
     }
+
+    if (poller_started) {
+        const uint64_t stop = 1;
+        if (write(stop_fd, &stop, sizeof(stop)) != (ssize_t) sizeof(stop)) {
+            perror("write() in http_close()");
+        } else {
+            pthread_join(poller, NULL);
+        }
+        poller_started = 0;
+    }
+    // Workers still hand connections back to epoll until they are stopped
+    thread_pool_shutdown(drop_connection);
+
+    pthread_mutex_lock(&waiting_lock);
+    while (waiting_head != NULL) {
+        struct http_connection *conn = waiting_head;
+        waiting_remove(conn);
+        close_connection(conn);
+    }
+    pthread_mutex_unlock(&waiting_lock);
+
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    if (stop_fd != -1) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+    recv_buffer_pool_clear();
 }
 
 /*******************************************************************
  * Receive content
- * Accepts a new connection and starts a new thread to handle it.
+ * Accepts a new connection and hands it to the poller; the worker pool
+ * handles its requests once data arrives.
  */
 int http_receive(void) {
-    // Allocate memory for the active socket
-    int *active_socket = malloc(sizeof(int));
-    if (active_socket == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
-
     // Accept a new connection
-    *active_socket = tcp_accept(passive_socket);
-    if (*active_socket < 0) {
-        free(active_socket);
+    int active_socket = tcp_accept(passive_socket);
+    if (active_socket < 0) {
         return ERR_IO;
     }
 
-    pthread_attr_t attr;
-
-    // Initialize thread attributes and set detach state
-    if (pthread_attr_init(&attr) ||
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)) {
-        free(active_socket);
-        return ERR_IO;
+    // No receive buffer yet: it is taken from the pool once data arrives
+    struct http_connection *conn = calloc(1, sizeof(struct http_connection));
+    if (conn == NULL) {
+        close(active_socket);
+        return ERR_OUT_OF_MEMORY;
     }
 
-    pthread_t thread;
-
-    // Create a new thread to handle the connection
-    pthread_create(&thread, &attr, handle_connection, active_socket);
-    pthread_attr_destroy(&attr);
+    conn->socket = active_socket;
+    http_parser_init(&conn->parser);
+    wait_for_data(conn, EPOLL_CTL_ADD);
 
     return ERR_NONE;
 }
@@ -256,8 +659,9 @@ int http_reply(int connection, const char *status, const char *headers, const ch
         }
     }
 
-    size_t len = header_len + 1 + body_len + 1;
-    char *resp = calloc(1, len);
+    // one more byte for the '\0' written by strcat, which is not sent
+    size_t len = header_len + body_len;
+    char *resp = calloc(1, len + 1);
     if (resp == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
@@ -273,8 +677,8 @@ int http_reply(int connection, const char *status, const char *headers, const ch
     }
 
     // Send the response over the connection
-    tcp_send(connection, resp, len);
+    const ssize_t sent = tcp_send(connection, resp, len);
     free(resp);
 
-    return ERR_NONE;
+    return sent == (ssize_t) len ? ERR_NONE : ERR_IO;
 }
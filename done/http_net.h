@@ -9,9 +9,11 @@
 
 #include <stdint.h>
 #include "http_prot.h" // for structs
+#include "thread_pool.h" // for enum job_class
 
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
 #define MAX_HEADER_SIZE    16384 // 2^14 -> to handle http headers
+#define HTTP_IDLE_TIMEOUT  10000 // ms before an idle keep-alive connection is closed
 
 /* **********************************************************************
  * TODO WEEK 11: DEFINE EventCallback HERE
@@ -24,8 +26,39 @@
  */
 typedef int (*EventCallback)(struct http_message* http_mess, int value);
 
+/**
+ * @brief Tells whether a fully parsed request is cheap or expensive to serve,
+ *        which selects the worker queue it runs from.
+ */
+typedef enum job_class (*ClassifyCallback)(const struct http_message* http_mess);
+
+/**
+ * @brief Called when the headers of a request sent with
+ *        "Expect: 100-continue" are received, before its body: returns 1 if
+ *        it answered the request already, which is then not read further
+ *        (the connection is closed), or 0 to ask the client for the body.
+ */
+typedef int (*ExpectCallback)(const struct http_message* http_mess, int connection);
+
 int http_init(uint16_t port, EventCallback cb);
 
+/**
+ * @brief Sets the number of worker threads. Must be called before http_init();
+ *        0 (the default) means two per online CPU.
+ */
+void http_set_nb_workers(size_t nb_workers);
+
+/**
+ * @brief Sets the request classifier. Without one, every request is cheap.
+ */
+void http_set_classifier(ClassifyCallback classify);
+
+/**
+ * @brief Sets what answers requests before their body. Without it, the
+ *        body is always asked for.
+ */
+void http_set_expect_handler(ExpectCallback expect);
+
 int http_receive(void);
 
 int http_serve_file(int connection, const char* filename);
@@ -1,9 +1,14 @@
 #include "http_prot.h"
 #include "error.h"
+#include "util.h" // MIN
+#include "http_scan.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
 #include <stdio.h>
+#include <stdint.h> // uintptr_t
+#include <limits.h> // INT_MAX
 
 // Matches the URI in the HTTP message with the target URI
 int http_match_uri(const struct http_message *message, const char *target_uri){
@@ -43,209 +48,415 @@ int http_match_verb(const struct http_string* method, const char* verb){
     return 1;
 }
 
+// Looks up a header by name, which is case-insensitive
+const struct http_string* http_get_header(const struct http_message* message, const char* key){
+    if (message == NULL || key == NULL) {
+        return NULL;
+    }
+
+    const size_t key_len = strlen(key);
+    for (size_t i = 0; i < message->num_headers; ++i) {
+        const struct http_header* header = &message->headers[i];
+        if (header->key.len == key_len && !strncasecmp(header->key.val, key, key_len)) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
 // Extracts a variable from the URL query string
 int http_get_var(const struct http_string* url, const char* name, char* out, size_t out_len){
     M_REQUIRE_NON_NULL(url);
     M_REQUIRE_NON_NULL(name);
     M_REQUIRE_NON_NULL(out);
 
-    // Find the beginning of the query string
-    char* args_begin = strstr(url->val, "?"); //to check the beginning of the arguments
+    // Only the URL itself: it is followed by the headers, or by the next
+    // pipelined request, and not terminated by a '\0'
+    const char* const url_end = url->val + url->len;
+    const char* args_begin = url->len > 0 ? memchr(url->val, '?', url->len) : NULL;
     if (args_begin == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
 
-    // Allocate memory for the variable name with "=" appended
-    char* name_cpy = calloc(1, strlen(name) + 2);
-    if (name_cpy == NULL) {
-        return ERR_IO;
+    // Each variable starts right after the '?' or a '&'
+    const size_t name_len = strlen(name);
+    const char* var = args_begin + 1;
+    while (var < url_end) {
+        const char* end = memchr(var, '&', (size_t) (url_end - var));
+        if (end == NULL) {
+            end = url_end;
+        }
+
+        if ((size_t) (end - var) > name_len && !strncmp(var, name, name_len)
+            && var[name_len] == '=') {
+            const char* start = var + name_len + 1;
+            const size_t arg_length = (size_t) (end - start);
+
+            // Check if the output buffer is large enough
+            if (arg_length > out_len || arg_length == 0) {
+                return ERR_RUNTIME;
+            }
+            memcpy(out, start, arg_length);
+            out[arg_length] = '\0';
+            return (int) arg_length;
+        }
+        var = end + 1;
     }
+    return 0;
+}
 
-    strcpy(name_cpy, name);
-    strcat(name_cpy, "=");
+// Reads the decimal number at *p, before end; returns 0 if there is none
+static int read_uint64(const char** p, const char* end, uint64_t* value)
+{
+    const char* start = *p;
+    *value = 0;
+    while (*p < end && '0' <= **p && **p <= '9') {
+        const uint64_t digit = (uint64_t) (**p - '0');
+        if (*value > (UINT64_MAX - digit) / 10) {
+            return 0;
+        }
+        *value = *value * 10 + digit;
+        ++*p;
+    }
+    return *p > start;
+}
 
-    // Find the variable in the query string
-    char* start = strstr(args_begin, name_cpy);
-    if (start == NULL) {
-        free(name_cpy);
-        return 0;
+static const char* skip_spaces(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
     }
+    return p;
+}
 
-    // Find the end of the variable value
-    char* end = strstr(start, "&");
-    if (end == NULL) {
-        end = url->val + url->len;
+// Parses the byte ranges of a Range header value
+int http_parse_range(const struct http_string* value, uint64_t size,
+                     struct http_range ranges[], size_t max_ranges)
+{
+    M_REQUIRE_NON_NULL(value);
+    M_REQUIRE_NON_NULL(value->val);
+    M_REQUIRE_NON_NULL(ranges);
+
+    static const char unit[] = "bytes=";
+    const char* p = value->val;
+    const char* const end = value->val + value->len;
+    if (value->len < strlen(unit) || strncasecmp(p, unit, strlen(unit))) {
+        return ERR_INVALID_ARGUMENT;
     }
-    start += strlen(name_cpy);
-    size_t arg_length = end - start;
+    p += strlen(unit);
+
+    size_t nb_specs = 0, nb_ranges = 0;
+    for (;;) {
+        uint64_t first = 0, last = 0;
+        p = skip_spaces(p, end);
+        const int has_first = read_uint64(&p, end, &first);
+        if (p == end || *p != '-') {
+            return ERR_INVALID_ARGUMENT;
+        }
+        ++p;
+        const int has_last = read_uint64(&p, end, &last);
+        if ((!has_first && !has_last) || (has_first && has_last && last < first)
+            || ++nb_specs > max_ranges) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        if (!has_first) { // the last bytes
+            if (last > 0 && size > 0) {
+                ranges[nb_ranges].first = last < size ? size - last : 0;
+                ranges[nb_ranges++].last = size - 1;
+            }
+        } else if (first < size) {
+            ranges[nb_ranges].first = first;
+            ranges[nb_ranges++].last = has_last && last < size ? last : size - 1;
+        }
 
-    // Check if the output buffer is large enough
-    if (arg_length > out_len || arg_length <= 0) {
-        free(name_cpy);
-        return ERR_RUNTIME;
+        p = skip_spaces(p, end);
+        if (p == end) {
+            return (int) nb_ranges;
+        }
+        if (*p != ',') {
+            return ERR_INVALID_ARGUMENT;
+        }
+        ++p;
     }
+}
 
-    // Copy the variable value to the output buffer
-    char arg[arg_length + 1];
-    memcpy(arg, start, arg_length);
-    arg[arg_length] = '\0';
-    memcpy(out, arg, arg_length + 1);
+// Looks for etag in a list of entity tags, ignoring their weakness
+int http_etag_match(const struct http_string* value, const char* etag)
+{
+    if (value == NULL || value->val == NULL || etag == NULL) {
+        return 0;
+    }
+
+    const size_t etag_len = strlen(etag);
+    const char* p = value->val;
+    const char* const end = value->val + value->len;
+    while (p < end) {
+        p = skip_spaces(p, end);
+        const char* tag_end = memchr(p, ',', (size_t) (end - p));
+        if (tag_end == NULL) {
+            tag_end = end;
+        }
+        const char* last = tag_end;
+        while (last > p && (last[-1] == ' ' || last[-1] == '\t')) {
+            --last;
+        }
+        if (last - p == 1 && *p == '*') {
+            return 1;
+        }
+        if (last - p >= 2 && !strncmp(p, "W/", 2)) {
+            p += 2;
+        }
+        if ((size_t) (last - p) == etag_len && !memcmp(p, etag, etag_len)) {
+            return 1;
+        }
+        p = tag_end + 1;
+    }
+    return 0;
+}
 
-    free(name_cpy);
-    return arg_length;
+// Finds the first occurrence of delimiter in [start, end), NULL if absent
+static const char* find_delim(const char* start, const char* end,
+                              const char* delimiter){
+    const size_t delim_len = strlen(delimiter);
+    while (start < end && (size_t) (end - start) >= delim_len) {
+        const char* candidate = memchr(start, delimiter[0],
+                                       (size_t) (end - start) - delim_len + 1);
+        if (candidate == NULL) {
+            return NULL;
+        }
+        if (!memcmp(candidate, delimiter, delim_len)) {
+            return candidate;
+        }
+        start = candidate + 1;
+    }
+    return NULL;
 }
 
-// Extracts the next token from a message based on the delimiter
+// Extracts the next token from [message, end) based on the delimiter
 static const char* get_next_token(const char* message,
+                                  const char* end,
                                   const char* delimiter,
                                   struct http_string* output){
     // find the position of the delimiter
-    const char* end_token = strstr(message, delimiter);
+    const char* end_token = find_delim(message, end, delimiter);
     if (end_token == NULL) {
         // if not found return NULL
         return NULL;
     }
-    
+
     if (output != NULL) {
         // Set the output token value and length
         output->val = message;
-        output->len = end_token - message;
+        output->len = (size_t) (end_token - message);
     }
 
     // Return the position just after the delimiter
     return end_token + strlen(delimiter);
 }
 
-// Parses the HTTP headers
-static const char* http_parse_headers(const char* header_start,
-                                      struct http_message* output) {
-    const char* currentLineStart = header_start;
-    struct http_string line;
+// Parses the HTTP header lines found in [header_start, headers_end),
+// headers_end pointing just after the CRLF of the last line
+static int http_parse_headers(const char* header_start,
+                              const char* headers_end,
+                              struct http_message* output) {
+    const char* current_pos = header_start;
+    const size_t line_delim_len = strlen(HTTP_LINE_DELIM);
 
     output -> num_headers = 0;
-    int count = 0;
-
-    // Loop to extract headers
-    while ((currentLineStart =
-            get_next_token(currentLineStart, HTTP_HDR_KV_DELIM, &line))
-            != NULL)
-    {
-    // since HTTP_HDR_END_DELIM is HTTP_HDR_KV_DELIM twice in a row,
-    //we can detect it with a .length of 0 instead of searching for it
-
-        if(line.len <= 0) break;
-        struct http_header current_header;
-        current_header.key = line;
-
-        if ((currentLineStart =
-            get_next_token(currentLineStart, HTTP_LINE_DELIM, &line))
-            == NULL) {
 
-            return NULL;
-        } //shouldnt happen on a well formed message
+    // Loop to extract headers, one line at a time
+    while (current_pos < headers_end) {
+        if (output -> num_headers >= MAX_HEADERS) {
+            return ERR_INVALID_ARGUMENT; // Exceeded maximum number of headers
+        }
+        struct http_header* current_header = &output -> headers[output -> num_headers];
 
-        current_header.value = line;
+        // The name is a token directly followed by ':'
+        const char* key_end = http_scan_token_end(current_pos, headers_end);
+        if (key_end == current_pos || key_end == headers_end || *key_end != ':') {
+            return ERR_INVALID_ARGUMENT; // not a "key: value" line
+        }
+        current_header->key.val = current_pos;
+        current_header->key.len = (size_t) (key_end - current_pos);
 
-        if (count >= MAX_HEADERS ) {
-            return NULL; // Exceeded maximum number of headers
+        // Optional white space, then the value up to the end of the line
+        const char* value_start = key_end + 1;
+        while (value_start < headers_end && (*value_start == ' ' || *value_start == '\t')) {
+            ++value_start;
         }
-        output -> headers[count] = current_header;
-        count++;
-        output -> num_headers = count;
+        const char* value_end = http_scan_line_end(value_start, headers_end);
+        if ((size_t) (headers_end - value_end) < line_delim_len
+            || memcmp(value_end, HTTP_LINE_DELIM, line_delim_len)) {
+            return ERR_INVALID_ARGUMENT; // control character in the value
+        }
+        current_header->value.val = value_start;
+        current_header->value.len = (size_t) (value_end - value_start);
+
+        output -> num_headers++;
+        current_pos = value_end + line_delim_len;
     }
 
-    // Return the position of the last header
-    return output->headers[count-1].key.val;
+    return ERR_NONE;
 }
 
+// Reads the value of the Content-Length header, 0 if absent
+static int http_parse_content_len(const struct http_message* msg, size_t* content_len) {
+    *content_len = 0;
 
-// Parses an HTTP message
-int http_parse_message(const char *stream,
-                       size_t bytes_received,
-                       struct http_message *out,
-                       int *content_len) {
-
-    M_REQUIRE_NON_NULL(stream);
-    M_REQUIRE_NON_NULL(out);
-    M_REQUIRE_NON_NULL(content_len);
+    for (size_t i = 0; i < msg->num_headers; i++) {
+        const struct http_header *header = &msg->headers[i];
 
-    if(bytes_received == 0){
-        return ERR_INVALID_ARGUMENT;
+        //looking for the argument Content-Length in the headers
+        if (http_match_verb(&header->key, "Content-Length")) {
+            if (header->value.len == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            size_t value = 0;
+            for (size_t j = 0; j < header->value.len; ++j) {
+                const char c = header->value.val[j];
+                if (c < '0' || c > '9' || value > (size_t) INT_MAX / 10) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+                value = 10 * value + (size_t) (c - '0');
+            }
+            if (value > (size_t) INT_MAX) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            *content_len = value;
+            return ERR_NONE;
+        }
     }
+    return ERR_NONE;
+}
 
-    const char *current_pos = stream;
-    const char *headers_end;
+// Parses the request line and the headers, which end at headers_end
+static int http_parse_head(const char* stream, const char* headers_end,
+                           struct http_message* out) {
+    const char* current_pos = stream;
     struct http_string token;
 
-    // Verify headers are completely received
-    headers_end = strstr(current_pos, HTTP_HDR_END_DELIM);
-    if (headers_end == NULL) {
-        return 0;  // Headers incomplete
-    }
-
-    // Verify headers are completely received
-    current_pos = get_next_token(current_pos, " ", &out->method);
+    // Parsing the method
+    current_pos = get_next_token(current_pos, headers_end, " ", &out->method);
     if (current_pos == NULL) {
         return ERR_INVALID_ARGUMENT;  //Parsing Error
     }
 
     // Parsing the URI and checking if it is valid
-    current_pos = get_next_token(current_pos, " ", &out->uri);
+    current_pos = get_next_token(current_pos, headers_end, " ", &out->uri);
     if (current_pos == NULL) {
         return ERR_INVALID_ARGUMENT;  //Parsing Error
     }
 
     // Parse the HTTP version
-    current_pos = get_next_token(current_pos, HTTP_LINE_DELIM, &token);
-    if (current_pos == NULL || strncmp(token.val, "HTTP/1.1", token.len) != 0) {
+    current_pos = get_next_token(current_pos, headers_end, HTTP_LINE_DELIM, &token);
+    if (current_pos == NULL || !http_match_verb(&token, "HTTP/1.1")) {
         return ERR_INVALID_ARGUMENT;  // Parsing Error
     }
 
     //parsing all the headers and storing them in the out struct
-    current_pos = http_parse_headers(current_pos, out);
-    if (current_pos == NULL) {
-        return ERR_INVALID_ARGUMENT;  // Parsing headers error
-    }
+    return http_parse_headers(current_pos, headers_end, out);
+}
 
+// Moves the pointers of msg from a buffer starting at old_base to one at new_base
+static void http_message_rebase(struct http_message* msg,
+                                const char* old_base, const char* new_base) {
+#define REBASE(str) \
+    if ((str).val != NULL) \
+        (str).val = new_base + ((uintptr_t) (str).val - (uintptr_t) old_base)
+
+    REBASE(msg->method);
+    REBASE(msg->uri);
+    for (size_t i = 0; i < msg->num_headers; ++i) {
+        REBASE(msg->headers[i].key);
+        REBASE(msg->headers[i].value);
+    }
+    REBASE(msg->body);
+#undef REBASE
+}
 
-    *content_len = 0;
+// Resets the parser for a new message
+void http_parser_init(struct http_parser* parser) {
+    if (parser == NULL) return;
+    memset(parser, 0, sizeof(*parser));
+    parser->state = HTTP_PARSE_HEADERS;
+}
 
-    for (size_t i = 0; i < out->num_headers; i++) {
-        struct http_header *header = &out->headers[i];
+// Resumes parsing an HTTP message
+int http_parser_feed(struct http_parser* parser,
+                     const char* stream,
+                     size_t bytes_received,
+                     struct http_message* out) {
+    M_REQUIRE_NON_NULL(parser);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
 
-        //looking for the argument Content-Length in the headers
-        if (strncmp(header->key.val, "Content-Length", header->key.len) == 0 &&
-            header->key.len == strlen("Content-Length")) {
-            char content_len_str[header->value.len + 1];
+    if (parser->state == HTTP_PARSE_HEADERS) {
+        const size_t delim_len = strlen(HTTP_HDR_END_DELIM);
+        const char* scan_start = stream + MIN(parser->scan_pos, bytes_received);
+
+        // Only the bytes received since the last call are scanned
+        const char* stream_end = stream + bytes_received;
+        const char* headers_end = http_scan_headers_end(scan_start, stream_end);
+        if (headers_end == stream_end) {
+            // a terminator may start in the last delim_len - 1 bytes
+            parser->scan_pos = bytes_received >= delim_len ? bytes_received - delim_len + 1 : 0;
+            return 0;  // Headers incomplete
+        }
 
-            //copying the value of the header in a string
-            memcpy(content_len_str, header->value.val, header->value.len);
-            content_len_str[header->value.len] = '\0';
-            *content_len = atoi(content_len_str);//converting the string to an int
-            break;
+        memset(out, 0, sizeof(*out));
+        // The header lines keep their CRLF, the blank line is left out
+        int err = http_parse_head(stream, headers_end + strlen(HTTP_LINE_DELIM), out);
+        if (err == ERR_NONE) {
+            err = http_parse_content_len(out, &parser->content_len);
         }
-    }
-    // Parsing the body if present
-    if (*content_len > 0) {
-        size_t headers_size = headers_end + strlen(HTTP_HDR_END_DELIM) - stream;
-        if (bytes_received < headers_size + *content_len) {
-            return 0;  // Incomplete body
+        if (err != ERR_NONE) {
+            return err;
         }
-        out->body.val = headers_end + strlen(HTTP_HDR_END_DELIM);
-        out->body.len = *content_len;
+
+        parser->headers_len = (size_t) (headers_end - stream) + delim_len;
+        parser->base = stream;
+        parser->state = HTTP_PARSE_BODY;
+    } else if (stream != parser->base) {
+        // The caller moved the bytes already parsed to a bigger buffer
+        http_message_rebase(out, parser->base, stream);
+        parser->base = stream;
+    }
+
+    // Headers are parsed only once: afterwards, only body bytes are counted
+    if (bytes_received < parser->headers_len + parser->content_len) {
+        return 0;  // Incomplete body
+    }
+
+    if (parser->content_len > 0) {
+        out->body.val = stream + parser->headers_len;
+        out->body.len = parser->content_len;
     } else {
         // no body or empty body
         out->body.val = NULL;
         out->body.len = 0;
     }
+    parser->state = HTTP_PARSE_DONE;
     return 1;  // full message have been parsed
 }
 
+// Parses an HTTP message in one go
+int http_parse_message(const char *stream,
+                       size_t bytes_received,
+                       struct http_message *out,
+                       int *content_len) {
 
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(content_len);
 
+    if(bytes_received == 0){
+        return ERR_INVALID_ARGUMENT;
+    }
 
-
-
-
-
-
+    struct http_parser parser;
+    http_parser_init(&parser);
+    const int ret = http_parser_feed(&parser, stream, bytes_received, out);
+    *content_len = (int) parser.content_len;
+    return ret;
+}
@@ -8,15 +8,23 @@
 #pragma once
 
 #define MAX_HEADERS 40
+#define MAX_RANGES  8 // in a Range header
 
 #define HTTP_HDR_KV_DELIM  ": "
 #define HTTP_LINE_DELIM    "\r\n"
 #define HTTP_HDR_END_DELIM HTTP_LINE_DELIM HTTP_LINE_DELIM
 #define HTTP_PROTOCOL_ID   "HTTP/1.1 "
+#define HTTP_CONTINUE      "100 Continue"
 #define HTTP_OK            "200 OK"
+#define HTTP_PARTIAL       "206 Partial Content"
+#define HTTP_NOT_MODIFIED  "304 Not Modified"
 #define HTTP_BAD_REQUEST   "400 Bad Request"
+#define HTTP_NOT_FOUND     "404 Not Found"
+#define HTTP_UNSATISFIABLE "416 Range Not Satisfiable"
+#define HTTP_UNAVAILABLE   "503 Service Unavailable"
 
 #include <stddef.h>
+#include <stdint.h> // uint64_t
 
 struct http_string {
     const char *val; // Warning! This is *NOT* null-terminated (thus len field below)
@@ -28,6 +36,12 @@ struct http_header {
     struct http_string value;
 };
 
+// Bytes first to last (included) of a content
+struct http_range {
+    uint64_t first;
+    uint64_t last;
+};
+
 struct http_message {
     struct http_string method;
     struct http_string uri;
@@ -36,6 +50,23 @@ struct http_message {
     struct http_string body;
 };
 
+enum http_parse_state {
+    HTTP_PARSE_HEADERS, // looking for the end of the headers
+    HTTP_PARSE_BODY,    // headers parsed, waiting for content_len body bytes
+    HTTP_PARSE_DONE
+};
+
+/**
+ * @brief State of a resumable HTTP parser, kept between two reads.
+ */
+struct http_parser {
+    enum http_parse_state state;
+    const char *base;   // stream the parsed http_strings point into
+    size_t scan_pos;    // where to resume looking for the end of the headers
+    size_t headers_len; // request line and headers, final blank line included
+    size_t content_len;
+};
+
 /**
  * @brief Checks whether the `message` URI starts with the provided `target_uri`.
  *
@@ -60,9 +91,35 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
  */
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
 
+/**
+ * @brief Prepares parser for a new message.
+ */
+void http_parser_init(struct http_parser *parser);
+
+/**
+ * @brief Resumes parsing a message from a growing stream.
+ *
+ * stream holds the bytes_received bytes received so far; the bytes given
+ * on a previous call must be unchanged but may have been moved to another
+ * buffer. The headers are parsed exactly once, afterwards only the number
+ * of body bytes is checked. The message occupies
+ * parser->headers_len + parser->content_len bytes of the stream.
+ *
+ * Returns:
+ *  a negative int if there was an error
+ *  0 if the message has not been received completely
+ *  1 if the message was fully received and parsed into out
+ */
+int http_parser_feed(struct http_parser *parser, const char *stream, size_t bytes_received,
+                     struct http_message *out);
+
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
  *
+ * Only the url->len first characters of the URL are searched, and `name`
+ * has to directly follow its '?' or a '&'. The value, at most out_len
+ * characters, is followed by a '\0' in out.
+ *
  * Return the length of the value.
  * 0 or negative return values indicate an error.
  */
@@ -72,3 +129,29 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
  * @brief Compare method with verb and return 1 if they are equal, 0 otherwise
  */
 int http_match_verb(const struct http_string* method, const char* verb);
+
+/**
+ * @brief Returns the value of the first header named `key` (case-insensitive),
+ *        NULL if the message has none.
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* key);
+
+/**
+ * @brief Parses the value of a Range header ("bytes=0-99,200-,-50") for a
+ *        content of size bytes. Ranges starting past its end are dropped,
+ *        the others end at its end at most.
+ *
+ * @return The number of ranges written to ranges, 0 if none is satisfiable,
+ *         or ERR_INVALID_ARGUMENT if the value is not a byte range or has
+ *         more than max_ranges ranges: the header is then to be ignored.
+ */
+int http_parse_range(const struct http_string* value, uint64_t size,
+                     struct http_range ranges[], size_t max_ranges);
+
+/**
+ * @brief Tells whether the value of an If-None-Match header lists etag
+ *        (weak comparison, as for this header) or is "*".
+ *
+ * @return 1 if it does, 0 if it does not.
+ */
+int http_etag_match(const struct http_string* value, const char* etag);
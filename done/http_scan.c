@@ -0,0 +1,318 @@
+/*
+ * @file http_scan.c
+ * @brief Vectorized scanning primitives for the HTTP parser
+ *
+ * The SIMD versions only look for candidate bytes; when a range used to
+ * find them is wider than the exact set (SSE4.2 token scan), the candidate
+ * is checked against the lookup table before being returned.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+#define HEADERS_END "\r\n\r\n"
+#define HEADERS_END_LEN 4
+
+typedef const char* (*scan_fn)(const char* start, const char* end);
+
+struct scan_impl {
+    const char* name;
+    scan_fn token_end;
+    scan_fn line_end;
+    scan_fn headers_end;
+};
+
+static unsigned char token_table[256];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static const struct scan_impl* current = NULL;
+
+/*******************************************************************
+ * Token characters (RFC 9110, section 5.6.2)
+ */
+static void init_token_table(void)
+{
+    for (int c = '0'; c <= '9'; ++c) token_table[c] = 1;
+    for (int c = 'a'; c <= 'z'; ++c) token_table[c] = 1;
+    for (int c = 'A'; c <= 'Z'; ++c) token_table[c] = 1;
+    for (const char* p = "!#$%&'*+-.^_`|~"; *p != '\0'; ++p) {
+        token_table[(unsigned char) *p] = 1;
+    }
+}
+
+static int is_line_end(unsigned char c)
+{
+    return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+/*******************************************************************
+ * Plain C versions, also used for the tails of the SIMD ones
+ */
+static const char* scalar_token_end(const char* p, const char* end)
+{
+    while (p < end && token_table[(unsigned char) *p]) ++p;
+    return p;
+}
+
+static const char* scalar_line_end(const char* p, const char* end)
+{
+    while (p < end && !is_line_end((unsigned char) *p)) ++p;
+    return p;
+}
+
+static const char* scalar_headers_end(const char* p, const char* end)
+{
+    while (end - p >= HEADERS_END_LEN) {
+        const char* cr = memchr(p, '\r', (size_t) (end - p) - HEADERS_END_LEN + 1);
+        if (cr == NULL) {
+            break;
+        }
+        if (!memcmp(cr, HEADERS_END, HEADERS_END_LEN)) {
+            return cr;
+        }
+        p = cr + 1;
+    }
+    return end;
+}
+
+// Returns the "\r\n\r\n" starting at one of the '\r' flagged in mask, if any
+static const char* match_headers_end(const char* block, unsigned mask, const char* end)
+{
+    while (mask != 0) {
+        const char* cr = block + __builtin_ctz(mask);
+        if (end - cr >= HEADERS_END_LEN && !memcmp(cr, HEADERS_END, HEADERS_END_LEN)) {
+            return cr;
+        }
+        mask &= mask - 1;
+    }
+    return NULL;
+}
+
+#if HAVE_X86_SIMD
+/*******************************************************************
+ * SSE4.2: PCMPESTRI with byte ranges, as done by picohttpparser
+ */
+
+// Non-token bytes; [0x7b, 0xff] also covers '|' and '~', hence the check
+static const char sse42_token_ranges[16] =
+    "\x00\x20\x22\x22\x28\x29\x2c\x2c\x2f\x2f\x3a\x40\x5b\x5d\x7b\xff";
+// Control characters except horizontal tab
+static const char sse42_line_ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+__attribute__((target("sse4.2")))
+static const char* sse42_token_end(const char* p, const char* end)
+{
+    const __m128i ranges = _mm_loadu_si128((const __m128i*) (const void*) sse42_token_ranges);
+    while (end - p >= 16) {
+        const __m128i block = _mm_loadu_si128((const __m128i*) (const void*) p);
+        const int idx = _mm_cmpestri(ranges, 16, block, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx == 16) {
+            p += 16;
+            continue;
+        }
+        p += idx;
+        if (!token_table[(unsigned char) *p]) {
+            return p;
+        }
+        ++p;
+    }
+    return scalar_token_end(p, end);
+}
+
+__attribute__((target("sse4.2")))
+static const char* sse42_line_end(const char* p, const char* end)
+{
+    const __m128i ranges = _mm_loadu_si128((const __m128i*) (const void*) sse42_line_ranges);
+    while (end - p >= 16) {
+        const __m128i block = _mm_loadu_si128((const __m128i*) (const void*) p);
+        const int idx = _mm_cmpestri(ranges, 6, block, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) {
+            return p + idx;
+        }
+        p += 16;
+    }
+    return scalar_line_end(p, end);
+}
+
+__attribute__((target("sse4.2")))
+static const char* sse42_headers_end(const char* p, const char* end)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (end - p >= 16) {
+        const __m128i block = _mm_loadu_si128((const __m128i*) (const void*) p);
+        const unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, cr));
+        const char* found = match_headers_end(p, mask, end);
+        if (found != NULL) {
+            return found;
+        }
+        p += 16;
+    }
+    return scalar_headers_end(p, end);
+}
+
+/*******************************************************************
+ * AVX2: 32 bytes at a time, byte classes built from comparisons.
+ * Every AVX2 CPU has SSE4.2, which handles the shorter tails.
+ */
+
+// Unsigned lo <= b <= hi, on every byte
+#define AVX2_IN_RANGE(b, lo, hi) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(b, _mm256_set1_epi8((char) (lo))), \
+                                      _mm256_set1_epi8((char) ((hi) - (lo)))), \
+                      _mm256_sub_epi8(b, _mm256_set1_epi8((char) (lo))))
+#define AVX2_EQ(b, c) _mm256_cmpeq_epi8(b, _mm256_set1_epi8((char) (c)))
+
+__attribute__((target("avx2")))
+static const char* avx2_token_end(const char* p, const char* end)
+{
+    while (end - p >= 32) {
+        const __m256i b = _mm256_loadu_si256((const __m256i*) (const void*) p);
+        __m256i bad = _mm256_or_si256(AVX2_IN_RANGE(b, 0x00, 0x20), AVX2_IN_RANGE(b, 0x7f, 0xff));
+        bad = _mm256_or_si256(bad, AVX2_EQ(b, 0x22));
+        bad = _mm256_or_si256(bad, AVX2_IN_RANGE(b, 0x28, 0x29));
+        bad = _mm256_or_si256(bad, AVX2_EQ(b, 0x2c));
+        bad = _mm256_or_si256(bad, AVX2_EQ(b, 0x2f));
+        bad = _mm256_or_si256(bad, AVX2_IN_RANGE(b, 0x3a, 0x40));
+        bad = _mm256_or_si256(bad, AVX2_IN_RANGE(b, 0x5b, 0x5d));
+        bad = _mm256_or_si256(bad, AVX2_EQ(b, 0x7b));
+        bad = _mm256_or_si256(bad, AVX2_EQ(b, 0x7d));
+        const unsigned mask = (unsigned) _mm256_movemask_epi8(bad);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return sse42_token_end(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* avx2_line_end(const char* p, const char* end)
+{
+    while (end - p >= 32) {
+        const __m256i b = _mm256_loadu_si256((const __m256i*) (const void*) p);
+        const __m256i ctl = _mm256_andnot_si256(AVX2_EQ(b, '\t'), AVX2_IN_RANGE(b, 0x00, 0x1f));
+        const unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_or_si256(ctl, AVX2_EQ(b, 0x7f)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return sse42_line_end(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* avx2_headers_end(const char* p, const char* end)
+{
+    while (end - p >= 32) {
+        const __m256i b = _mm256_loadu_si256((const __m256i*) (const void*) p);
+        const unsigned mask = (unsigned) _mm256_movemask_epi8(AVX2_EQ(b, '\r'));
+        const char* found = match_headers_end(p, mask, end);
+        if (found != NULL) {
+            return found;
+        }
+        p += 32;
+    }
+    return sse42_headers_end(p, end);
+}
+#endif
+
+/*******************************************************************
+ * Dispatch
+ */
+static const struct scan_impl impls[NB_HTTP_SCAN_IMPLS] = {
+    [HTTP_SCAN_SCALAR] = { "scalar", scalar_token_end, scalar_line_end, scalar_headers_end },
+#if HAVE_X86_SIMD
+    [HTTP_SCAN_SSE42]  = { "sse4.2", sse42_token_end, sse42_line_end, sse42_headers_end },
+    [HTTP_SCAN_AVX2]   = { "avx2", avx2_token_end, avx2_line_end, avx2_headers_end },
+#endif
+};
+
+static int impl_supported(enum http_scan_impl impl)
+{
+    switch (impl) {
+    case HTTP_SCAN_SCALAR:
+        return 1;
+#if HAVE_X86_SIMD
+    case HTTP_SCAN_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case HTTP_SCAN_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void init_scan(void)
+{
+    init_token_table();
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+#endif
+    // Header names and values are mostly shorter than 32 bytes: one PCMPESTRI
+    // beats the AVX2 comparison chains there (see http-parse-bench)
+    static const enum http_scan_impl preference[] = { HTTP_SCAN_SSE42, HTTP_SCAN_AVX2 };
+    enum http_scan_impl best = HTTP_SCAN_SCALAR;
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); ++i) {
+        if (impl_supported(preference[i])) {
+            best = preference[i];
+            break;
+        }
+    }
+    __atomic_store_n(&current, &impls[best], __ATOMIC_RELEASE);
+}
+
+static const struct scan_impl* get_impl(void)
+{
+    const struct scan_impl* impl = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    if (impl == NULL) {
+        pthread_once(&init_once, init_scan);
+        impl = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    }
+    return impl;
+}
+
+int http_scan_select(enum http_scan_impl impl)
+{
+    pthread_once(&init_once, init_scan);
+    if (impl == HTTP_SCAN_AUTO) {
+        init_scan();
+        return ERR_NONE;
+    }
+    if (impl < 0 || impl >= NB_HTTP_SCAN_IMPLS || !impl_supported(impl)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    __atomic_store_n(&current, &impls[impl], __ATOMIC_RELEASE);
+    return ERR_NONE;
+}
+
+const char* http_scan_impl_name(void)
+{
+    return get_impl()->name;
+}
+
+const char* http_scan_token_end(const char* start, const char* end)
+{
+    return get_impl()->token_end(start, end);
+}
+
+const char* http_scan_line_end(const char* start, const char* end)
+{
+    return get_impl()->line_end(start, end);
+}
+
+const char* http_scan_headers_end(const char* start, const char* end)
+{
+    return get_impl()->headers_end(start, end);
+}
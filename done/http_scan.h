@@ -0,0 +1,49 @@
+/**
+ * @file http_scan.h
+ * @brief Vectorized scanning primitives for the HTTP parser.
+ *
+ * Each function looks at [start, end) and returns a pointer to the first
+ * byte of interest, or end if there is none. On first use, the SSE4.2
+ * version is selected if the running CPU supports it, plain C otherwise;
+ * the AVX2 one can be selected explicitly.
+ */
+
+#pragma once
+
+enum http_scan_impl {
+    HTTP_SCAN_AUTO,   // preferred one supported by the CPU
+    HTTP_SCAN_SCALAR,
+    HTTP_SCAN_SSE42,
+    HTTP_SCAN_AVX2,
+    NB_HTTP_SCAN_IMPLS
+};
+
+/**
+ * @brief First byte that cannot be part of a token (RFC 9110 tchar),
+ *        e.g. the ':' ending a header name.
+ */
+const char* http_scan_token_end(const char* start, const char* end);
+
+/**
+ * @brief First control character other than horizontal tab,
+ *        e.g. the '\r' ending a header value.
+ */
+const char* http_scan_line_end(const char* start, const char* end);
+
+/**
+ * @brief Start of the first "\r\n\r\n" (end if not found).
+ */
+const char* http_scan_headers_end(const char* start, const char* end);
+
+/**
+ * @brief Selects an implementation, mainly for benchmarks.
+ *
+ * @return Some error code. 0 if no error, ERR_INVALID_ARGUMENT if the
+ *         CPU does not support it.
+ */
+int http_scan_select(enum http_scan_impl impl);
+
+/**
+ * @brief Name of the implementation in use.
+ */
+const char* http_scan_impl_name(void);
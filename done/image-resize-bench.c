@@ -0,0 +1,171 @@
+/*
+ * @file image-resize-bench.c
+ * @brief Measures the latency and peak memory of creating the small and
+ *        thumb variants of JPEG images, decoding the full original
+ *        (vips_jpegload_buffer + vips_thumbnail_image) or with
+ *        shrink-on-load (vips_thumbnail_buffer)
+ *
+ * Each measurement runs in its own process, so that the peak memory of
+ * one does not hide the one of the next.
+ *
+ * Usage: image-resize-bench [iterations] [image.jpg ...]
+ *        (default: the JPEG images of provided/tests/data)
+ */
+
+#include "error.h"
+#include "util.h" // SIZE_T_FMT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vips/vips.h>
+
+#define DEFAULT_ITERATIONS 20
+#define DATA_DIR "../provided/tests/data/"
+
+static const char* const default_images[] = {
+    DATA_DIR "papillon.jpg", DATA_DIR "coquelicots.jpg", DATA_DIR "brouillard.jpg",
+    DATA_DIR "mure.jpg", DATA_DIR "foret.jpg"
+};
+
+// Default SMALL_RES and THUMB_RES sizes
+static const int targets[][2] = { { 256, 256 }, { 64, 64 } };
+#define NB_TARGETS (sizeof(targets) / sizeof(targets[0]))
+
+enum resize_mode {
+    MODE_FULL_DECODE,
+    MODE_SHRINK_ON_LOAD,
+    NB_MODES
+};
+
+static const char* const mode_names[NB_MODES] = { "full decode", "shrink-on-load" };
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec * 1e-6;
+}
+
+// Creates both variants of the image once, as the server does
+static int resize_once(enum resize_mode mode, void* image, size_t size)
+{
+    for (size_t t = 0; t < NB_TARGETS; ++t) {
+        VipsImage* in = NULL;
+        VipsImage* out = NULL;
+        int err;
+        if (mode == MODE_FULL_DECODE) {
+            err = vips_jpegload_buffer(image, size, &in, NULL)
+                  || vips_thumbnail_image(in, &out, targets[t][0], "height", targets[t][1], NULL);
+        } else {
+            err = vips_thumbnail_buffer(image, size, &out, targets[t][0],
+                                        "height", targets[t][1], NULL);
+        }
+
+        void* jpeg = NULL;
+        size_t jpeg_len = 0;
+        err = err || vips_jpegsave_buffer(out, &jpeg, &jpeg_len, NULL);
+        g_free(jpeg);
+        if (out != NULL) g_object_unref(out);
+        if (in != NULL) g_object_unref(in);
+        if (err) {
+            return ERR_IMGLIB;
+        }
+    }
+    return ERR_NONE;
+}
+
+// Child process: prints the average latency and the peak memory
+static int run(enum resize_mode mode, const char* argv0, void* image, size_t size,
+               unsigned long iterations)
+{
+    if (VIPS_INIT(argv0)) {
+        return ERR_IMGLIB;
+    }
+    // Each iteration must decode again
+    vips_cache_set_max(0);
+
+    const double start = now_ms();
+    for (unsigned long i = 0; i < iterations; ++i) {
+        if (resize_once(mode, image, size) != ERR_NONE) {
+            fprintf(stderr, "resize failed: %s\n", vips_error_buffer());
+            return ERR_IMGLIB;
+        }
+    }
+    const double elapsed = now_ms() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const size_t highwater = vips_tracked_get_mem_highwater();
+    printf("  %-16s %10.2f ms %12.1f MB %12.1f MB\n", mode_names[mode],
+           elapsed / (double) iterations,
+           (double) highwater / (1024.0 * 1024.0),
+           (double) usage.ru_maxrss / 1024.0);
+    fflush(stdout);
+    vips_shutdown();
+    return ERR_NONE;
+}
+
+static void* read_image(const char* filename, size_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    void* image = NULL;
+    long len = -1;
+    if (!fseek(file, 0, SEEK_END) && (len = ftell(file)) > 0 && !fseek(file, 0, SEEK_SET)) {
+        image = malloc((size_t) len);
+        if (image != NULL && fread(image, (size_t) len, 1, file) != 1) {
+            free(image);
+            image = NULL;
+        }
+    }
+    fclose(file);
+    *size = (size_t) len;
+    return image;
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+    const char* const* images = argc > 2 ? (const char* const*) (argv + 2) : default_images;
+    const size_t nb_images = argc > 2 ? (size_t) (argc - 2)
+                             : sizeof(default_images) / sizeof(default_images[0]);
+    if (iterations == 0) {
+        fprintf(stderr, "Usage: %s [iterations] [image.jpg ...]\n", argv[0]);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    printf("%lu iterations, variants %dx%d and %dx%d\n", iterations,
+           targets[0][0], targets[0][1], targets[1][0], targets[1][1]);
+    printf("  %-16s %13s %15s %15s\n", "", "latency", "vips peak", "max RSS");
+
+    for (size_t i = 0; i < nb_images; ++i) {
+        size_t size = 0;
+        void* image = read_image(images[i], &size);
+        if (image == NULL) {
+            fprintf(stderr, "cannot read %s\n", images[i]);
+            continue;
+        }
+        printf("%s (" SIZE_T_FMT " bytes)\n", images[i], size);
+        fflush(stdout);
+
+        for (int m = 0; m < NB_MODES; ++m) {
+            const pid_t pid = fork();
+            if (pid == 0) {
+                exit(run((enum resize_mode) m, argv[0], image, size, iterations) == ERR_NONE ? 0 : 1);
+            }
+            if (pid > 0) {
+                waitpid(pid, NULL, 0);
+            }
+        }
+        free(image);
+    }
+    return ERR_NONE;
+}
@@ -6,133 +6,318 @@
 #include <string.h>
 #include <stdio.h>
 
-#define NUM_IMGS 1
-
 void clean_up(VipsImage *in, VipsImage *out, void *resized_buffer, void *image_buffer) {
-    g_object_unref(in);
-    g_object_unref(out);
+    if (in != NULL) g_object_unref(in);
+    if (out != NULL) g_object_unref(out);
     free(resized_buffer);
     free(image_buffer);
 }
 
-int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t index) {
+// Frees the variants created so far
+static void free_resized(void *resized_buffers[MAX_RES], size_t resized_lengths[MAX_RES]) {
+    for (int res = 0; res < MAX_RES; ++res) {
+        free(resized_buffers[res]);
+        resized_buffers[res] = NULL;
+        resized_lengths[res] = 0;
+    }
+}
 
-    M_REQUIRE_NON_NULL(imgfs_file);
-    M_REQUIRE_NON_NULL(imgfs_file->file);
-    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+// The resized resolutions of the imgFS, largest first (the last numbered
+// first if equal, i.e. small before thumb); returns their number
+static int resized_by_size(const struct imgfs_file *imgfs_file, int order[MAX_RES]) {
+    uint32_t areas[MAX_RES];
+    int nb = 0;
+    for (int res = nb_resolutions(imgfs_file) - 1; res >= 0; --res) {
+        uint16_t width = 0, height = 0;
+        if (resolution_size(imgfs_file, res, &width, &height) != ERR_NONE) {
+            continue; // original
+        }
+        const uint32_t area = (uint32_t) width * height;
+        int i = nb++;
+        for (; i > 0 && areas[i - 1] < area; --i) {
+            areas[i] = areas[i - 1];
+            order[i] = order[i - 1];
+        }
+        areas[i] = area;
+        order[i] = res;
+    }
+    return nb;
+}
 
-    if (index >= imgfs_file->header.max_files ||
-        imgfs_file->metadata[index].is_valid == EMPTY) {
-        return ERR_INVALID_IMGID;
+// Shrink-on-load factor for the original: libjpeg decodes directly at 1/2,
+// 1/4 or 1/8 of its size. As vips_thumbnail() does, it leaves at least a
+// factor of two to the final resize, here for every resized resolution of
+// the imgFS: the decoded image is then the same whichever variants are
+// missing, hence so is each of them.
+static int load_shrink(const struct imgfs_file *imgfs_file, const struct img_metadata *metadata,
+                       const int order[MAX_RES], int nb_resized) {
+    const uint32_t orig_width = metadata->orig_res[0];
+    const uint32_t orig_height = metadata->orig_res[1];
+    int shrink = 8;
+    for (int i = 0; i < nb_resized; ++i) {
+        uint16_t width = 0, height = 0;
+        resolution_size(imgfs_file, order[i], &width, &height);
+        // Fitting in width x height: the largest of both factors
+        while (shrink > 1 && orig_width < 2u * (uint32_t) shrink * width
+               && orig_height < 2u * (uint32_t) shrink * height) {
+            shrink /= 2;
+        }
     }
+    return shrink;
+}
 
-    // Retrieve metadata for the image at the specified index
-    struct img_metadata *metadata = &imgfs_file->metadata[index];
+int create_resized_imgs(const struct imgfs_file *imgfs_file, const struct img_metadata *metadata,
+                        const struct img_ext_metadata *ext, int resolution,
+                        void *resized_buffers[MAX_RES], size_t resized_lengths[MAX_RES]) {
 
-    // Check if the requested resolution already exists
-    if ((metadata->size[resolution] != 0) || (resolution == ORIG_RES)) {
-        return ERR_NONE;
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(metadata);
+    M_REQUIRE_NON_NULL(resized_buffers);
+    M_REQUIRE_NON_NULL(resized_lengths);
+
+    if (resolution < 0 || resolution >= nb_resolutions(imgfs_file)) {
+        return ERR_RESOLUTIONS;
+    }
+
+    //initializing the resized buffers
+    for (int res = 0; res < MAX_RES; ++res) {
+        resized_buffers[res] = NULL;
+        resized_lengths[res] = 0;
     }
 
     // Load the original image from its offset
-    size_t length;
-    void *image_buffer = malloc(metadata->size[ORIG_RES]);
-    if (image_buffer == NULL) {
-        return ERR_OUT_OF_MEMORY;  // Memory allocation error
+    char *image_buffer = NULL;
+    int errcode = read_blob(imgfs_file, metadata->offset[ORIG_RES], metadata->size[ORIG_RES],
+                            &image_buffer);
+    if (errcode != ERR_NONE) {
+        return errcode;
     }
 
-    if (fseek(imgfs_file->file, metadata->offset[ORIG_RES], SEEK_SET)) {
-        free(image_buffer);
-        return ERR_IO;  // File seek error
+    // Largest first, the order they are appended in
+    int order[MAX_RES];
+    const int nb_resized = resized_by_size(imgfs_file, order);
+
+    // Load the original image from the buffer, once for all the variants
+    VipsImage *in = NULL;
+    if (vips_jpegload_buffer(image_buffer, metadata->size[ORIG_RES], &in,
+                             "shrink", load_shrink(imgfs_file, metadata, order, nb_resized),
+                             NULL)) {
+        clean_up(in, NULL, NULL, image_buffer);
+        return ERR_IMGLIB;
     }
 
-    // Read the original image from the file
-    if (fread(image_buffer, metadata->size[ORIG_RES], NUM_IMGS, imgfs_file->file) !=
-        NUM_IMGS) {
-        free(image_buffer);
-        return ERR_IO;
+    for (int i = 0; i < nb_resized; ++i) {
+        const int res = order[i];
+        if (variant_size(metadata, ext, res) != 0 || (resolution != ORIG_RES && res != resolution)) {
+            continue;
+        }
+
+        // extracting the corresponding width and height
+        uint16_t target_width = 0, target_height = 0;
+        resolution_size(imgfs_file, res, &target_width, &target_height);
+
+        VipsImage *out = NULL;
+        if (vips_thumbnail_image(in, &out, target_width, "height", (int) target_height, NULL)
+            // Saving the resized image to a buffer
+            || vips_jpegsave_buffer(out, &resized_buffers[res], &resized_lengths[res], NULL)) {
+            clean_up(in, out, NULL, image_buffer);
+            free_resized(resized_buffers, resized_lengths);
+            return ERR_IMGLIB;
+        }
+        clean_up(out, NULL, NULL, NULL);
     }
 
-    //initializing the resized buffer 
-    void *resized_buffer = NULL;
-    size_t resized_length = 0;
+    clean_up(in, NULL, NULL, image_buffer);
+    return ERR_NONE;
+}
 
-    //initializing the 
-    VipsImage *in, *out;
+int store_resized_imgs(struct imgfs_file *imgfs_file, size_t index, const unsigned char *SHA,
+                       void *const resized_buffers[MAX_RES],
+                       const size_t resized_lengths[MAX_RES]) {
 
-    // Load the original image from the buffer
-    if (vips_jpegload_buffer(image_buffer, metadata->size[ORIG_RES], &in, NULL)) {
-        clean_up(in, out, resized_buffer, image_buffer);
-        return ERR_IMGLIB;
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(resized_buffers);
+    M_REQUIRE_NON_NULL(resized_lengths);
+
+    // The slot may have been deleted, or reused, since the variants were created
+    if (index >= imgfs_file->header.max_files ||
+        imgfs_file->metadata[index].is_valid == EMPTY ||
+        memcmp(imgfs_file->metadata[index].SHA, SHA, SHA256_DIGEST_LENGTH)) {
+        return ERR_IMAGE_NOT_FOUND;
     }
 
-    // extracting the corresponding width from the header
-    int target_width = imgfs_file->header.resized_res[2 * resolution];
+    struct img_metadata *metadata = &imgfs_file->metadata[index];
+    struct img_ext_metadata *ext = ext_metadata(imgfs_file, index);
+
+    // In the order they were created, largest first
+    int order[MAX_RES];
+    const int nb_resized = resized_by_size(imgfs_file, order);
+    for (int i = 0; i < nb_resized; ++i) {
+        const int res = order[i];
+        // Not created, or someone else already stored it
+        if (resized_buffers[res] == NULL || variant_size(metadata, ext, res) != 0) {
+            continue;
+        }
+        if (resized_lengths[res] > UINT32_MAX) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        // Write the resized image at the end of the file
+        uint64_t offset = 0;
+        const int errcode = append_content(imgfs_file, resized_buffers[res], resized_lengths[res],
+                                           &offset);
+        if (errcode != ERR_NONE) {
+            return errcode;
+        }
+
+        // updating the metadata of the image
+        set_variant(metadata, ext, res, (uint32_t) resized_lengths[res], offset);
+    }
+    return ERR_NONE;
+}
 
-    // extracting the corresponding height from the header
-    int target_height = imgfs_file->header.resized_res[2 * resolution + 1];
+int commit_resized_imgs(struct imgfs_file *imgfs_file, size_t index, const unsigned char *SHA,
+                        void *const resized_buffers[MAX_RES],
+                        const size_t resized_lengths[MAX_RES]) {
 
-    // Create a thumbnail of the image at the desired resolution
-    if (vips_thumbnail_image(in, &out, target_width, "height", target_height, NULL)) {
-        clean_up(in, out, resized_buffer, image_buffer);
-        return ERR_IMGLIB;
+    int errcode = store_resized_imgs(imgfs_file, index, SHA, resized_buffers, resized_lengths);
+    if (errcode != ERR_NONE) {
+        return errcode;
     }
 
-    // Saving the resized image to a buffer
-    if (vips_jpegsave_buffer(out, &resized_buffer, &resized_length, NULL)) {
-        clean_up(in, out, resized_buffer, image_buffer);
-        return ERR_IMGLIB;
+    // Content first: it must be readable once the metadata points to it
+    if (fflush(imgfs_file->file)) {
+        return ERR_IO;
     }
 
-    // initializing the position of the file pointer to the end of the file
-    if (fseek(imgfs_file->file, 0, SEEK_END)) {
-        clean_up(in, out, resized_buffer, image_buffer);
-        return ERR_IO;  // File seek error
+    // One write of the slot for all the variants
+    errcode = write_metadata(imgfs_file, index);
+    if (errcode != ERR_NONE) {
+        return errcode;
     }
 
-    uint64_t offset = ftell(imgfs_file->file);
+    return fflush(imgfs_file->file) ? ERR_IO : ERR_NONE;
+}
 
-    // Write the resized image to the file
-    if (fwrite(resized_buffer, resized_length, NUM_IMGS, imgfs_file->file) != NUM_IMGS) {
-        clean_up(in, out, resized_buffer, image_buffer);
-        return ERR_IO;
-    }
+int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t index) {
 
-    // updating the metadata of the image
-    metadata->offset[resolution] = offset;
-    metadata->size[resolution] = resized_length;
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
 
+    if (index >= imgfs_file->header.max_files ||
+        imgfs_file->metadata[index].is_valid == EMPTY) {
+        return ERR_INVALID_IMGID;
+    }
+    if (resolution < 0 || resolution >= nb_resolutions(imgfs_file)) {
+        return ERR_RESOLUTIONS;
+    }
 
-    // fiding the position of the metadata of the image in the file
-    int metadata_file_pointer =
-            sizeof(struct imgfs_header) + index * sizeof(struct img_metadata);
+    // Retrieve metadata for the image at the specified index
+    const struct img_metadata *metadata = &imgfs_file->metadata[index];
+    const struct img_ext_metadata *ext = ext_metadata(imgfs_file, index);
 
-    // moving the file pointer to the metadata of the image
-    if (fseek(imgfs_file->file, metadata_file_pointer, SEEK_SET)) {
-        clean_up(in, out, resized_buffer, image_buffer);
-        return ERR_IO;  // File seek error
+    // Check if the requested resolution already exists
+    if ((resolution == ORIG_RES) || (variant_size(metadata, ext, resolution) != 0)) {
+        return ERR_NONE;
     }
 
-    // writing the metadata of the image to the file
-    if (fwrite(metadata, sizeof(struct img_metadata), NUM_IMGS, imgfs_file->file)
-            !=  NUM_IMGS) {
-        clean_up(in, out, resized_buffer, image_buffer);
-        return ERR_IO;
+    // Only the requested one: the command line reads one image per run
+    void *resized_buffers[MAX_RES];
+    size_t resized_lengths[MAX_RES];
+    int errcode = create_resized_imgs(imgfs_file, metadata, ext, resolution,
+                                      resized_buffers, resized_lengths);
+    if (errcode == ERR_NONE) {
+        errcode = commit_resized_imgs(imgfs_file, index, metadata->SHA,
+                                      resized_buffers, resized_lengths);
+        free_resized(resized_buffers, resized_lengths);
     }
+    return errcode;
+}
 
-    // Clean up
-    clean_up(in, out, resized_buffer, image_buffer);
+// ======================================================================
+#define JPEG_MARKER 0xFF
+#define JPEG_SOI    0xD8 // start of image
+#define JPEG_SOS    0xDA // start of scan: no frame header after it
+#define JPEG_TEM    0x01
+#define JPEG_RST0   0xD0
+#define JPEG_RST7   0xD7
+
+// SOF0 to SOF15, except DHT (C4), JPG (C8) and DAC (CC), which share the range
+static int is_sof(unsigned marker) {
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+}
 
-    return ERR_NONE;
+static uint16_t read_be16(const unsigned char *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+/**
+ * @brief Reads the dimensions from the frame header (SOFn segment) of a
+ *        JPEG, without decoding anything.
+ *
+ * @return 1 if found, 0 if the buffer is not a JPEG this parser understands.
+ */
+static int jpeg_frame_size(const unsigned char *buffer, size_t size,
+                           uint32_t *height, uint32_t *width) {
+    if (size < 4 || buffer[0] != JPEG_MARKER || buffer[1] != JPEG_SOI) {
+        return 0;
+    }
+
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (buffer[pos] != JPEG_MARKER) {
+            return 0;
+        }
+        const unsigned marker = buffer[pos + 1];
+        if (marker == JPEG_MARKER) {
+            ++pos; // fill byte
+            continue;
+        }
+        if (marker == JPEG_TEM || (marker >= JPEG_RST0 && marker <= JPEG_RST7)) {
+            pos += 2; // no length
+            continue;
+        }
+        if (marker == JPEG_SOS) {
+            return 0;
+        }
+
+        // The length includes itself but not the marker
+        const size_t length = read_be16(buffer + pos + 2);
+        if (length < 2 || pos + 2 + length > size) {
+            return 0;
+        }
+
+        if (is_sof(marker)) {
+            // precision (1 byte), height, width (2 bytes each)
+            if (length < 7) {
+                return 0;
+            }
+            *height = read_be16(buffer + pos + 5);
+            *width = read_be16(buffer + pos + 7);
+            // A height of 0 is defined later by a DNL segment
+            return *height != 0 && *width != 0;
+        }
+        pos += 2 + length;
+    }
+    return 0;
 }
 
-// ======================================================================
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
                    size_t image_size) {
     M_REQUIRE_NON_NULL(height);
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    // Most images: straight from the header
+    if (jpeg_frame_size((const unsigned char *) image_buffer, image_size, height, width)) {
+        return ERR_NONE;
+    }
+
+    // Odd ones: let vips decide
     VipsImage *original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
@@ -19,6 +19,8 @@ extern "C" {
 /**
  * @brief Gets the resolution of an image.
  *
+ * Read from the JPEG frame header when possible, through vips otherwise.
+ *
  * @param height Where to put the calculated image height.
  * @param width Where to put the calculated image width.
  * @param filename The image file name.
@@ -27,15 +29,70 @@ extern "C" {
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
 
 /**
- * @brief Calls the create_resized_img function and updates the metadata on the disk
+ * @brief Calls the create_resized_imgs function and updates the metadata on the disk
  *
- * @param resolution
+ * @param resolution Any resolution of the imgFS (nothing to do for ORIG_RES)
  * @param imgfs_file The main in-memory structure
  * @param index The index of the image in the metadata array
  * @return Some error code. 0 if no error.
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief Reads the original of an image once and encodes its missing
+ *        variants (the ones of size 0 in metadata), largest first.
+ *
+ * The original is decoded once for all of them, with shrink-on-load: directly
+ * at the smallest scale libjpeg provides that leaves at least a factor of two
+ * to the largest resized resolution of the imgFS.
+ *
+ * Does not modify the imgFS, hence may run without holding any lock as
+ * long as metadata is a copy: original content is never overwritten.
+ *
+ * @param imgfs_file The main in-memory structure (for the target sizes)
+ * @param metadata The metadata of the image
+ * @param ext Its additional metadata (NULL if the imgFS has none)
+ * @param resolution A resized resolution for that variant only,
+ *        ORIG_RES for all the missing ones
+ * @param resized_buffers For each resized resolution, the newly allocated
+ *        JPEG content, or NULL if the variant was not missing
+ * @param resized_lengths Their sizes
+ * @return Some error code. 0 if no error; on error, nothing is allocated.
+ */
+int create_resized_imgs(const struct imgfs_file* imgfs_file, const struct img_metadata* metadata,
+                        const struct img_ext_metadata* ext, int resolution,
+                        void* resized_buffers[MAX_RES], size_t resized_lengths[MAX_RES]);
+
+/**
+ * @brief Appends the variants made by create_resized_imgs() and records them
+ *        in the in-memory metadata only. The stream is not flushed and the
+ *        slot is not written: see commit_resized_imgs().
+ *
+ * Same parameters and return values as commit_resized_imgs().
+ */
+int store_resized_imgs(struct imgfs_file* imgfs_file, size_t index, const unsigned char* SHA,
+                       void* const resized_buffers[MAX_RES],
+                       const size_t resized_lengths[MAX_RES]);
+
+/**
+ * @brief Appends the variants made by create_resized_imgs() and records them
+ *        in the metadata, in memory and on disk.
+ *
+ * The variants stored in the meantime are not written again.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param SHA Hash of the original the variants were made from; the slot
+ *        must still hold that image
+ * @param resized_buffers Content of the variants (NULL for none)
+ * @param resized_lengths Their sizes
+ * @return Some error code. 0 if no error, ERR_IMAGE_NOT_FOUND if the
+ *         slot no longer holds that image.
+ */
+int commit_resized_imgs(struct imgfs_file* imgfs_file, size_t index, const unsigned char* SHA,
+                        void* const resized_buffers[MAX_RES],
+                        const size_t resized_lengths[MAX_RES]);
+
 #ifdef __cplusplus
 }
 #endif
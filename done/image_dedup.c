@@ -37,6 +37,11 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index) {
                 memcpy(metadata -> offset, current_metadata -> offset, NB_RES*sizeof(uint64_t));
                 //double checking that we have exactly the same size 
                 memcpy(metadata -> size, current_metadata -> size, NB_RES*sizeof(uint32_t));
+                // and the additional resolutions already made from it
+                struct img_ext_metadata* ext = ext_metadata(imgfs_file, index);
+                if (ext != NULL) {
+                    *ext = *ext_metadata(imgfs_file, i);
+                }
                 return ERR_NONE;
             }
         }
@@ -0,0 +1,274 @@
+/*
+ * @file image_format.c
+ * @brief Encodings the resized variants can be served in
+ */
+
+#include <math.h> // fmin, round
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // strncasecmp
+#include <vips/vips.h>
+
+#include "error.h"
+#include "image_format.h"
+
+struct format_info {
+    const char* name;
+    const char* mime;
+    int max_effort;
+    int thumb_effort;   // thumbnails are small enough to afford more
+    int default_effort; // for the other resolutions
+};
+
+static const struct format_info formats[NB_FORMATS] = {
+    [FORMAT_JPEG] = { "jpeg", "image/jpeg", 0, 0, 0 },
+    [FORMAT_WEBP] = { "webp", "image/webp", 6, 6, 4 },
+    [FORMAT_AVIF] = { "avif", "image/avif", 9, 5, 3 },
+};
+
+// Set by image_format_set_effort(), plus one: 0 for the default
+static int efforts[NB_FORMATS][MAX_RES];
+
+static int encoder_effort(enum image_format format, int resolution)
+{
+    if (efforts[format][resolution] != 0) {
+        return efforts[format][resolution] - 1;
+    }
+    return resolution == THUMB_RES ? formats[format].thumb_effort : formats[format].default_effort;
+}
+
+const char* image_format_name(enum image_format format)
+{
+    return format >= 0 && format < NB_FORMATS ? formats[format].name : NULL;
+}
+
+const char* image_format_mime(enum image_format format)
+{
+    return format >= 0 && format < NB_FORMATS ? formats[format].mime : NULL;
+}
+
+enum image_format image_format_of(const void* content, size_t len)
+{
+    const unsigned char* bytes = content;
+    if (bytes == NULL || len < 12) {
+        return NB_FORMATS;
+    }
+    if (bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF) {
+        return FORMAT_JPEG;
+    }
+    if (!memcmp(bytes, "RIFF", 4) && !memcmp(bytes + 8, "WEBP", 4)) {
+        return FORMAT_WEBP;
+    }
+    // ISO BMFF: size of the first box, then "ftyp" and the major brand
+    if (!memcmp(bytes + 4, "ftypavi", 7)) {
+        return FORMAT_AVIF;
+    }
+    return NB_FORMATS;
+}
+
+/*******************************************************************
+ * Accept header: comma-separated media ranges with optional parameters,
+ * e.g. "image/avif,image/webp,image/apng;q=0.8"
+ */
+static const char* skip_spaces(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    return p;
+}
+
+// Quality of a media range, from its parameters in [p, end)
+static double range_quality(const char* p, const char* end)
+{
+    while (p < end) {
+        p = skip_spaces(p + 1, end); // skip ';'
+        if (end - p > 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+            char value[8] = {0};
+            const size_t len = (size_t) (end - p - 2) < sizeof(value) - 1
+                               ? (size_t) (end - p - 2) : sizeof(value) - 1;
+            memcpy(value, p + 2, len);
+            return strtod(value, NULL);
+        }
+        while (p < end && *p != ';') ++p;
+    }
+    return 1.0;
+}
+
+int image_format_accepted(const char* accept, size_t len, enum image_format format)
+{
+    if (format == FORMAT_JPEG) {
+        return 1;
+    }
+    if (accept == NULL || format < 0 || format >= NB_FORMATS) {
+        return 0;
+    }
+
+    const char* mime = formats[format].mime;
+    const size_t mime_len = strlen(mime);
+    const char* end = accept + len;
+    const char* p = accept;
+    while (p < end) {
+        const char* range_end = memchr(p, ',', (size_t) (end - p));
+        if (range_end == NULL) {
+            range_end = end;
+        }
+
+        p = skip_spaces(p, range_end);
+        const char* params = memchr(p, ';', (size_t) (range_end - p));
+        const char* type_end = params != NULL ? params : range_end;
+        while (type_end > p && (type_end[-1] == ' ' || type_end[-1] == '\t')) --type_end;
+
+        if ((size_t) (type_end - p) == mime_len && !strncasecmp(p, mime, mime_len)) {
+            return params == NULL || range_quality(params, range_end) > 0.0;
+        }
+        p = range_end + 1;
+    }
+    return 0;
+}
+
+int image_format_set_effort(enum image_format format, int resolution, int effort)
+{
+    if (format <= FORMAT_JPEG || format >= NB_FORMATS
+        || resolution < 0 || resolution >= MAX_RES || resolution == ORIG_RES
+        || effort < 0 || effort > formats[format].max_effort) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    efforts[format][resolution] = effort + 1;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Encoding
+ */
+static int save(VipsImage* image, enum image_format format, int effort,
+                void** buffer, size_t* length)
+{
+    switch (format) {
+    case FORMAT_JPEG:
+        return vips_jpegsave_buffer(image, buffer, length, NULL);
+    case FORMAT_WEBP:
+        return vips_webpsave_buffer(image, buffer, length, "effort", effort, NULL);
+    case FORMAT_AVIF:
+        return vips_heifsave_buffer(image, buffer, length,
+                                    "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1,
+                                    "effort", effort, NULL);
+    default:
+        return -1;
+    }
+}
+
+// Encodes the content of the imgFS at offset, fitted in width x height
+static int encode_fitted(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size,
+                         uint16_t width, uint16_t height, enum image_format format, int effort,
+                         void** buffer, size_t* length)
+{
+    char* source = NULL;
+    int errcode = read_blob(imgfs_file, offset, size, &source);
+    if (errcode != ERR_NONE) {
+        return errcode;
+    }
+
+    VipsImage* out = NULL;
+    void* content = NULL;
+    size_t content_len = 0;
+    if (vips_thumbnail_buffer(source, size, &out, width, "height", (int) height, NULL)
+        || save(out, format, effort, &content, &content_len)) {
+        errcode = ERR_IMGLIB;
+    }
+
+    if (out != NULL) g_object_unref(out);
+    free(source);
+    if (errcode != ERR_NONE) {
+        g_free(content);
+        return errcode;
+    }
+
+    // Allocated by glib: copy it so that callers can use free()
+    *buffer = malloc(content_len);
+    if (*buffer == NULL) {
+        g_free(content);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(*buffer, content, content_len);
+    *length = content_len;
+    g_free(content);
+    return ERR_NONE;
+}
+
+int create_format_variant(const struct imgfs_file* imgfs_file, const struct img_metadata* metadata,
+                          int resolution, enum image_format format,
+                          void** buffer, size_t* length)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(metadata);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(length);
+
+    uint16_t width = 0, height = 0;
+    int errcode = resolution_size(imgfs_file, resolution, &width, &height);
+    if (errcode != ERR_NONE) {
+        return errcode;
+    }
+    if (format < 0 || format >= NB_FORMATS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return encode_fitted(imgfs_file, metadata->offset[ORIG_RES], metadata->size[ORIG_RES],
+                         width, height, format, encoder_effort(format, resolution),
+                         buffer, length);
+}
+
+/*******************************************************************
+ * Variants of any size
+ */
+// Size of the image once fitted in width x height, as vips_thumbnail() does
+static void fitted_size(const struct img_metadata* metadata, uint32_t width, uint32_t height,
+                        uint32_t fitted[2])
+{
+    const double scale = fmin((double) width / metadata->orig_res[0],
+                              (double) height / metadata->orig_res[1]);
+    for (int i = 0; i < 2; ++i) {
+        const double side = round(metadata->orig_res[i] * scale);
+        fitted[i] = side < 1.0 ? 1u : (uint32_t) side;
+    }
+}
+
+int create_sized_variant(const struct imgfs_file* imgfs_file, const struct img_metadata* metadata,
+                         const struct img_ext_metadata* ext, uint16_t width, uint16_t height,
+                         enum image_format format, void** buffer, size_t* length)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(metadata);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(length);
+
+    if (width == 0 || height == 0 || format < 0 || format >= NB_FORMATS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // Decoding a smaller variant is cheaper: use the smallest stored one
+    // that is still at least as large as the result
+    int source = ORIG_RES;
+    if (metadata->orig_res[0] != 0 && metadata->orig_res[1] != 0) {
+        uint32_t target[2], best[2] = { metadata->orig_res[0], metadata->orig_res[1] };
+        fitted_size(metadata, width, height, target);
+        for (int res = 0; res < nb_resolutions(imgfs_file); ++res) {
+            uint16_t res_width = 0, res_height = 0;
+            if (variant_size(metadata, ext, res) == 0
+                || resolution_size(imgfs_file, res, &res_width, &res_height) != ERR_NONE) {
+                continue;
+            }
+            uint32_t fitted[2];
+            fitted_size(metadata, res_width, res_height, fitted);
+            if (fitted[0] >= target[0] && fitted[1] >= target[1]
+                && fitted[0] < best[0] && fitted[1] < best[1]) {
+                source = res;
+                best[0] = fitted[0];
+                best[1] = fitted[1];
+            }
+        }
+    }
+
+    return encode_fitted(imgfs_file, variant_offset(metadata, ext, source),
+                         variant_size(metadata, ext, source), width, height, format,
+                         formats[format].default_effort, buffer, length);
+}
@@ -0,0 +1,82 @@
+/**
+ * @file image_format.h
+ * @brief Encodings the resized variants can be served in.
+ *
+ * JPEG variants are stored in the imgFS. The other formats are usually
+ * 30-50% smaller for the same quality and are created on demand for the
+ * clients that accept them.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct img_metadata
+
+#include <stddef.h> // size_t
+
+enum image_format {
+    FORMAT_JPEG,
+    FORMAT_WEBP,
+    FORMAT_AVIF,
+    NB_FORMATS
+};
+
+/**
+ * @brief Short name of the format, e.g. "webp".
+ */
+const char* image_format_name(enum image_format format);
+
+/**
+ * @brief MIME type of the format, e.g. "image/webp".
+ */
+const char* image_format_mime(enum image_format format);
+
+/**
+ * @brief Format of an encoded image, from its first bytes.
+ *
+ * @return NB_FORMATS if it is none of them.
+ */
+enum image_format image_format_of(const void* content, size_t len);
+
+/**
+ * @brief Tells whether the value of an Accept header explicitly lists the
+ *        format with a non-zero quality. JPEG is always acceptable.
+ *
+ * @param accept The header value (may be NULL if there is none)
+ * @param len Its length
+ */
+int image_format_accepted(const char* accept, size_t len, enum image_format format);
+
+/**
+ * @brief Sets the encoder effort (CPU time against size) used for a
+ *        resized resolution: 0-6 for WebP, 0-9 for AVIF.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int image_format_set_effort(enum image_format format, int resolution, int effort);
+
+/**
+ * @brief Creates a resized variant of an image in the given format,
+ *        from the original (with shrink-on-load).
+ *
+ * @param imgfs_file The main in-memory structure (for the target sizes)
+ * @param metadata The metadata of the image
+ * @param resolution A resized resolution of the imgFS
+ * @param buffer Location of the newly allocated content
+ * @param length Location of its size
+ * @return Some error code. 0 if no error.
+ */
+int create_format_variant(const struct imgfs_file* imgfs_file, const struct img_metadata* metadata,
+                          int resolution, enum image_format format,
+                          void** buffer, size_t* length);
+
+/**
+ * @brief Creates a variant of an image fitting in width x height, in the
+ *        given format, from the smallest stored variant that is at least
+ *        as large as the result (or else from the original).
+ *
+ * @param ext The additional metadata of the image (may be NULL)
+ * @return Some error code. 0 if no error.
+ */
+int create_sized_variant(const struct imgfs_file* imgfs_file, const struct img_metadata* metadata,
+                         const struct img_ext_metadata* ext, uint16_t width, uint16_t height,
+                         enum image_format format, void** buffer, size_t* length);
@@ -0,0 +1,164 @@
+/*
+ * @file image_preview.c
+ * @brief Tiny previews of the images (BlurHash)
+ */
+
+#include <math.h> // cos, pow, fabs
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#include "error.h"
+#include "image_preview.h"
+
+#define PI 3.14159265358979323846
+
+static const char base83_digits[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+
+// Writes value as length base 83 digits, most significant first
+static char* base83(uint32_t value, int length, char* out)
+{
+    for (int i = length - 1; i >= 0; --i) {
+        out[i] = base83_digits[value % 83];
+        value /= 83;
+    }
+    return out + length;
+}
+
+/*******************************************************************
+ * Colour conversions
+ */
+static double srgb_to_linear(uint8_t value)
+{
+    const double v = value / 255.0;
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static uint32_t linear_to_srgb(double value)
+{
+    const double v = value < 0.0 ? 0.0 : value > 1.0 ? 1.0 : value;
+    const double srgb = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1 / 2.4) - 0.055;
+    return (uint32_t) (srgb * 255 + 0.5);
+}
+
+// Quantises an AC component to 0-18, 9 being 0
+static uint32_t quantise_ac(double value, double maximum)
+{
+    const double v = value / maximum;
+    const double q = floor(copysign(sqrt(fabs(v)), v) * 9 + 9.5);
+    return q < 0.0 ? 0u : q > 18.0 ? 18u : (uint32_t) q;
+}
+
+/*******************************************************************
+ * Encoding
+ */
+int blurhash_encode(const uint8_t* pixels, uint32_t width, uint32_t height, int bands,
+                    int x_components, int y_components, char hash[MAX_PREVIEW + 1])
+{
+    M_REQUIRE_NON_NULL(pixels);
+    M_REQUIRE_NON_NULL(hash);
+
+    if (width == 0 || height == 0 || bands < 1
+        || x_components < 1 || x_components > 9 || y_components < 1 || y_components > 9
+        || 6 + 2 * (x_components * y_components - 1) > MAX_PREVIEW) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // Components, in linear RGB
+    double factors[9 * 9][3];
+    const size_t pixel_size = (size_t) bands;
+    const size_t green = bands >= 3 ? 1 : 0, blue = bands >= 3 ? 2 : 0;
+    for (int j = 0; j < y_components; ++j) {
+        for (int i = 0; i < x_components; ++i) {
+            const double normalisation = i == 0 && j == 0 ? 1.0 : 2.0;
+            double r = 0.0, g = 0.0, b = 0.0;
+            for (uint32_t y = 0; y < height; ++y) {
+                const double basis_y = cos(PI * j * y / height);
+                for (uint32_t x = 0; x < width; ++x) {
+                    const double basis = normalisation * cos(PI * i * x / width) * basis_y;
+                    const uint8_t* p = pixels + ((size_t) y * width + x) * pixel_size;
+                    r += basis * srgb_to_linear(p[0]);
+                    g += basis * srgb_to_linear(p[green]);
+                    b += basis * srgb_to_linear(p[blue]);
+                }
+            }
+            const double scale = 1.0 / ((double) width * height);
+            double* factor = factors[j * x_components + i];
+            factor[0] = r * scale;
+            factor[1] = g * scale;
+            factor[2] = b * scale;
+        }
+    }
+
+    char* out = hash;
+    const int nb_ac = x_components * y_components - 1;
+    out = base83((uint32_t) (x_components - 1 + (y_components - 1) * 9), 1, out);
+
+    double maximum = 1.0;
+    if (nb_ac > 0) {
+        double actual_maximum = 0.0;
+        for (int k = 1; k <= nb_ac; ++k) {
+            for (int c = 0; c < 3; ++c) {
+                actual_maximum = fmax(actual_maximum, fabs(factors[k][c]));
+            }
+        }
+        const double q = floor(actual_maximum * 166 - 0.5);
+        const uint32_t quantised = q < 0.0 ? 0u : q > 82.0 ? 82u : (uint32_t) q;
+        maximum = (quantised + 1) / 166.0;
+        out = base83(quantised, 1, out);
+    } else {
+        out = base83(0, 1, out);
+    }
+
+    const uint32_t dc = (linear_to_srgb(factors[0][0]) << 16) | (linear_to_srgb(factors[0][1]) << 8)
+                        | linear_to_srgb(factors[0][2]);
+    out = base83(dc, 4, out);
+
+    for (int k = 1; k <= nb_ac; ++k) {
+        const uint32_t ac = quantise_ac(factors[k][0], maximum) * 19 * 19
+                            + quantise_ac(factors[k][1], maximum) * 19
+                            + quantise_ac(factors[k][2], maximum);
+        out = base83(ac, 2, out);
+    }
+    *out = '\0';
+    return ERR_NONE;
+}
+
+int create_preview(const char* image_buffer, size_t image_size, struct img_preview* preview)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(preview);
+
+    memset(preview, 0, sizeof(struct img_preview));
+
+    // The components only need a few pixels: libjpeg decodes at 1/8
+    VipsImage* tiny = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    const int err = vips_thumbnail_buffer((void*) image_buffer, image_size, &tiny, PREVIEW_SIZE,
+                                          "height", PREVIEW_SIZE, NULL);
+#pragma GCC diagnostic pop
+    if (err) {
+        return ERR_IMGLIB;
+    }
+
+    size_t pixels_size = 0;
+    uint8_t* pixels = vips_image_write_to_memory(tiny, &pixels_size);
+    const int width = vips_image_get_width(tiny);
+    const int height = vips_image_get_height(tiny);
+    const int bands = vips_image_get_bands(tiny);
+    g_object_unref(tiny);
+    if (pixels == NULL) {
+        return ERR_IMGLIB;
+    }
+
+    int errcode = ERR_IMGLIB;
+    if (width > 0 && height > 0 && bands > 0
+        && pixels_size == (size_t) width * (size_t) height * (size_t) bands) {
+        errcode = blurhash_encode(pixels, (uint32_t) width, (uint32_t) height, bands,
+                                  PREVIEW_X_COMPONENTS, PREVIEW_Y_COMPONENTS, preview->blurhash);
+    }
+    g_free(pixels);
+    return errcode;
+}
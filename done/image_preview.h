@@ -0,0 +1,41 @@
+/**
+ * @file image_preview.h
+ * @brief Tiny previews of the images, shown while they load.
+ *
+ * A preview is the BlurHash of the image: its average colour and a few
+ * low-frequency cosine components, encoded in base 83 in less than 32
+ * characters. Clients decode it into a blurred placeholder of any size.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct img_preview
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t, uint32_t
+
+#define PREVIEW_X_COMPONENTS 4
+#define PREVIEW_Y_COMPONENTS 3
+#define PREVIEW_SIZE 32 // the image is decoded to fit in PREVIEW_SIZE x PREVIEW_SIZE
+
+/**
+ * @brief Computes the BlurHash of an image.
+ *
+ * @param pixels width x height pixels, row after row, of bands bytes each:
+ *        red, green and blue first, or a single grey level if bands < 3
+ * @param x_components Number of horizontal components (1 to 9)
+ * @param y_components Number of vertical components (1 to 9)
+ * @param hash Where to write it, NUL-terminated
+ * @return Some error code. 0 if no error, ERR_INVALID_ARGUMENT if the hash
+ *         would be longer than MAX_PREVIEW.
+ */
+int blurhash_encode(const uint8_t* pixels, uint32_t width, uint32_t height, int bands,
+                    int x_components, int y_components, char hash[MAX_PREVIEW + 1]);
+
+/**
+ * @brief Computes the preview of a JPEG image, decoded directly at a tiny
+ *        size (shrink-on-load).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int create_preview(const char* image_buffer, size_t image_size, struct img_preview* preview);
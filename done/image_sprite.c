@@ -0,0 +1,90 @@
+/*
+ * @file image_sprite.c
+ * @brief Sprite sheets of images
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#include "error.h"
+#include "image_sprite.h"
+
+static void unref_all(VipsImage* images[], size_t nb_images)
+{
+    for (size_t i = 0; i < nb_images; ++i) {
+        if (images[i] != NULL) g_object_unref(images[i]);
+    }
+}
+
+int create_sprite(char* const images[], const uint32_t lengths[], size_t nb_images,
+                  struct sprite_tile tiles[], uint32_t* width, uint32_t* height,
+                  void** buffer, size_t* length)
+{
+    M_REQUIRE_NON_NULL(images);
+    M_REQUIRE_NON_NULL(lengths);
+    M_REQUIRE_NON_NULL(tiles);
+    M_REQUIRE_NON_NULL(width);
+    M_REQUIRE_NON_NULL(height);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(length);
+
+    if (nb_images == 0 || nb_images > MAX_SPRITE_TILES) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    VipsImage* decoded[MAX_SPRITE_TILES] = { NULL };
+    uint32_t cell_width = 0, cell_height = 0;
+    for (size_t i = 0; i < nb_images; ++i) {
+        if (images[i] == NULL
+            || vips_jpegload_buffer(images[i], lengths[i], &decoded[i], NULL)) {
+            unref_all(decoded, nb_images);
+            return ERR_IMGLIB;
+        }
+        tiles[i].width = (uint32_t) vips_image_get_width(decoded[i]);
+        tiles[i].height = (uint32_t) vips_image_get_height(decoded[i]);
+        if (tiles[i].width > cell_width) cell_width = tiles[i].width;
+        if (tiles[i].height > cell_height) cell_height = tiles[i].height;
+    }
+
+    size_t columns = 1;
+    while (columns * columns < nb_images) {
+        ++columns;
+    }
+    const size_t rows = (nb_images + columns - 1) / columns;
+    for (size_t i = 0; i < nb_images; ++i) {
+        tiles[i].x = (uint32_t) (i % columns) * cell_width;
+        tiles[i].y = (uint32_t) (i / columns) * cell_height;
+    }
+
+    // Each image at the top left of its cell
+    VipsImage* sprite = NULL;
+    void* content = NULL;
+    size_t content_len = 0;
+    int errcode = ERR_NONE;
+    if (vips_arrayjoin(decoded, &sprite, (int) nb_images, "across", (int) columns,
+                       "hspacing", (int) cell_width, "vspacing", (int) cell_height, NULL)
+        || vips_jpegsave_buffer(sprite, &content, &content_len, NULL)) {
+        errcode = ERR_IMGLIB;
+    }
+
+    if (sprite != NULL) g_object_unref(sprite);
+    unref_all(decoded, nb_images);
+    if (errcode != ERR_NONE) {
+        g_free(content);
+        return errcode;
+    }
+
+    // Allocated by glib: copy it so that callers can use free()
+    *buffer = malloc(content_len);
+    if (*buffer == NULL) {
+        g_free(content);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(*buffer, content, content_len);
+    *length = content_len;
+    *width = (uint32_t) columns * cell_width;
+    *height = (uint32_t) rows * cell_height;
+    g_free(content);
+    return ERR_NONE;
+}
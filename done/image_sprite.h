@@ -0,0 +1,38 @@
+/**
+ * @file image_sprite.h
+ * @brief Sprite sheets: many images composited into a single one, so that
+ *        a page shows all its thumbnails with one request.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+#define MAX_SPRITE_TILES 256
+
+// Where an image was placed in the sprite
+struct sprite_tile {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/**
+ * @brief Lays images out on a grid, as square as possible, with cells as
+ *        large as the largest of them, and encodes the result as JPEG.
+ *
+ * @param images The JPEG content of the images
+ * @param lengths Their sizes
+ * @param nb_images Their number, 1 to MAX_SPRITE_TILES
+ * @param tiles Where to store the place of each image
+ * @param width Location of the width of the sprite
+ * @param height Location of its height
+ * @param buffer Location of the newly allocated sprite
+ * @param length Location of its size
+ * @return Some error code. 0 if no error.
+ */
+int create_sprite(char* const images[], const uint32_t lengths[], size_t nb_images,
+                  struct sprite_tile tiles[], uint32_t* width, uint32_t* height,
+                  void** buffer, size_t* length);
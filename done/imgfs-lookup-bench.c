@@ -0,0 +1,190 @@
+/*
+ * @file imgfs-lookup-bench.c
+ * @brief Measures metadata lookups per second with 1, 8 and 32 threads,
+ *        under a mutex, a reader-writer lock and through an imgfs_view
+ *
+ * A writer thread keeps modifying slots meanwhile, as inserts and resizes
+ * do on a live server.
+ *
+ * Usage: imgfs-lookup-bench [ms per run] [nb images]
+ */
+
+#include "error.h"
+#include "imgfs.h"
+#include "imgfs_view.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_RUN_MS 1000
+#define DEFAULT_NB_IMAGES 1000
+#define WRITER_PERIOD_US 100
+
+enum lock_mode {
+    MODE_MUTEX,
+    MODE_RWLOCK,
+    MODE_VIEW,
+    NB_MODES
+};
+
+static const char* const mode_names[NB_MODES] = { "mutex", "rwlock", "seqlock" };
+
+static struct imgfs_file fs;
+static struct imgfs_view view;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static enum lock_mode mode;
+static int running;
+
+// Lookup as the server did before the view
+static int locked_find(const char* img_id, struct img_metadata* md)
+{
+    for (uint32_t i = 0; i < fs.header.max_files; ++i) {
+        const struct img_metadata* slot = &fs.metadata[i];
+        if (slot->is_valid == NON_EMPTY && !strncmp(slot->img_id, img_id, MAX_IMG_ID)) {
+            *md = *slot;
+            return (int) i;
+        }
+    }
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+static void* reader_main(void* arg)
+{
+    unsigned long long* nb_ops = arg;
+    unsigned seed = (unsigned) (uintptr_t) arg;
+    char img_id[MAX_IMG_ID + 1];
+    struct img_metadata md;
+    unsigned long long n = 0;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        snprintf(img_id, sizeof(img_id), "img%05u", (unsigned) rand_r(&seed) % fs.header.nb_files);
+        int index;
+        switch (mode) {
+        case MODE_MUTEX:
+            pthread_mutex_lock(&mutex);
+            index = locked_find(img_id, &md);
+            pthread_mutex_unlock(&mutex);
+            break;
+        case MODE_RWLOCK:
+            pthread_rwlock_rdlock(&rwlock);
+            index = locked_find(img_id, &md);
+            pthread_rwlock_unlock(&rwlock);
+            break;
+        default:
+            index = view_find(&view, img_id, &md);
+            break;
+        }
+        if (index < 0) {
+            fprintf(stderr, "%s not found\n", img_id);
+            exit(ERR_RUNTIME);
+        }
+        ++n;
+    }
+    *nb_ops = n;
+    return NULL;
+}
+
+static void* writer_main(void* unused)
+{
+    (void) unused;
+    uint32_t i = 0;
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        i = (i + 7) % fs.header.nb_files;
+        if (mode == MODE_RWLOCK) {
+            pthread_rwlock_wrlock(&rwlock);
+            ++fs.metadata[i].size[THUMB_RES];
+            pthread_rwlock_unlock(&rwlock);
+        } else {
+            pthread_mutex_lock(&mutex);
+            ++fs.metadata[i].size[THUMB_RES];
+            if (mode == MODE_VIEW) {
+                view_publish(&view, &fs);
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+        usleep(WRITER_PERIOD_US);
+    }
+    return NULL;
+}
+
+static double run(enum lock_mode m, size_t nb_threads, unsigned run_ms)
+{
+    mode = m;
+    running = 1;
+
+    pthread_t writer;
+    pthread_t* readers = calloc(nb_threads, sizeof(pthread_t));
+    unsigned long long* nb_ops = calloc(nb_threads, sizeof(unsigned long long));
+    if (readers == NULL || nb_ops == NULL) {
+        exit(ERR_OUT_OF_MEMORY);
+    }
+
+    pthread_create(&writer, NULL, writer_main, NULL);
+    for (size_t t = 0; t < nb_threads; ++t) {
+        pthread_create(&readers[t], NULL, reader_main, &nb_ops[t]);
+    }
+
+    usleep(run_ms * 1000u);
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+    unsigned long long total = 0;
+    for (size_t t = 0; t < nb_threads; ++t) {
+        pthread_join(readers[t], NULL);
+        total += nb_ops[t];
+    }
+    pthread_join(writer, NULL);
+
+    free(readers);
+    free(nb_ops);
+    return (double) total * 1000.0 / run_ms;
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned run_ms = argc > 1 ? (unsigned) strtoul(argv[1], NULL, 10) : DEFAULT_RUN_MS;
+    const uint32_t nb_images = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10) : DEFAULT_NB_IMAGES;
+    if (run_ms == 0 || nb_images == 0 || nb_images > 100000) {
+        fprintf(stderr, "Usage: %s [ms per run] [nb images (1-100000)]\n", argv[0]);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    fs.header.max_files = fs.header.nb_files = nb_images;
+    fs.metadata = calloc(nb_images, sizeof(struct img_metadata));
+    if (fs.metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (uint32_t i = 0; i < nb_images; ++i) {
+        snprintf(fs.metadata[i].img_id, MAX_IMG_ID + 1, "img%05u", i);
+        fs.metadata[i].is_valid = NON_EMPTY;
+    }
+    if (view_init(&view, &fs) != ERR_NONE) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    static const unsigned thread_counts[] = { 1, 8, 32 };
+    printf("%u images, %u ms per run, one writer every %d us\n",
+           nb_images, run_ms, WRITER_PERIOD_US);
+    printf("%-8s", "threads");
+    for (int m = 0; m < NB_MODES; ++m) {
+        printf(" %14s", mode_names[m]);
+    }
+    printf("   (lookups/s)\n");
+
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+        printf("%-8u", thread_counts[i]);
+        for (int m = 0; m < NB_MODES; ++m) {
+            printf(" %14.0f", run((enum lock_mode) m, thread_counts[i], run_ms));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    view_free(&view);
+    free(fs.metadata);
+    return ERR_NONE;
+}
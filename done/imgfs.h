@@ -40,6 +40,17 @@
 #define ORIG_RES  2
 #define NB_RES    3
 
+// Additional resolutions of a v2 imgFS, numbered from NB_RES on
+#define MAX_RES       8                  // max. number of resolutions, original included
+#define NB_EXTRA_RES  (MAX_RES - NB_RES)
+#define MAX_RES_NAME 11                  // max. size of a resolution name
+
+// Options of imgfs_header.flags, chosen at creation
+#define IMGFS_PREVIEWS 0x1u              // a preview of each image is stored
+#define IMGFS_FLAGS    IMGFS_PREVIEWS    // all the known options
+
+#define MAX_PREVIEW  31                  // max. size of a preview
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -51,8 +62,9 @@ struct imgfs_header {
     uint32_t nb_files;
     uint32_t max_files;
     uint16_t resized_res[2 * (NB_RES - 1)];
+    uint32_t nb_res;        // 0 for NB_RES (no additional resolution)
+    uint32_t flags;         // IMGFS_* options
     uint32_t unused_32;
-    uint64_t unused_64;
 
 };
 
@@ -66,6 +78,21 @@ struct img_metadata { // sizeof must be 216
     uint16_t unused_16;
 };
 
+struct imgfs_resolution { // sizeof must be 16
+    char name[MAX_RES_NAME + 1];
+    uint16_t width;
+    uint16_t height;
+};
+
+struct img_ext_metadata { // sizeof must be 64
+    uint32_t size[NB_EXTRA_RES];
+    uint64_t offset[NB_EXTRA_RES];
+};
+
+struct img_preview { // sizeof must be 32
+    char blurhash[MAX_PREVIEW + 1]; // empty if there is none
+};
+
 struct imgfs_file {
     FILE* file;
     struct imgfs_header header;
@@ -88,6 +115,21 @@ void print_header(const struct imgfs_header* header);
  */
 void print_metadata(const struct img_metadata* metadata);
 
+/**
+ * @brief Writes a SHA in hexadecimal.
+ *
+ * @param sha_string Where to write it, 2 * SHA256_DIGEST_LENGTH + 1 chars
+ */
+void sha_to_string(const unsigned char* SHA, char* sha_string);
+
+/**
+ * @brief Reads a SHA written in hexadecimal by sha_to_string().
+ *
+ * @param sha_string Its first 2 * SHA256_DIGEST_LENGTH chars are read
+ * @return Some error code. 0 if no error.
+ */
+int sha_from_string(const char* sha_string, unsigned char* SHA);
+
 /**
  * @brief Open imgFS file, read the header and all the metadata.
  *
@@ -99,6 +141,90 @@ int do_open(const char* imgfs_filename,
             const char* open_mode,
             struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Size of the metadata region described by header: the metadata
+ *        array, then the additional resolutions and their metadata if any,
+ *        then the previews if any.
+ */
+size_t metadata_region_size(const struct imgfs_header* header);
+
+/**
+ * @brief Number of resolutions of the imgFS, original included.
+ */
+int nb_resolutions(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Table of the additional resolutions (NULL if there are none):
+ *        entry i describes resolution NB_RES + i.
+ */
+struct imgfs_resolution* extra_resolutions(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Additional metadata of slot index (NULL if the imgFS has no
+ *        additional resolution).
+ */
+struct img_ext_metadata* ext_metadata(const struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Preview of slot index (NULL if the imgFS stores no previews).
+ */
+struct img_preview* preview_metadata(const struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Gets the target size of a resized resolution.
+ *
+ * @return Some error code. 0 if no error, ERR_RESOLUTIONS if there is
+ *         no such resized resolution.
+ */
+int resolution_size(const struct imgfs_file* imgfs_file, int resolution,
+                    uint16_t* width, uint16_t* height);
+
+/**
+ * @brief Size and offset of a variant of an image, 0 if it is not stored.
+ *
+ * @param ext Additional metadata of the image, may be NULL if there are none
+ */
+uint32_t variant_size(const struct img_metadata* md, const struct img_ext_metadata* ext,
+                      int resolution);
+uint64_t variant_offset(const struct img_metadata* md, const struct img_ext_metadata* ext,
+                        int resolution);
+
+/**
+ * @brief Records where a variant of an image is stored.
+ */
+void set_variant(struct img_metadata* md, struct img_ext_metadata* ext, int resolution,
+                 uint32_t size, uint64_t offset);
+
+/**
+ * @brief Writes the in-memory header to the imgFS file (not flushed).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int write_header(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Writes the in-memory metadata slot index (and its additional
+ *        metadata and preview, if any) to the imgFS file (not flushed).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param index The index of the slot
+ * @return Some error code. 0 if no error.
+ */
+int write_metadata(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Appends content at the end of the imgFS file (not flushed).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param content The content to append
+ * @param size Its size
+ * @param offset Location of its position in the file
+ * @return Some error code. 0 if no error.
+ */
+int append_content(struct imgfs_file* imgfs_file, const void* content, size_t size,
+                   uint64_t* offset);
+
 /**
  * @brief Do some clean-up for imgFS file handling.
  *
@@ -114,15 +240,19 @@ void do_close(struct imgfs_file* imgfs_file);
 enum do_list_mode {
     STDOUT,
     JSON,
+    JSON_BLOBS, // JSON, with the URL of the content of each image
     NB_DO_LIST_MODES
 };
 
+#define BLOB_URI "/imgfs/blob/" // followed by the SHA of the content, in hexadecimal
+
 /**
  * @brief Displays (on stdout) imgFS metadata.
  *
  * @param imgfs_file In memory structure with header and metadata.
  * @param output_mode What style to use for displaying infos.
- * @param json A pointer to a string containing the list in JSON format if output_mode is JSON.
+ * @param json A pointer to a string containing the list in JSON format if output_mode is JSON
+ *      or JSON_BLOBS.
  *      It will be dynamically allocated by the function. Ignored for other output modes.
  * @return some error code.
  */
@@ -134,10 +264,21 @@ int do_list(const struct imgfs_file* imgfs_file,
  *        preallocated empty metadata array to imgFS file.
  *
  * @param imgfs_filename Path to the imgFS file
- * @param imgfs_file In memory structure with header and metadata.
+ * @param imgfs_file In memory structure with header and metadata. The
+ *        max_files, resized_res and flags of its header must be set.
  */
 int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief do_create() with additional resolutions (v2 format).
+ *
+ * @param nb_extra Number of additional resolutions, at most NB_EXTRA_RES
+ *        (0 creates the same imgFS as do_create())
+ * @param extra Their names and sizes
+ */
+int do_create_with_res(const char* imgfs_filename, struct imgfs_file* imgfs_file,
+                       size_t nb_extra, const struct imgfs_resolution* extra);
+
 /**
  * @brief Deletes an image from a imgFS imgFS.
  *
@@ -152,6 +293,17 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
  */
 int do_delete(const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief In-memory part of do_delete(): invalidates the image and updates
+ *        the header. Nothing is written to disk.
+ *
+ * @param img_id The ID of the image to be deleted.
+ * @param imgfs_file The main in-memory data structure
+ * @param index Location of the index of the invalidated slot
+ * @return Some error code. 0 if no error.
+ */
+int delete_image(const char* img_id, struct imgfs_file* imgfs_file, size_t* index);
+
 /**
  * @brief Transforms resolution string to its int value.
  *
@@ -161,6 +313,14 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file);
  */
 int resolution_atoi(const char* resolution);
 
+/**
+ * @brief resolution_atoi() that also knows the additional resolutions
+ *        of imgfs_file, by name.
+ *
+ * @return The corresponding value or -1 if error.
+ */
+int imgfs_resolution_atoi(const struct imgfs_file* imgfs_file, const char* resolution);
+
 /**
  * @brief Reads the content of an image from a imgFS.
  *
@@ -174,6 +334,22 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Reads size bytes of content stored at offset in the imgFS file.
+ *
+ * Positional read: it does not use the stream position, so that it may run
+ * concurrently with other reads. Data written through the stream must have
+ * been flushed first.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param offset Position of the content in the file
+ * @param size Number of bytes to read
+ * @param buffer Location of the newly allocated content, NULL on error
+ * @return Some error code. 0 if no error.
+ */
+int read_blob(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size,
+              char** buffer);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -185,6 +361,48 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief First part of an insertion, which does not need the imgFS:
+ *        hashes the image and reads its dimensions into md (the other
+ *        fields are zeroed).
+ *
+ * @param image_buffer Pointer to the raw image content
+ * @param image_size Image size
+ * @param md The metadata to prepare
+ * @return Some error code. 0 if no error.
+ */
+int prepare_image(const char* image_buffer, size_t image_size, struct img_metadata* md);
+
+/**
+ * @brief Second part of an insertion: insert_image() with metadata made by
+ *        prepare_image() from the same content.
+ *
+ * @param preview The preview of the image, stored if the imgFS has
+ *        previews (may be NULL for none)
+ * @param image_buffer The content, or NULL to insert an image that is
+ *        already stored under another ID: the insertion then fails with
+ *        ERR_IMAGE_NOT_FOUND if no image has the SHA of prepared
+ */
+int insert_prepared(const struct img_metadata* prepared, const struct img_preview* preview,
+                    const char* image_buffer, const char* img_id,
+                    struct imgfs_file* imgfs_file, size_t* index);
+
+/**
+ * @brief do_insert() without writing the metadata and the header: fills a
+ *        free slot, deduplicates and appends the content if new.
+ *
+ * The stream is not flushed. On error, the slot is left empty.
+ *
+ * @param buffer Pointer to the raw image content
+ * @param size Image size
+ * @param img_id Image ID
+ * @param imgfs_file The main in-memory data structure
+ * @param index Location of the index of the filled slot
+ * @return Some error code. 0 if no error.
+ */
+int insert_image(const char* image_buffer, size_t image_size, const char* img_id,
+                 struct imgfs_file* imgfs_file, size_t* index);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
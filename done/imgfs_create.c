@@ -3,9 +3,24 @@
 #include <stdlib.h>
 
 int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
+{
+    return do_create_with_res(imgfs_filename, imgfs_file, 0, NULL);
+}
+
+int do_create_with_res(const char* imgfs_filename, struct imgfs_file* imgfs_file,
+                       size_t nb_extra, const struct imgfs_resolution* extra)
 {
     M_REQUIRE_NON_NULL(imgfs_filename);
     M_REQUIRE_NON_NULL(imgfs_file);
+    if (nb_extra > NB_EXTRA_RES) {
+        return ERR_RESOLUTIONS;
+    }
+    if (nb_extra > 0) {
+        M_REQUIRE_NON_NULL(extra);
+    }
+    if ((imgfs_file->header.flags & ~IMGFS_FLAGS) != 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
     FILE* output = fopen(imgfs_filename, "wb");
 
     if (output == NULL) return ERR_IO; // Return a NUll if an opren error accure
@@ -14,13 +29,19 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
     imgfs_file->header.nb_files = 0;
     imgfs_file->header.version = 0;
     strncpy(imgfs_file->header.name, CAT_TXT, strlen(CAT_TXT));
+    // Without additional resolutions, the file is the same as before they existed
+    imgfs_file->header.nb_res = nb_extra > 0 ? (uint32_t) (NB_RES + nb_extra) : 0;
     imgfs_file->header.unused_32 = 0;
-    imgfs_file->header.unused_64 = 0;
 
-    imgfs_file->metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
+    const size_t region_size = metadata_region_size(&imgfs_file->header);
+    imgfs_file->metadata = calloc(1, region_size > 0 ? region_size : 1);
     if (imgfs_file->metadata == NULL) {
+        fclose(output);
         return ERR_OUT_OF_MEMORY;
     }
+    if (nb_extra > 0) {
+        memcpy(extra_resolutions(imgfs_file), extra, nb_extra * sizeof(struct imgfs_resolution));
+    }
 
     imgfs_file->file = output;
 
@@ -30,8 +51,8 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
         return ERR_IO;
     }
 
-    // Writing metadatas
-    if(fwrite(imgfs_file->metadata, sizeof(struct img_metadata), imgfs_file->header.max_files, output) != imgfs_file->header.max_files) {
+    // Writing metadatas, with the additional resolutions if any
+    if(region_size > 0 && fwrite(imgfs_file->metadata, region_size, 1, output) != 1) {
         fclose(imgfs_file -> file);
         return ERR_IO;
     }
@@ -40,4 +61,4 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
     printf("%i item(s) written\n",imgfs_file->header.max_files + 1);
 
     return ERR_NONE;
-}
\ No newline at end of file
+}
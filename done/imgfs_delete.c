@@ -1,42 +1,57 @@
 #include "imgfs.h"
 #include <string.h>
 
-int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
+int delete_image(const char* img_id, struct imgfs_file* imgfs_file, size_t* index)
 {
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
     if(imgfs_file->header.nb_files == 0) return ERR_IMAGE_NOT_FOUND;
-    
+
     // Searching index
     int pos = -1;
     for(unsigned int i = 0; i < imgfs_file->header.max_files; ++i) {
-        if (strcmp(img_id, imgfs_file->metadata[i].img_id) == 0) {
+        if (imgfs_file->metadata[i].is_valid == NON_EMPTY &&
+            strncmp(img_id, imgfs_file->metadata[i].img_id, MAX_IMG_ID) == 0) {
             pos = i;
         }
     }
 
-    if (pos == -1 || imgfs_file->metadata[pos].is_valid == EMPTY) {
+    if (pos == -1) {
         return ERR_IMAGE_NOT_FOUND;
     }
 
     // Invalidating image
     imgfs_file->metadata[pos].is_valid = EMPTY;
+    imgfs_file->header.nb_files--;
+    imgfs_file->header.version++;
+
+    *index = (size_t) pos;
+    return ERR_NONE;
+}
 
-    // Rewrite metadata to disk
-    long offset = sizeof(struct imgfs_header) + pos * sizeof(struct img_metadata);
-    fseek(imgfs_file->file, offset, SEEK_SET);
-    if (fwrite(&imgfs_file->metadata[pos], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
+{
+    size_t pos = 0;
+    int errcode = delete_image(img_id, imgfs_file, &pos);
+    if (errcode != ERR_NONE) {
+        return errcode;
     }
 
-    imgfs_file->header.nb_files--;
-    imgfs_file->header.version++;
+    // Rewrite metadata and header to disk
+    errcode = write_metadata(imgfs_file, pos);
+    if (errcode == ERR_NONE) {
+        errcode = write_header(imgfs_file);
+    }
 
-    // Rewrite header to disk
-    fseek(imgfs_file->file, 0, SEEK_SET);
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    if (errcode != ERR_NONE) {
+        // Nothing was written: keep memory in line with the disk
+        imgfs_file->metadata[pos].is_valid = NON_EMPTY;
+        imgfs_file->header.nb_files++;
+        imgfs_file->header.version--;
+        return errcode;
     }
 
-    return ERR_NONE;
-}
\ No newline at end of file
+    // Make the new content visible to read_blob()
+    return fflush(imgfs_file->file) ? ERR_IO : ERR_NONE;
+}
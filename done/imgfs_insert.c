@@ -2,107 +2,146 @@
 #include "error.h"
 #include "image_content.h"
 #include "image_dedup.h"
+#include "image_preview.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH and SHA256()
 
-int do_insert(const char *image_buffer, size_t image_size,
-              const char *img_id, struct imgfs_file *imgfs_file) {
+int prepare_image(const char *image_buffer, size_t image_size, struct img_metadata *md) {
     M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(md);
+
+    if (image_size > UINT32_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(md, 0, sizeof(struct img_metadata));
+    SHA256((const unsigned char *) image_buffer, image_size, md->SHA);
+    md->size[ORIG_RES] = (uint32_t) image_size;
+
+    uint32_t height = 0, width = 0;
+    const int errcode = get_resolution(&height, &width, image_buffer, image_size);
+    if (errcode != ERR_NONE) {
+        return errcode;
+    }
+
+    md->orig_res[0] = width;
+    md->orig_res[1] = height;
+    return ERR_NONE;
+}
+
+int insert_prepared(const struct img_metadata *prepared, const struct img_preview *preview,
+                    const char *image_buffer, const char *img_id,
+                    struct imgfs_file *imgfs_file, size_t *index) {
+    M_REQUIRE_NON_NULL(prepared);
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
 
     if (imgfs_file->header.max_files == imgfs_file->header.nb_files) {
         return ERR_IMGFS_FULL;
     }
 
-    int index = -1, i = 0;
-    while (i < imgfs_file->header.max_files && index == -1) {
+    int free_index = -1, i = 0;
+    while (i < imgfs_file->header.max_files && free_index == -1) {
         if (imgfs_file->metadata[i].is_valid == EMPTY) {
-            index = i;
+            free_index = i;
         }
         i++;
     }
 
-    if (index == -1) {
+    if (free_index == -1) {
         return ERR_IMGFS_FULL; // can only happen if .max_files is wrong
     }
 
-    struct img_metadata *md = &imgfs_file->metadata[index];
-
-    strcpy(md->img_id, img_id);
-    SHA256((const unsigned char *) image_buffer, image_size, md->SHA);
-    md->size[ORIG_RES] = (uint32_t) image_size;
-    md->size[THUMB_RES] = 0;
-    md->size[SMALL_RES] = 0;
-    md->is_valid = NON_EMPTY;
-    md->unused_16 = 0;
-
-    int errcode = do_name_and_content_dedup(imgfs_file, index);
-    if (errcode != ERR_NONE) {
-        return errcode;
-    }
+    struct img_metadata *md = &imgfs_file->metadata[free_index];
+    struct img_ext_metadata *ext = ext_metadata(imgfs_file, (size_t) free_index);
+    struct img_preview *slot_preview = preview_metadata(imgfs_file, (size_t) free_index);
 
-    uint32_t height = 0, width = 0;
-    errcode = get_resolution(&height, &width, image_buffer, image_size);
-    if (errcode != ERR_NONE) {
-        return errcode;
+    *md = *prepared;
+    if (ext != NULL) {
+        // variants of the image that was deleted from this slot
+        memset(ext, 0, sizeof(struct img_ext_metadata));
     }
-
-    md->orig_res[0] = width;
-    md->orig_res[1] = height;
-
-    if (md->offset[ORIG_RES] == 0) {
-        // no duplicate, so we need to write to disk
-        // writing at the end
-        if (fseek(imgfs_file->file, 0, SEEK_END)) {
-            return ERR_IO;  // File seek error
+    if (slot_preview != NULL) {
+        if (preview != NULL) {
+            *slot_preview = *preview;
+        } else {
+            memset(slot_preview, 0, sizeof(struct img_preview));
         }
+    }
+    memset(md->img_id, 0, sizeof(md->img_id));
+    strncpy(md->img_id, img_id, MAX_IMG_ID);
+    md->is_valid = NON_EMPTY;
 
-        long offset = ftell(imgfs_file->file);
-        if (offset < 0) {
-            return ERR_IO;
-        }
+    int errcode = do_name_and_content_dedup(imgfs_file, (uint32_t) free_index);
 
-        md->offset[ORIG_RES] = (uint64_t) offset;
+    if (errcode == ERR_NONE && md->offset[ORIG_RES] == 0 && image_buffer == NULL) {
+        errcode = ERR_IMAGE_NOT_FOUND; // the stored copy was deleted
+    } else if (errcode == ERR_NONE && md->offset[ORIG_RES] == 0) {
+        // no duplicate, so we need to write the image at the end
         md->offset[THUMB_RES] = 0;
         md->offset[SMALL_RES] = 0;
+        errcode = append_content(imgfs_file, image_buffer, md->size[ORIG_RES],
+                                 &md->offset[ORIG_RES]);
+    }
 
-        // writing image
-        if (fwrite(image_buffer, image_size, 1, imgfs_file->file) != 1) {
-            return ERR_IO;
+    if (errcode != ERR_NONE) {
+        // leave the slot free, as it was
+        memset(md, 0, sizeof(struct img_metadata));
+        if (ext != NULL) {
+            memset(ext, 0, sizeof(struct img_ext_metadata));
+        }
+        if (slot_preview != NULL) {
+            memset(slot_preview, 0, sizeof(struct img_preview));
         }
+        return errcode;
     }
 
     imgfs_file->header.nb_files += 1;
     imgfs_file->header.version += 1;
+    *index = (size_t) free_index;
+    return ERR_NONE;
+}
 
-    // fiding the position of the metadata of the image in the file
-    int metadata_file_pointer =
-            sizeof(struct imgfs_header) + index * sizeof(struct img_metadata);
-
-    // moving the file pointer to the metadata of the image
-    if (fseek(imgfs_file->file, metadata_file_pointer, SEEK_SET)) {
-        return ERR_IO;  // File seek error
-    }
+int insert_image(const char *image_buffer, size_t image_size, const char *img_id,
+                 struct imgfs_file *imgfs_file, size_t *index) {
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
 
-    // writing the metadata of the image to the file
-    if (fwrite(md, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    struct img_metadata prepared;
+    const int errcode = prepare_image(image_buffer, image_size, &prepared);
+    if (errcode != ERR_NONE) {
+        return errcode;
     }
 
+    // The preview is optional: the image is inserted without one if it fails
+    struct img_preview preview;
+    const int has_preview = preview_metadata(imgfs_file, 0) != NULL
+                            && create_preview(image_buffer, image_size, &preview) == ERR_NONE;
+    return insert_prepared(&prepared, has_preview ? &preview : NULL, image_buffer, img_id,
+                           imgfs_file, index);
+}
 
-    // moving the file pointer to the end of the header of the image
-    if (fseek(imgfs_file->file, 0, SEEK_SET)) {
-        return ERR_IO;  // File seek error
+int do_insert(const char *image_buffer, size_t image_size,
+              const char *img_id, struct imgfs_file *imgfs_file) {
+    size_t index = 0;
+    int errcode = insert_image(image_buffer, image_size, img_id, imgfs_file, &index);
+    if (errcode != ERR_NONE) {
+        return errcode;
     }
 
-    // writing the header of the image to the file
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header)
-            , 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    errcode = write_metadata(imgfs_file, index);
+    if (errcode == ERR_NONE) {
+        errcode = write_header(imgfs_file);
     }
 
-    return ERR_NONE;
+    // Make the new content visible to read_blob()
+    if (fflush(imgfs_file->file) && errcode == ERR_NONE) {
+        errcode = ERR_IO;
+    }
+    return errcode;
 }
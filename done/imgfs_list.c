@@ -9,6 +9,11 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
 
     if (output_mode == STDOUT) {
         print_header(&imgfs_file->header);
+        const struct imgfs_resolution* extra = extra_resolutions(imgfs_file);
+        for (int res = NB_RES; extra != NULL && res < nb_resolutions(imgfs_file); ++res) {
+            printf("RESOLUTION %s: %u x %u\n", extra[res - NB_RES].name,
+                   (unsigned) extra[res - NB_RES].width, (unsigned) extra[res - NB_RES].height);
+        }
         if (imgfs_file->header.nb_files == 0) printf("<< empty imgFS >>\n");
         else {
             int foundImgs = 0, i = 0;
@@ -16,13 +21,22 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
                 
                 if(imgfs_file->metadata[i].is_valid) {
                     print_metadata(&imgfs_file->metadata[i]);
+                    const struct img_preview* preview = preview_metadata(imgfs_file, (size_t) i);
+                    if (preview != NULL) {
+                        printf("PREVIEW: " STR_LENGTH_FMT(MAX_PREVIEW) "\n", preview->blurhash);
+                    }
                     ++foundImgs;
                 }
                 ++i;
             }
         }
-    } else if (output_mode == JSON) {
+    } else if (output_mode == JSON || output_mode == JSON_BLOBS) {
         struct json_object* values = json_object_new_array_ext(imgfs_file->header.nb_files);
+        // Content-addressed URLs, which may be cached forever
+        struct json_object* blobs = output_mode == JSON_BLOBS ? json_object_new_object() : NULL;
+        // Placeholders to show while the images load, if the imgFS has them
+        struct json_object* previews = preview_metadata(imgfs_file, 0) != NULL
+                                       ? json_object_new_object() : NULL;
         int foundImgs = 0, i = 0;
         while(foundImgs < imgfs_file->header.nb_files && i <imgfs_file->header.max_files) {
                 
@@ -32,6 +46,24 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
                         // TODO see what needs to be freed
                         return ERR_RUNTIME;
                     }
+                    if (blobs != NULL) {
+                        char url[sizeof(BLOB_URI) + 2 * SHA256_DIGEST_LENGTH];
+                        strcpy(url, BLOB_URI);
+                        sha_to_string(imgfs_file->metadata[i].SHA, url + strlen(BLOB_URI));
+                        json_object_object_add(blobs, imgfs_file->metadata[i].img_id,
+                                               json_object_new_string(url));
+                    }
+                    const struct img_preview* preview = preview_metadata(imgfs_file, (size_t) i);
+                    if (previews != NULL && preview->blurhash[0] != '\0') {
+                        const struct img_metadata* md = &imgfs_file->metadata[i];
+                        struct json_object* entry = json_object_new_object();
+                        json_object_object_add(entry, "blurhash",
+                                               json_object_new_string_len(preview->blurhash,
+                                                       (int) strnlen(preview->blurhash, MAX_PREVIEW)));
+                        json_object_object_add(entry, "width", json_object_new_int64(md->orig_res[0]));
+                        json_object_object_add(entry, "height", json_object_new_int64(md->orig_res[1]));
+                        json_object_object_add(previews, md->img_id, entry);
+                    }
                     ++foundImgs;
                 }
                 ++i;
@@ -42,6 +74,12 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
             // TODO see what nees to be freed
             return ERR_RUNTIME;
         }
+        if (previews != NULL && json_object_object_add(obj, "Previews", previews)) {
+            return ERR_RUNTIME;
+        }
+        if (blobs != NULL && json_object_object_add(obj, "Blobs", blobs)) {
+            return ERR_RUNTIME;
+        }
 
         char* temp = json_object_to_json_string(obj);
         *json = calloc(1, strlen(temp) + 1);
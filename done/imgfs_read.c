@@ -4,6 +4,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h> // pread
 
 // Function to read an image from the imgFS file
 int do_read(const char* img_id, int resolution, char** image_buffer,
@@ -29,14 +31,20 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
         return ERR_IMAGE_NOT_FOUND;
     }
 
+    if (resolution < 0 || resolution >= nb_resolutions(imgfs_file)) {
+        return ERR_RESOLUTIONS;
+    }
+
     // Get the metadata for the image
-    struct img_metadata* md = &imgfs_file->metadata[index];
+    const struct img_metadata* md = &imgfs_file->metadata[index];
+    const struct img_ext_metadata* ext = ext_metadata(imgfs_file, (size_t) index);
     int errcode = ERR_NONE;
 
 
     // If the requested resolution is not the original and
     // the resolution data is not present, resize the image
-    if (resolution != ORIG_RES && (md->offset[resolution] == 0 || md->size[resolution] == 0)) {
+    if (resolution != ORIG_RES && (variant_offset(md, ext, resolution) == 0
+                                   || variant_size(md, ext, resolution) == 0)) {
         errcode = lazily_resize(resolution, imgfs_file, (size_t) index);
     }
 
@@ -45,23 +53,50 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
         return errcode;
     }
 
+    // Read the image from the file into a new buffer
+    errcode = read_blob(imgfs_file, variant_offset(md, ext, resolution),
+                        variant_size(md, ext, resolution), image_buffer);
+    if (errcode != ERR_NONE) {
+        return errcode;
+    }
+
     // Set the size of the image
-    *image_size = md->size[resolution];
+    *image_size = variant_size(md, ext, resolution);
+
+    // Return success
+    return ERR_NONE;
+}
 
-    // Allocate memory for the image buffer
-    *image_buffer = malloc(md->size[resolution]);
-    if (*image_buffer == NULL) {
+// Reads image content without moving the file position, so that several
+// threads can read at the same time
+int read_blob(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size,
+              char** buffer)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    *buffer = NULL;
+    if (imgfs_file->file == NULL) {
+        return ERR_IO;
+    }
+
+    char* content = malloc(size);
+    if (content == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
 
-    // Read the image from the file into the buffer
-    if (imgfs_file->file == NULL || 
-        fseek(imgfs_file->file, md->offset[resolution], SEEK_SET) || 
-        fread(*image_buffer, md->size[resolution], 1, imgfs_file->file) != 1)
-    {
-        return ERR_IO;
+    const int fd = fileno(imgfs_file->file);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pread(fd, content + done, size - done, (off_t) (offset + done));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            free(content);
+            return ERR_IO;
+        }
+        done += (size_t) n;
     }
 
-    // Return success
+    *buffer = content;
     return ERR_NONE;
 }
@@ -9,48 +9,1041 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <inttypes.h> // PRIu32
 #include <pthread.h>
+#include <openssl/sha.h> // SHA256
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "imgfs_view.h"
+#include "imgfs_writer.h"
+#include "image_content.h" // create_resized_imgs
+#include "image_format.h"
+#include "image_sprite.h"
+#include "variant_cache.h"
 #include "http_net.h"
 #include "imgfs_server_service.h"
+#include "thread_pool.h"
+#include "resize_queue.h"
 #include <vips/vips.h>
+#include <json-c/json.h>
 
-// Function declaration
+// Function declarations
 int handle_http_message(struct http_message* msg, int connection);
+static int expect_insert(const struct http_message* msg, int connection);
 // Main in-memory structure for imgFS
 static struct imgfs_file fs_file;
 static uint16_t server_port;
-pthread_mutex_t mutex;
+// Only the writer thread modifies fs_file (insert, delete, storing a
+// resized variant). Readers do not lock: they use view, republished by
+// the writer after each batch of modifications.
+static struct imgfs_view view;
+
+// A resize in progress, creating all the missing variants of an image.
+// Requests for any of them wait for it and share its result instead of
+// decoding the original once more.
+struct resize_flight {
+    size_t index;
+    int done;
+    int errcode;
+    struct img_metadata md;          // metadata of the image once done
+    struct img_ext_metadata ext;     // and its additional metadata
+    void* content[MAX_RES];          // the variants this flight created
+    size_t content_len[MAX_RES];
+    size_t nb_users;                 // requests still using it, the last one frees it
+    struct resize_flight* next;
+};
+
+// Flights in progress, hashed on the slot
+#define NB_FLIGHT_BUCKETS 64
+struct flight_bucket {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct resize_flight* flights;
+};
+static struct flight_bucket flight_buckets[NB_FLIGHT_BUCKETS];
+static uint64_t nb_resizes = 0;   // originals decoded to create variants
+static uint64_t nb_coalesced = 0; // requests that waited for one instead
 
 #define URI_ROOT "/imgfs"
+#define MULTIPART_BOUNDARY "imgfs-boundary-7d1f0c5b93e2a846" // of multipart bodies
+#define MULTIPART_END "--" MULTIPART_BOUNDARY "--" HTTP_LINE_DELIM
+
+/**********************************************************************
+ * Tells whether the requested variant of an image is already stored, i.e.
+ * whether reading it does not need a resize.
+ ********************************************************************** */
+static int is_stored(const char* img_id, int resolution)
+{
+    struct img_metadata md;
+    struct img_ext_metadata ext;
+    // not found: reading it fails without resizing anything
+    return resolution == ORIG_RES || view_find_ext(&view, img_id, &md, &ext) < 0
+           || variant_size(&md, &ext, resolution) != 0;
+}
+
+/**********************************************************************
+ * Creates and stores the missing variants, unless the slot changed.
+ * No lock is held while the image is decoded, resized and encoded;
+ * the writer thread then stores the result.
+ ********************************************************************** */
+static void run_flight(struct resize_flight* flight, const unsigned char* SHA)
+{
+    // The variant may have been stored since the caller looked
+    view_read_ext(&view, flight->index, &flight->md, &flight->ext);
+
+    if (flight->md.is_valid == EMPTY || memcmp(flight->md.SHA, SHA, SHA256_DIGEST_LENGTH)) {
+        flight->errcode = ERR_IMAGE_NOT_FOUND; // deleted in the meantime
+        return;
+    }
+    int missing = 0;
+    for (int res = 0; res < nb_resolutions(&fs_file); ++res) {
+        missing |= res != ORIG_RES && variant_size(&flight->md, &flight->ext, res) == 0;
+    }
+    if (!missing) {
+        return;
+    }
+
+    __atomic_add_fetch(&nb_resizes, 1, __ATOMIC_RELAXED);
+    // The original is read anyway: create all the missing variants
+    flight->errcode = create_resized_imgs(&fs_file, &flight->md, &flight->ext, ORIG_RES,
+                                          flight->content, flight->content_len);
+    if (flight->errcode != ERR_NONE) {
+        return;
+    }
+
+    flight->errcode = writer_store_resized(flight->index, SHA,
+                                           flight->content, flight->content_len);
+    view_read_ext(&view, flight->index, &flight->md, &flight->ext); // published before completion
+}
+
+/**********************************************************************
+ * Reads the missing variant of the image at index, md being a copy of
+ * its metadata. The first request for a variant creates it, the ones
+ * arriving meanwhile get a copy of its result. With a NULL buffer, the
+ * variant is only created.
+ ********************************************************************** */
+static int resize_variant(size_t index, int resolution, const struct img_metadata* md,
+                          char** buffer, uint32_t* size)
+{
+    struct flight_bucket* bucket = &flight_buckets[index % NB_FLIGHT_BUCKETS];
+
+    pthread_mutex_lock(&bucket->lock);
+    struct resize_flight* flight = bucket->flights;
+    while (flight != NULL && flight->index != index) {
+        flight = flight->next;
+    }
+
+    if (flight != NULL) {
+        ++flight->nb_users;
+        __atomic_add_fetch(&nb_coalesced, 1, __ATOMIC_RELAXED);
+        while (!flight->done) {
+            pthread_cond_wait(&bucket->done, &bucket->lock);
+        }
+    } else {
+        flight = calloc(1, sizeof(struct resize_flight));
+        if (flight == NULL) {
+            pthread_mutex_unlock(&bucket->lock);
+            return ERR_OUT_OF_MEMORY;
+        }
+        flight->index = index;
+        flight->nb_users = 1;
+        flight->next = bucket->flights;
+        bucket->flights = flight;
+        pthread_mutex_unlock(&bucket->lock);
+
+        run_flight(flight, md->SHA);
+
+        // Requests arriving from now on find the variant in the metadata
+        pthread_mutex_lock(&bucket->lock);
+        for (struct resize_flight** p = &bucket->flights; *p != NULL; p = &(*p)->next) {
+            if (*p == flight) {
+                *p = flight->next;
+                break;
+            }
+        }
+        flight->done = 1;
+        pthread_cond_broadcast(&bucket->done);
+    }
+    pthread_mutex_unlock(&bucket->lock);
+
+    // A finished flight is not modified anymore
+    int errcode = flight->errcode;
+    if (errcode == ERR_NONE && buffer != NULL) {
+        *size = variant_size(&flight->md, &flight->ext, resolution);
+        if (*size == 0) {
+            errcode = ERR_IMAGE_NOT_FOUND; // only if the slot was reused
+        } else if (flight->content[resolution] != NULL) {
+            *buffer = malloc(flight->content_len[resolution]);
+            if (*buffer == NULL) {
+                errcode = ERR_OUT_OF_MEMORY;
+            } else {
+                memcpy(*buffer, flight->content[resolution], flight->content_len[resolution]);
+            }
+        } else {
+            errcode = read_blob(&fs_file, variant_offset(&flight->md, &flight->ext, resolution),
+                                *size, buffer);
+        }
+    }
+
+    pthread_mutex_lock(&bucket->lock);
+    const int last = --flight->nb_users == 0;
+    pthread_mutex_unlock(&bucket->lock);
+    if (last) {
+        for (int res = 0; res < MAX_RES; ++res) {
+            free(flight->content[res]);
+        }
+        free(flight);
+    }
+    return errcode;
+}
+
+/**********************************************************************
+ * Background job queued after an insertion: creates the missing variants
+ * of the image, through a flight so that reads arriving meanwhile wait
+ * for it instead of resizing once more.
+ ********************************************************************** */
+static void eager_resize(size_t index, const unsigned char* SHA)
+{
+    struct img_metadata md;
+    struct img_ext_metadata ext;
+    view_read_ext(&view, index, &md, &ext);
+    if (md.is_valid == EMPTY || memcmp(md.SHA, SHA, SHA256_DIGEST_LENGTH)) {
+        return; // deleted in the meantime
+    }
+    for (int res = 0; res < nb_resolutions(&fs_file); ++res) {
+        if (res != ORIG_RES && variant_size(&md, &ext, res) == 0) {
+            resize_variant(index, res, &md, NULL, NULL);
+            return;
+        }
+    }
+}
+
+/**********************************************************************
+ * Reads a variant of an image, creating it if needed. Content is never
+ * overwritten, so it is read from a copy of the metadata without lock.
+ ********************************************************************** */
+static int read_slot_variant(size_t index, const struct img_metadata* md,
+                             const struct img_ext_metadata* ext, int resolution,
+                             char** buffer, uint32_t* size)
+{
+    *size = variant_size(md, ext, resolution);
+    if (*size == 0) {
+        return resize_variant(index, resolution, md, buffer, size);
+    }
+    return read_blob(&fs_file, variant_offset(md, ext, resolution), *size, buffer);
+}
+
+static int read_variant(const char* img_id, int resolution, struct img_metadata* md,
+                        char** buffer, uint32_t* size)
+{
+    struct img_ext_metadata ext;
+    const int index = view_find_ext(&view, img_id, md, &ext);
+    if (index < 0) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+    return read_slot_variant((size_t) index, md, &ext, resolution, buffer, size);
+}
+
+/**********************************************************************
+ * Other formats of the resized variants, kept in the variant cache only:
+ * the metadata has no room for their offsets.
+ ********************************************************************** */
+static void format_variant_name(enum image_format format, int resolution,
+                                char name[MAX_VARIANT_NAME + 1])
+{
+    snprintf(name, MAX_VARIANT_NAME + 1, "%s/%d", image_format_name(format), resolution);
+}
+
+// Formats other than JPEG listed by the Accept header of msg
+static int accepted_formats(const struct http_message* msg, int accepted[NB_FORMATS])
+{
+    const struct http_string* accept = http_get_header(msg, "Accept");
+    int nb_accepted = 0;
+    for (int f = 0; f < NB_FORMATS; ++f) {
+        accepted[f] = f != FORMAT_JPEG && accept != NULL
+                      && image_format_accepted(accept->val, accept->len, (enum image_format) f);
+        nb_accepted += accepted[f];
+    }
+    return nb_accepted;
+}
+
+// Whether one of the accepted formats of a variant still has to be encoded
+static int has_missing_format(const char* img_id, int resolution, const int accepted[NB_FORMATS])
+{
+    struct img_metadata md;
+    if (view_find(&view, img_id, &md) < 0) {
+        return 0;
+    }
+    char name[MAX_VARIANT_NAME + 1];
+    for (int f = 0; f < NB_FORMATS; ++f) {
+        format_variant_name((enum image_format) f, resolution, name);
+        if (accepted[f] && !variant_cache_get(md.SHA, name, NULL, NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+ * Replaces the JPEG variant in buffer by the smallest of the accepted
+ * formats, creating them in the variant cache if needed. Falls back to
+ * JPEG if a format cannot be created.
+ ********************************************************************** */
+static enum image_format negotiate_format(const struct img_metadata* md, int resolution,
+                                          const int accepted[NB_FORMATS],
+                                          char** buffer, uint32_t* size)
+{
+    enum image_format best = FORMAT_JPEG;
+    char name[MAX_VARIANT_NAME + 1];
+    for (int f = 0; f < NB_FORMATS; ++f) {
+        if (!accepted[f]) {
+            continue;
+        }
+
+        void* content = NULL;
+        size_t len = 0;
+        format_variant_name((enum image_format) f, resolution, name);
+        if (!variant_cache_get(md->SHA, name, &content, &len)) {
+            if (create_format_variant(&fs_file, md, resolution, (enum image_format) f,
+                                      &content, &len) != ERR_NONE) {
+                continue;
+            }
+            variant_cache_put(md->SHA, name, content, len);
+        }
+
+        if (len < *size) {
+            free(*buffer);
+            *buffer = content;
+            *size = (uint32_t) len;
+            best = (enum image_format) f;
+        } else {
+            free(content);
+        }
+    }
+    return best;
+}
+
+/**********************************************************************
+ * Variants of any size, read with w and/or h instead of res and kept in
+ * the variant cache only. The requested size is rounded up to a multiple
+ * of CUSTOM_SIZE_STEP and never exceeds the original, so that close
+ * requests share the same variant.
+ ********************************************************************** */
+#define CUSTOM_SIZE_STEP 32
+#define MAX_CUSTOM_SIZE 2048
+
+// Reads the w and h parameters of msg into size (0 if absent);
+// returns 1 if one of them is given, 0 if none, or some error code
+static int get_custom_size(const struct http_message* msg, uint16_t size[2])
+{
+    static const char* const names[2] = { "w", "h" };
+    int found = 0;
+    for (int i = 0; i < 2; ++i) {
+        char value[6] = {0};
+        const int len = http_get_var(&msg->uri, names[i], value, sizeof(value) - 1);
+        size[i] = 0;
+        if (len == ERR_RUNTIME) {
+            return ERR_INVALID_ARGUMENT; // too long
+        }
+        if (len <= 0) {
+            continue;
+        }
+        size[i] = atouint16(value);
+        if (size[i] == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        found = 1;
+    }
+    return found;
+}
+
+// Box the requested variant of md fits in (an absent side does not
+// constrain it); returns 0 if the variant is the original itself
+static int custom_box(const struct img_metadata* md, const uint16_t size[2], uint16_t box[2])
+{
+    int resized = 0;
+    for (int i = 0; i < 2; ++i) {
+        uint32_t side = md->orig_res[i];
+        if (size[i] != 0) {
+            const uint32_t rounded = (size[i] + CUSTOM_SIZE_STEP - 1u) / CUSTOM_SIZE_STEP
+                                     * CUSTOM_SIZE_STEP;
+            if (rounded < MAX_CUSTOM_SIZE && rounded < side) {
+                side = rounded;
+                resized = 1;
+            } else if (MAX_CUSTOM_SIZE < side) {
+                side = MAX_CUSTOM_SIZE;
+                resized = 1;
+            }
+        }
+        box[i] = side < UINT16_MAX ? (uint16_t) side : UINT16_MAX;
+    }
+    return resized;
+}
+
+static void custom_variant_name(const uint16_t box[2], char name[MAX_VARIANT_NAME + 1])
+{
+    snprintf(name, MAX_VARIANT_NAME + 1, "%s/%ux%u", image_format_name(FORMAT_JPEG),
+             (unsigned) box[0], (unsigned) box[1]);
+}
+
+// Whether reading the variant does not need a resize
+static int has_custom_variant(const char* img_id, const uint16_t size[2])
+{
+    struct img_metadata md;
+    uint16_t box[2];
+    // not found: reading it fails without resizing anything
+    if (view_find(&view, img_id, &md) < 0 || !custom_box(&md, size, box)) {
+        return 1;
+    }
+    char name[MAX_VARIANT_NAME + 1];
+    custom_variant_name(box, name);
+    return variant_cache_get(md.SHA, name, NULL, NULL);
+}
+
+// Name of the variant of md read with size: the original if it fits
+static void sized_variant_name(const struct img_metadata* md, const uint16_t size[2],
+                               char name[MAX_VARIANT_NAME + 1])
+{
+    uint16_t box[2];
+    if (custom_box(md, size, box)) {
+        custom_variant_name(box, name);
+    } else {
+        format_variant_name(FORMAT_JPEG, ORIG_RES, name);
+    }
+}
+
+// Reads the JPEG variant of img_id fitting in size, creating it if needed
+static int read_custom_variant(const char* img_id, const uint16_t size[2], struct img_metadata* md,
+                               char** buffer, uint32_t* length)
+{
+    struct img_ext_metadata ext;
+    if (view_find_ext(&view, img_id, md, &ext) < 0) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    uint16_t box[2];
+    if (!custom_box(md, size, box)) {
+        *length = md->size[ORIG_RES];
+        return read_blob(&fs_file, md->offset[ORIG_RES], *length, buffer);
+    }
+
+    char name[MAX_VARIANT_NAME + 1];
+    custom_variant_name(box, name);
+    void* content = NULL;
+    size_t content_len = 0;
+    if (!variant_cache_get(md->SHA, name, &content, &content_len)) {
+        const int errcode = create_sized_variant(&fs_file, md, &ext, box[0], box[1], FORMAT_JPEG,
+                                                 &content, &content_len);
+        if (errcode != ERR_NONE) {
+            return errcode;
+        }
+        variant_cache_put(md->SHA, name, content, content_len);
+    }
+    *buffer = content;
+    *length = (uint32_t) content_len;
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * HTTP caching. Each variant has a strong ETag made of the SHA of its
+ * image and of its name in the variant cache, so that a client which
+ * already has it is answered "304 Not Modified" from the metadata alone.
+ * How long clients may use a resolution without revalidating it is set
+ * at startup; by default they always revalidate, as an img_id may be
+ * inserted again with another content.
+ ********************************************************************** */
+#define MAX_ETAG (2 * SHA256_DIGEST_LENGTH + MAX_VARIANT_NAME + 3)
+#define MAX_CACHE_CONTROL 40
+#define MAX_CACHE_HEADERS 256
+#define CUSTOM_POLICY MAX_RES        // of the variants read with w and h
+#define IMMUTABLE_POLICY (MAX_RES + 1) // of the ones read by their SHA
+
+static char cache_control[MAX_RES + 2][MAX_CACHE_CONTROL];
+
+static void init_cache_policies(void)
+{
+    for (int policy = 0; policy <= MAX_RES; ++policy) {
+        strcpy(cache_control[policy], "no-cache");
+    }
+    strcpy(cache_control[IMMUTABLE_POLICY], "public, max-age=31536000, immutable");
+}
+
+// Sets a policy from "NAME=SECONDS", NAME being a resolution or "custom"
+static int set_cache_policy(const char* arg)
+{
+    const char* sep = strchr(arg, '=');
+    if (sep == NULL || sep - arg > MAX_RES_NAME) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    char name[MAX_RES_NAME + 1] = {0};
+    memcpy(name, arg, (size_t) (sep - arg));
+    const int policy = !strcmp(name, "custom") ? CUSTOM_POLICY : imgfs_resolution_atoi(&fs_file, name);
+    if (policy < 0) {
+        return ERR_RESOLUTIONS;
+    }
+    snprintf(cache_control[policy], MAX_CACHE_CONTROL, "public, max-age=%" PRIu32, atouint32(sep + 1));
+    return ERR_NONE;
+}
+
+static void format_etag(const struct img_metadata* md, const char* variant, char etag[MAX_ETAG + 1])
+{
+    char sha[2 * SHA256_DIGEST_LENGTH + 1];
+    sha_to_string(md->SHA, sha);
+    snprintf(etag, MAX_ETAG + 1, "\"%s-%s\"", sha, variant);
+}
+
+static void format_cache_headers(const char* etag, int policy, int vary,
+                                 char headers[MAX_CACHE_HEADERS])
+{
+    snprintf(headers, MAX_CACHE_HEADERS, "ETag: %s" HTTP_LINE_DELIM "Cache-Control: %s" HTTP_LINE_DELIM "%s",
+             etag, cache_control[policy], vary ? "Vary: Accept" HTTP_LINE_DELIM : "");
+}
+
+// Whether If-None-Match lists the variant of md, in JPEG or in one of the
+// accepted formats (JPEG only if accepted is NULL); if so, etag is its ETag
+static int has_variant(const struct http_string* if_none_match, const struct img_metadata* md,
+                       int resolution, const int accepted[NB_FORMATS], char etag[MAX_ETAG + 1])
+{
+    char name[MAX_VARIANT_NAME + 1];
+    for (int f = 0; f < NB_FORMATS; ++f) {
+        if (f == FORMAT_JPEG || (accepted != NULL && accepted[f])) {
+            format_variant_name((enum image_format) f, resolution, name);
+            format_etag(md, name, etag);
+            if (http_etag_match(if_none_match, etag)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int reply_304_msg(int connection, const char* etag, int policy, int vary)
+{
+    char headers[MAX_CACHE_HEADERS];
+    format_cache_headers(etag, policy, vary, headers);
+    return http_reply(connection, HTTP_NOT_MODIFIED, headers, "", 0);
+}
+
+/**********************************************************************
+ * Lists of images, given as a comma-separated img_ids parameter
+ ********************************************************************** */
+#define MAX_IMG_IDS MAX_SPRITE_TILES
+
+// Points img_ids at the ids of the img_ids parameter of msg, split in
+// place in a newly allocated *buffer (to free, even on error)
+static int get_img_ids(const struct http_message* msg, char** buffer,
+                       const char* img_ids[MAX_IMG_IDS], size_t* nb_ids)
+{
+    *nb_ids = 0;
+    *buffer = calloc(1, MAX_HEADER_SIZE + 1);
+    if (*buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (http_get_var(&msg->uri, "img_ids", *buffer, MAX_HEADER_SIZE) <= 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char* saveptr = NULL;
+    for (char* id = strtok_r(*buffer, ",", &saveptr); id != NULL;
+         id = strtok_r(NULL, ",", &saveptr)) {
+        if (*nb_ids == MAX_IMG_IDS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        img_ids[(*nb_ids)++] = id;
+    }
+    return *nb_ids > 0 ? ERR_NONE : ERR_INVALID_ARGUMENT;
+}
+
+/**********************************************************************
+ * Sprite sheets: the thumbnails of many images in a single JPEG, with a
+ * JSON map of where each one is. Both are kept in the variant cache under
+ * a hash of the ids and SHAs of the images, so that a sheet is never
+ * served once one of its images was replaced.
+ ********************************************************************** */
+#define SPRITE_IMAGE_NAME "sprite/jpeg"
+#define SPRITE_MAP_NAME   "sprite/map"
+
+struct sprite_request {
+    char* ids_buffer;                        // img_ids parameter, split in place
+    const char* img_ids[MAX_SPRITE_TILES];   // the ones found, in order
+    size_t nb_images;
+    unsigned char key[SHA256_DIGEST_LENGTH]; // of their ids and SHAs
+};
+
+static void free_sprite_request(struct sprite_request* req)
+{
+    free(req->ids_buffer);
+    req->ids_buffer = NULL;
+}
+
+// Looks the images of msg up; the ones that are not found are left out
+// of the sheet
+static int parse_sprite_request(const struct http_message* msg, struct sprite_request* req)
+{
+    memset(req, 0, sizeof(*req));
+    const char* img_ids[MAX_IMG_IDS];
+    size_t nb_ids = 0;
+    int errcode = get_img_ids(msg, &req->ids_buffer, img_ids, &nb_ids);
+    if (errcode != ERR_NONE) {
+        return errcode;
+    }
+
+    unsigned char* keyed = calloc(nb_ids, MAX_IMG_ID + 1 + SHA256_DIGEST_LENGTH);
+    if (keyed == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t keyed_len = 0;
+    for (size_t i = 0; i < nb_ids; ++i) {
+        struct img_metadata md;
+        if (strlen(img_ids[i]) > MAX_IMG_ID || view_find(&view, img_ids[i], &md) < 0) {
+            continue;
+        }
+        req->img_ids[req->nb_images++] = img_ids[i];
+        const size_t id_len = strlen(img_ids[i]) + 1;
+        memcpy(keyed + keyed_len, img_ids[i], id_len);
+        memcpy(keyed + keyed_len + id_len, md.SHA, SHA256_DIGEST_LENGTH);
+        keyed_len += id_len + SHA256_DIGEST_LENGTH;
+    }
+
+    SHA256(keyed, keyed_len, req->key);
+    free(keyed);
+    return req->nb_images > 0 ? ERR_NONE : ERR_IMAGE_NOT_FOUND;
+}
+
+static char* sprite_map_json(const struct sprite_request* req, const struct sprite_tile tiles[],
+                             uint32_t width, uint32_t height)
+{
+    struct json_object* obj = json_object_new_object();
+    json_object_object_add(obj, "width", json_object_new_int64(width));
+    json_object_object_add(obj, "height", json_object_new_int64(height));
+    struct json_object* list = json_object_new_array_ext((int) req->nb_images);
+    for (size_t i = 0; i < req->nb_images; ++i) {
+        struct json_object* tile = json_object_new_object();
+        json_object_object_add(tile, "img_id", json_object_new_string(req->img_ids[i]));
+        json_object_object_add(tile, "x", json_object_new_int64(tiles[i].x));
+        json_object_object_add(tile, "y", json_object_new_int64(tiles[i].y));
+        json_object_object_add(tile, "width", json_object_new_int64(tiles[i].width));
+        json_object_object_add(tile, "height", json_object_new_int64(tiles[i].height));
+        json_object_array_add(list, tile);
+    }
+    json_object_object_add(obj, "tiles", list);
+    char* output = strdup(json_object_to_json_string(obj));
+    json_object_put(obj);
+    return output;
+}
+
+// Composites the thumbnails of the images, caching both the sheet and its
+// map, and returns the requested one
+static int build_sprite(const struct sprite_request* req, int map, void** content, size_t* len)
+{
+    char* thumbs[MAX_SPRITE_TILES] = { NULL };
+    uint32_t sizes[MAX_SPRITE_TILES] = { 0 };
+    int errcode = ERR_NONE;
+    for (size_t i = 0; i < req->nb_images && errcode == ERR_NONE; ++i) {
+        struct img_metadata md;
+        errcode = read_variant(req->img_ids[i], THUMB_RES, &md, &thumbs[i], &sizes[i]);
+    }
+
+    struct sprite_tile tiles[MAX_SPRITE_TILES];
+    uint32_t width = 0, height = 0;
+    void* sprite = NULL;
+    size_t sprite_len = 0;
+    if (errcode == ERR_NONE) {
+        errcode = create_sprite(thumbs, sizes, req->nb_images, tiles, &width, &height,
+                                &sprite, &sprite_len);
+    }
+    for (size_t i = 0; i < req->nb_images; ++i) {
+        free(thumbs[i]);
+    }
+    if (errcode != ERR_NONE) {
+        return errcode;
+    }
+
+    char* json = sprite_map_json(req, tiles, width, height);
+    if (json == NULL) {
+        free(sprite);
+        return ERR_OUT_OF_MEMORY;
+    }
+    variant_cache_put(req->key, SPRITE_IMAGE_NAME, sprite, sprite_len);
+    variant_cache_put(req->key, SPRITE_MAP_NAME, json, strlen(json));
+
+    if (map) {
+        free(sprite);
+        *content = json;
+        *len = strlen(json);
+    } else {
+        free(json);
+        *content = sprite;
+        *len = sprite_len;
+    }
+    return ERR_NONE;
+}
+
+// Whether the sheet (or map) msg asks for still has to be composited
+static int is_sprite_missing(const struct http_message* msg, int map)
+{
+    struct sprite_request req;
+    const int missing = parse_sprite_request(msg, &req) == ERR_NONE
+                        && !variant_cache_get(req.key, map ? SPRITE_MAP_NAME : SPRITE_IMAGE_NAME,
+                                              NULL, NULL);
+    free_sprite_request(&req);
+    return missing;
+}
+
+/**********************************************************************
+ * Reading many images at once, as one multipart/mixed body in the order
+ * of the request (images not found are left out). The stored variants
+ * are read in the order of their offsets, so that the file is read
+ * forward; missing ones are created as by /imgfs/read.
+ ********************************************************************** */
+// Bounds what a single request holds in memory: on average, a small
+// variant for each image
+#define MAX_MULTIREAD_PART (128u << 10)
+#define MAX_MULTIREAD_SIZE ((uint64_t) MAX_IMG_IDS * MAX_MULTIREAD_PART)
+
+struct multiread_part {
+    const char* img_id;
+    int found;
+    uint64_t offset; // of the stored variant, 0 if it is not stored yet
+    uint32_t size;
+    char* content;
+};
+
+static int compare_part_offsets(const void* a, const void* b)
+{
+    const struct multiread_part* pa = *(const struct multiread_part* const*) a;
+    const struct multiread_part* pb = *(const struct multiread_part* const*) b;
+    return (pa->offset > pb->offset) - (pa->offset < pb->offset);
+}
+
+static int read_parts(struct multiread_part parts[], size_t nb_parts, int resolution)
+{
+    struct multiread_part* by_offset[MAX_IMG_IDS];
+    size_t nb_stored = 0;
+    uint64_t total = 0;
+    for (size_t i = 0; i < nb_parts; ++i) {
+        struct img_metadata md;
+        struct img_ext_metadata ext;
+        parts[i].found = strlen(parts[i].img_id) <= MAX_IMG_ID
+                         && view_find_ext(&view, parts[i].img_id, &md, &ext) >= 0;
+        if (parts[i].found && (parts[i].size = variant_size(&md, &ext, resolution)) != 0) {
+            parts[i].offset = variant_offset(&md, &ext, resolution);
+            total += parts[i].size;
+            by_offset[nb_stored++] = &parts[i];
+        }
+    }
+    if (total > MAX_MULTIREAD_SIZE) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    qsort(by_offset, nb_stored, sizeof(by_offset[0]), compare_part_offsets);
+    for (size_t i = 0; i < nb_stored; ++i) {
+        const int errcode = read_blob(&fs_file, by_offset[i]->offset, by_offset[i]->size,
+                                      &by_offset[i]->content);
+        if (errcode != ERR_NONE) {
+            return errcode;
+        }
+    }
+
+    for (size_t i = 0; i < nb_parts; ++i) {
+        if (parts[i].found && parts[i].content == NULL) {
+            struct img_metadata md;
+            const int errcode = read_variant(parts[i].img_id, resolution, &md,
+                                             &parts[i].content, &parts[i].size);
+            if (errcode == ERR_IMAGE_NOT_FOUND) {
+                parts[i].found = 0; // deleted in the meantime
+            } else if (errcode != ERR_NONE) {
+                return errcode;
+            } else if ((total += parts[i].size) > MAX_MULTIREAD_SIZE) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        }
+    }
+    return ERR_NONE;
+}
+
+#define PART_HEADER "--" MULTIPART_BOUNDARY HTTP_LINE_DELIM \
+                    "Content-Type: %s" HTTP_LINE_DELIM \
+                    "Content-ID: <%s>" HTTP_LINE_DELIM \
+                    "Content-Length: %" PRIu32 HTTP_HDR_END_DELIM
+static const char* part_mime(const struct multiread_part* part)
+{
+    const enum image_format format = image_format_of(part->content, part->size);
+    return format < NB_FORMATS ? image_format_mime(format) : "application/octet-stream";
+}
+
+static int multipart_body(const struct multiread_part parts[], size_t nb_parts,
+                          char** body, size_t* body_len)
+{
+    size_t len = strlen(MULTIPART_END);
+    for (size_t i = 0; i < nb_parts; ++i) {
+        if (parts[i].found) {
+            len += (size_t) snprintf(NULL, 0, PART_HEADER, part_mime(&parts[i]),
+                                     parts[i].img_id, parts[i].size)
+                   + parts[i].size + strlen(HTTP_LINE_DELIM);
+        }
+    }
+
+    *body = malloc(len + 1);
+    if (*body == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    char* out = *body;
+    for (size_t i = 0; i < nb_parts; ++i) {
+        if (parts[i].found) {
+            out += sprintf(out, PART_HEADER, part_mime(&parts[i]), parts[i].img_id, parts[i].size);
+            memcpy(out, parts[i].content, parts[i].size);
+            out += parts[i].size;
+            out += sprintf(out, HTTP_LINE_DELIM);
+        }
+    }
+    strcpy(out, MULTIPART_END);
+    *body_len = len;
+    return ERR_NONE;
+}
+
+// Whether reading the images of msg needs a resize
+static int is_multiread_expensive(const struct http_message* msg)
+{
+    char res[MAX_RES_NAME + 1] = {0};
+    if (http_get_var(&msg->uri, "res", res, MAX_RES_NAME) <= 0) {
+        return 0;
+    }
+    const int resolution = imgfs_resolution_atoi(&fs_file, res);
+    if (resolution < 0) {
+        return 0;
+    }
+
+    char* ids_buffer = NULL;
+    const char* img_ids[MAX_IMG_IDS];
+    size_t nb_ids = 0;
+    int expensive = 0;
+    if (get_img_ids(msg, &ids_buffer, img_ids, &nb_ids) == ERR_NONE) {
+        for (size_t i = 0; i < nb_ids && !expensive; ++i) {
+            expensive = strlen(img_ids[i]) <= MAX_IMG_ID && !is_stored(img_ids[i], resolution);
+        }
+    }
+    free(ids_buffer);
+    return expensive;
+}
+
+/**********************************************************************
+ * Content-addressed reads, BLOB_URI followed by the SHA of the image and
+ * optionnaly by ?res=: as the content of a SHA never changes, clients
+ * may cache them forever. The original is read by default.
+ ********************************************************************** */
+static int parse_blob_uri(const struct http_message* msg, unsigned char SHA[SHA256_DIGEST_LENGTH],
+                          int* resolution)
+{
+    const size_t sha_len = 2 * SHA256_DIGEST_LENGTH;
+    const size_t prefix_len = strlen(BLOB_URI);
+    if (msg->uri.len < prefix_len + sha_len
+        || (msg->uri.len > prefix_len + sha_len && msg->uri.val[prefix_len + sha_len] != '?')
+        || sha_from_string(msg->uri.val + prefix_len, SHA) != ERR_NONE) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char res[MAX_RES_NAME + 1] = {0};
+    *resolution = ORIG_RES;
+    if (msg->uri.len > prefix_len + sha_len
+        && http_get_var(&msg->uri, "res", res, MAX_RES_NAME) > 0) {
+        *resolution = imgfs_resolution_atoi(&fs_file, res);
+    }
+    return *resolution < 0 ? ERR_RESOLUTIONS : ERR_NONE;
+}
+
+// Whether reading the variant msg asks for needs a resize or an encoding
+static int is_blob_expensive(const struct http_message* msg)
+{
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    int resolution = ORIG_RES;
+    struct img_metadata md;
+    if (parse_blob_uri(msg, SHA, &resolution) != ERR_NONE
+        || view_find_sha(&view, SHA, &md, NULL) < 0) {
+        return 0;
+    }
+    int accepted[NB_FORMATS];
+    return !is_stored(md.img_id, resolution)
+           || (resolution != ORIG_RES && accepted_formats(msg, accepted) > 0
+               && has_missing_format(md.img_id, resolution, accepted));
+}
+
+/**********************************************************************
+ * Tells the HTTP layer which requests may take long (resizing, inserting)
+ * so that they run from the expensive queue of the worker pool.
+ ********************************************************************** */
+static enum job_class classify_http_message(const struct http_message* msg)
+{
+    if (http_match_uri(msg, URI_ROOT "/insert")) {
+        return JOB_EXPENSIVE;
+    }
+
+    if (http_match_uri(msg, URI_ROOT "/multiread")) {
+        return is_multiread_expensive(msg) ? JOB_EXPENSIVE : JOB_CHEAP;
+    }
+
+    if (http_match_uri(msg, BLOB_URI)) {
+        return is_blob_expensive(msg) ? JOB_EXPENSIVE : JOB_CHEAP;
+    }
+
+    if (http_match_uri(msg, URI_ROOT "/sprite")) { // also matches /sprite_map
+        return is_sprite_missing(msg, http_match_uri(msg, URI_ROOT "/sprite_map"))
+               ? JOB_EXPENSIVE : JOB_CHEAP;
+    }
+
+    if (!http_match_uri(msg, URI_ROOT "/read")) {
+        return JOB_CHEAP;
+    }
+
+    char res[MAX_RES_NAME + 1] = {0};
+    char img_id[MAX_IMG_ID + 1] = {0};
+    if (http_get_var(&msg->uri, "img_id", img_id, MAX_IMG_ID) <= 0) {
+        return JOB_CHEAP; // will be answered with an error
+    }
+
+    uint16_t size[2];
+    const int custom = get_custom_size(msg, size);
+    if (custom != 0) {
+        return custom > 0 && !has_custom_variant(img_id, size) ? JOB_EXPENSIVE : JOB_CHEAP;
+    }
+
+    if (http_get_var(&msg->uri, "res", res, MAX_RES_NAME) <= 0) {
+        return JOB_CHEAP;
+    }
+
+    const int resolution = imgfs_resolution_atoi(&fs_file, res);
+    if (resolution < 0) {
+        return JOB_CHEAP;
+    }
+
+    // Reading a variant that is not stored yet means resizing it,
+    // one in another format that is not cached yet means encoding it
+    int accepted[NB_FORMATS];
+    if (!is_stored(img_id, resolution)
+        || (resolution != ORIG_RES && accepted_formats(msg, accepted) > 0
+            && has_missing_format(img_id, resolution, accepted))) {
+        return JOB_EXPENSIVE;
+    }
+    return JOB_CHEAP;
+}
+
+/**********************************************************************
+ * What server_startup() started, in this order: stopped in reverse order
+ * on failure and by server_shutdown().
+ ********************************************************************** */
+enum startup_stage {
+    STARTED_NONE,
+    STARTED_VIPS,
+    STARTED_FILE,
+    STARTED_VIEW,
+    STARTED_CACHE,
+    STARTED_FLIGHTS,
+    STARTED_WRITER,
+    STARTED_RESIZE,
+    STARTED_HTTP
+};
+
+static void destroy_flight_buckets(size_t nb_buckets)
+{
+    for (size_t i = 0; i < nb_buckets; ++i) {
+        pthread_mutex_destroy(&flight_buckets[i].lock);
+        pthread_cond_destroy(&flight_buckets[i].done);
+    }
+}
+
+static void stop_services(enum startup_stage stage)
+{
+    if (stage >= STARTED_HTTP) http_close();   // Close the HTTP server
+    if (stage >= STARTED_RESIZE) resize_queue_shutdown(); // Finish the variants being created
+    if (stage >= STARTED_WRITER) writer_stop();  // Write the last modifications
+    if (stage >= STARTED_FLIGHTS) destroy_flight_buckets(NB_FLIGHT_BUCKETS);
+    if (stage >= STARTED_CACHE) variant_cache_free();
+    if (stage >= STARTED_VIEW) view_free(&view);
+    if (stage >= STARTED_FILE) do_close(&fs_file); // Close the imgFS file
+    if (stage >= STARTED_VIPS) vips_shutdown();    // Shutdown the VIPS library
+}
 
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name as argv[1], optionnaly port number as argv[2],
+ * optionnaly the number of worker threads as argv[3] and optionnaly the
+ * number of threads creating the variants of new images as argv[4]
+ * (none by default: variants are created on their first read), then
+ * optionnaly how long clients may cache each resolution as RES=SECONDS
+ * ("custom" for the variants read with w and h)
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
     if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;  // Check if enough arguments are provided
     int errcode = ERR_NONE;
+    init_cache_policies();
+    for (int i = 5; i < argc; ++i) {
+        if ((errcode = set_cache_policy(argv[i]))) {
+            return errcode;
+        }
+    }
+
+    // Before any thread may use it
+    if (VIPS_INIT(argv[0])) { // Initialize the VIPS library
+        return ERR_IMGLIB;
+    }
+
     if ((errcode = do_open(argv[1], "rb+", &fs_file))) {// Open the imgFS file
+        stop_services(STARTED_VIPS);
+        return errcode;
+    }
+
+    if ((errcode = view_init(&view, &fs_file))) { // Copy of the metadata for the readers
+        stop_services(STARTED_FILE);
         return errcode;
     }
 
-    if (pthread_mutex_init(&mutex, NULL)) { // Initialize the mutex
-        return ERR_IO;
+    if ((errcode = variant_cache_init(VARIANT_CACHE_SIZE))) { // Other formats of the variants
+        stop_services(STARTED_VIEW);
+        return errcode;
+    }
+
+    for (size_t i = 0; i < NB_FLIGHT_BUCKETS; ++i) {
+        if (pthread_mutex_init(&flight_buckets[i].lock, NULL)) {
+            destroy_flight_buckets(i);
+            stop_services(STARTED_CACHE);
+            return ERR_IO;
+        }
+        if (pthread_cond_init(&flight_buckets[i].done, NULL)) {
+            pthread_mutex_destroy(&flight_buckets[i].lock);
+            destroy_flight_buckets(i);
+            stop_services(STARTED_CACHE);
+            return ERR_IO;
+        }
+    }
+
+    if ((errcode = writer_start(&fs_file, &view))) { // From now on, the only one modifying fs_file
+        stop_services(STARTED_FLIGHTS);
+        return errcode;
     }
     print_header(&fs_file.header);  // Print the header information of the imgFS file
 
+    if ((errcode = resize_queue_init(argc > 4 ? atouint32(argv[4]) : 0, eager_resize))) {
+        stop_services(STARTED_WRITER);
+        return errcode;
+    }
+
     // Set the server port, use default if not provided
     server_port = argc > 2 ? atouint16(argv[2]) : DEFAULT_LISTENING_PORT;
-    // Initialize the HTTP server
-    uint16_t listening_port = (uint16_t) http_init(server_port, handle_http_message);
+    // Size of the worker pool, default is chosen by the HTTP layer
+    if (argc > 3) {
+        http_set_nb_workers(atouint32(argv[3]));
+    }
+    http_set_classifier(classify_http_message);
+    http_set_expect_handler(expect_insert);
 
-    if (VIPS_INIT(argv[0])) { // Initialize the VIPS library
-        return ERR_IMGLIB;
+    // Initialize the HTTP server
+    const int listening_socket = http_init(server_port, handle_http_message);
+    if (listening_socket < 0) {
+        stop_services(STARTED_RESIZE);
+        return listening_socket;
     }
 
     printf("ImgFS server started on http://localhost:%d\n", server_port);
@@ -65,10 +1058,7 @@ int server_startup (int argc, char **argv)
 void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
-    http_close();   // Close the HTTP server
-    pthread_mutex_destroy(&mutex);  // Destroy the mutex
-    do_close(&fs_file); // Close the imgFS file
-    vips_shutdown();    // Shutdown the VIPS library
+    stop_services(STARTED_HTTP);
 }
 
 /**********************************************************************
@@ -105,16 +1095,42 @@ static int reply_302_msg(int connection)
 /**********************************************************************
  * Handler for each actions
  ********************************************************************** */
-int handle_list_call(int connection) {
+int handle_list_call(struct http_message* msg, int connection) {
     char* output = NULL;
     int errcode = 0;
-    pthread_mutex_lock(&mutex);
-    if ((errcode = do_list(&fs_file, JSON, &output))) { // List the contents of imgFS
-        pthread_mutex_unlock(&mutex);
+    // List a consistent copy of each slot (JSON output only uses the metadata
+    // and the previews)
+    struct imgfs_file snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.header.max_files = (uint32_t) view.nb_slots;
+    snapshot.header.flags = fs_file.header.flags & IMGFS_PREVIEWS;
+    const size_t region_size = metadata_region_size(&snapshot.header);
+    snapshot.metadata = calloc(1, region_size > 0 ? region_size : 1);
+    if (snapshot.metadata == NULL) {
+        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    }
+    for (size_t i = 0; i < view.nb_slots; ++i) {
+        struct img_preview* preview = preview_metadata(&snapshot, i);
+        if (preview != NULL) {
+            view_read_preview(&view, i, &snapshot.metadata[i], preview);
+        } else {
+            view_read(&view, i, &snapshot.metadata[i]);
+        }
+        if (snapshot.metadata[i].is_valid == NON_EMPTY) {
+            ++snapshot.header.nb_files;
+        }
+    }
+
+    // With ?blobs=1, also the content-addressed URL of each image
+    char blobs[2] = {0};
+    const enum do_list_mode mode = http_get_var(&msg->uri, "blobs", blobs, 1) > 0 && blobs[0] == '1'
+                                   ? JSON_BLOBS : JSON;
+    errcode = do_list(&snapshot, mode, &output); // List the contents of imgFS
+    free(snapshot.metadata);
+    if (errcode != ERR_NONE) {
         return reply_error_msg(connection, errcode);
     }
 
-    pthread_mutex_unlock(&mutex);
     errcode = http_reply(connection, HTTP_OK,
                  "Content-Type: application/json" HTTP_LINE_DELIM,
                  output, strlen(output));
@@ -123,9 +1139,223 @@ int handle_list_call(int connection) {
     return errcode;
 }
 
+int handle_stats_call(int connection) {
+    struct thread_pool_stats stats;
+    thread_pool_get_stats(&stats);
+
+    static const char* const class_names[NB_JOB_CLASSES] = { "cheap", "expensive" };
+    struct json_object* obj = json_object_new_object();
+    json_object_object_add(obj, "workers", json_object_new_int64((int64_t) stats.nb_workers));
+    json_object_object_add(obj, "cheap_only_workers",
+                           json_object_new_int64((int64_t) stats.nb_cheap_only));
+    json_object_object_add(obj, "steals", json_object_new_int64((int64_t) stats.nb_steals));
+    for (int c = 0; c < NB_JOB_CLASSES; ++c) {
+        struct json_object* queue = json_object_new_object();
+        json_object_object_add(queue, "depth",
+                               json_object_new_int64((int64_t) stats.queue_depth[c]));
+        json_object_object_add(queue, "jobs", json_object_new_int64((int64_t) stats.nb_jobs[c]));
+        json_object_object_add(queue, "avg_wait_us", json_object_new_int64(stats.nb_jobs[c] == 0 ? 0 :
+                               (int64_t) (stats.total_wait_us[c] / stats.nb_jobs[c])));
+        json_object_object_add(queue, "max_wait_us",
+                               json_object_new_int64((int64_t) stats.max_wait_us[c]));
+        json_object_object_add(obj, class_names[c], queue);
+    }
+
+    struct json_object* resizes = json_object_new_object();
+    json_object_object_add(resizes, "done",
+                           json_object_new_int64((int64_t) __atomic_load_n(&nb_resizes, __ATOMIC_RELAXED)));
+    json_object_object_add(resizes, "coalesced",
+                           json_object_new_int64((int64_t) __atomic_load_n(&nb_coalesced, __ATOMIC_RELAXED)));
+    json_object_object_add(obj, "resizes", resizes);
+
+    struct resize_queue_stats qstats;
+    resize_queue_get_stats(&qstats);
+    struct json_object* eager = json_object_new_object();
+    json_object_object_add(eager, "workers", json_object_new_int64((int64_t) qstats.nb_workers));
+    json_object_object_add(eager, "depth", json_object_new_int64((int64_t) qstats.depth));
+    json_object_object_add(eager, "queued", json_object_new_int64((int64_t) qstats.nb_queued));
+    json_object_object_add(eager, "done", json_object_new_int64((int64_t) qstats.nb_done));
+    json_object_object_add(eager, "dropped", json_object_new_int64((int64_t) qstats.nb_dropped));
+    json_object_object_add(obj, "eager", eager);
+
+    struct writer_stats wstats;
+    writer_get_stats(&wstats);
+    struct json_object* writes = json_object_new_object();
+    json_object_object_add(writes, "ops", json_object_new_int64((int64_t) wstats.nb_ops));
+    json_object_object_add(writes, "batches", json_object_new_int64((int64_t) wstats.nb_batches));
+    json_object_object_add(writes, "max_batch", json_object_new_int64((int64_t) wstats.max_batch));
+    json_object_object_add(obj, "writes", writes);
+
+    struct variant_cache_stats cstats;
+    variant_cache_get_stats(&cstats);
+    struct json_object* cache = json_object_new_object();
+    json_object_object_add(cache, "entries", json_object_new_int64((int64_t) cstats.nb_entries));
+    json_object_object_add(cache, "size", json_object_new_int64((int64_t) cstats.size));
+    json_object_object_add(cache, "capacity", json_object_new_int64((int64_t) cstats.capacity));
+    json_object_object_add(cache, "hits", json_object_new_int64((int64_t) cstats.nb_hits));
+    json_object_object_add(cache, "misses", json_object_new_int64((int64_t) cstats.nb_misses));
+    json_object_object_add(cache, "evictions", json_object_new_int64((int64_t) cstats.nb_evictions));
+    json_object_object_add(obj, "variant_cache", cache);
+
+    const char* output = json_object_to_json_string(obj);
+    int errcode = http_reply(connection, HTTP_OK,
+                             "Content-Type: application/json" HTTP_LINE_DELIM,
+                             output, strlen(output));
+    json_object_put(obj);
+    return errcode;
+}
+
+/**********************************************************************
+ * Range requests: a stored variant is sent in part, as
+ * "206 Partial Content", reading only the requested bytes. Returns
+ * ERR_INVALID_ARGUMENT, without replying, if the whole variant is to be
+ * sent instead: invalid Range header or variant not stored yet.
+ ********************************************************************** */
+#define RANGE_PART_HEADER "--" MULTIPART_BOUNDARY HTTP_LINE_DELIM \
+                          "Content-Type: image/jpeg" HTTP_LINE_DELIM \
+                          "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu32 HTTP_HDR_END_DELIM
+
+static int reply_range(int connection, const struct img_metadata* md,
+                       const struct img_ext_metadata* ext, int resolution, int policy,
+                       const struct http_string* range)
+{
+    const uint32_t size = variant_size(md, ext, resolution);
+    const uint64_t offset = variant_offset(md, ext, resolution);
+    if (size == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct http_range ranges[MAX_RANGES];
+    const int nb_ranges = http_parse_range(range, size, ranges, MAX_RANGES);
+    if (nb_ranges < 0) {
+        return nb_ranges;
+    }
+
+    char etag[MAX_ETAG + 1];
+    char name[MAX_VARIANT_NAME + 1];
+    char cache[MAX_CACHE_HEADERS];
+    format_variant_name(FORMAT_JPEG, resolution, name);
+    format_etag(md, name, etag);
+    format_cache_headers(etag, policy, resolution != ORIG_RES, cache);
+    char headers[MAX_CACHE_HEADERS + 128];
+    if (nb_ranges == 0) {
+        snprintf(headers, sizeof(headers), "Content-Range: bytes */%" PRIu32 HTTP_LINE_DELIM, size);
+        return http_reply(connection, HTTP_UNSATISFIABLE, headers, "", 0);
+    }
+
+    if (nb_ranges == 1) {
+        char* buffer = NULL;
+        const uint32_t len = (uint32_t) (ranges[0].last - ranges[0].first + 1);
+        int errcode = read_blob(&fs_file, offset + ranges[0].first, len, &buffer);
+        if (errcode != ERR_NONE) {
+            return reply_error_msg(connection, errcode);
+        }
+        snprintf(headers, sizeof(headers), "Content-Type: image/jpeg" HTTP_LINE_DELIM "%s"
+                 "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu32 HTTP_LINE_DELIM,
+                 cache, ranges[0].first, ranges[0].last, size);
+        errcode = http_reply(connection, HTTP_PARTIAL, headers, buffer, len);
+        free(buffer);
+        return errcode;
+    }
+
+    // Several ranges: one part each, read straight into the body
+    size_t body_len = strlen(MULTIPART_END);
+    for (int i = 0; i < nb_ranges; ++i) {
+        body_len += (size_t) snprintf(NULL, 0, RANGE_PART_HEADER, ranges[i].first, ranges[i].last, size)
+                    + (size_t) (ranges[i].last - ranges[i].first + 1) + strlen(HTTP_LINE_DELIM);
+    }
+    char* body = malloc(body_len + 1);
+    if (body == NULL) {
+        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    }
+    char* out = body;
+    for (int i = 0; i < nb_ranges; ++i) {
+        out += sprintf(out, RANGE_PART_HEADER, ranges[i].first, ranges[i].last, size);
+        char* part = NULL;
+        const uint32_t len = (uint32_t) (ranges[i].last - ranges[i].first + 1);
+        const int errcode = read_blob(&fs_file, offset + ranges[i].first, len, &part);
+        if (errcode != ERR_NONE) {
+            free(body);
+            return reply_error_msg(connection, errcode);
+        }
+        memcpy(out, part, len);
+        free(part);
+        out += len;
+        out += sprintf(out, HTTP_LINE_DELIM);
+    }
+    strcpy(out, MULTIPART_END);
+
+    snprintf(headers, sizeof(headers), "Content-Type: multipart/byteranges; boundary="
+             MULTIPART_BOUNDARY HTTP_LINE_DELIM "%s", cache);
+    const int errcode = http_reply(connection, HTTP_PARTIAL, headers, body, body_len);
+    free(body);
+    return errcode;
+}
+
+/**********************************************************************
+ * Replies with a variant of the image at index, md and ext being a copy
+ * of its slot, cached by clients as the given policy says.
+ ********************************************************************** */
+static int reply_variant(const struct http_message* msg, int connection, size_t index,
+                         const struct img_metadata* md, const struct img_ext_metadata* ext,
+                         int resolution, int policy)
+{
+    // Resized variants are served in the smallest format the client accepts
+    int accepted[NB_FORMATS];
+    const int negotiated = resolution != ORIG_RES && accepted_formats(msg, accepted) > 0;
+
+    // A client that already has the variant is answered from the metadata alone
+    char etag[MAX_ETAG + 1];
+    const struct http_string* if_none_match = http_get_header(msg, "If-None-Match");
+    if (if_none_match != NULL
+        && has_variant(if_none_match, md, resolution, negotiated ? accepted : NULL, etag)) {
+        return reply_304_msg(connection, etag, policy, resolution != ORIG_RES);
+    }
+
+    // Only the requested bytes of stored JPEG content are read
+    int errcode = ERR_NONE;
+    const struct http_string* range = http_get_header(msg, "Range");
+    if (range != NULL && !negotiated) {
+        errcode = reply_range(connection, md, ext, resolution, policy, range);
+        if (errcode != ERR_INVALID_ARGUMENT) {
+            return errcode;
+        }
+    }
+
+    char* buffer = NULL;
+    uint32_t size = 0;
+    errcode = read_slot_variant(index, md, ext, resolution, &buffer, &size); // Read the image from imgFS
+    if (errcode != ERR_NONE) {
+        free(buffer);
+        return reply_error_msg(connection, errcode);
+    }
+
+    const enum image_format format = negotiated
+                                     ? negotiate_format(md, resolution, accepted, &buffer, &size)
+                                     : FORMAT_JPEG;
+    char name[MAX_VARIANT_NAME + 1];
+    char cache[MAX_CACHE_HEADERS];
+    char headers[MAX_CACHE_HEADERS + 64];
+    format_variant_name(format, resolution, name);
+    format_etag(md, name, etag);
+    format_cache_headers(etag, policy, resolution != ORIG_RES, cache);
+    snprintf(headers, sizeof(headers), "Content-Type: %s" HTTP_LINE_DELIM "%s%s",
+             image_format_mime(format),
+             format == FORMAT_JPEG ? "Accept-Ranges: bytes" HTTP_LINE_DELIM : "", cache);
+    errcode = http_reply(connection,HTTP_OK, headers, buffer, size); // Reply with the image
+    free(buffer);
+    return errcode;
+}
+
 int handle_read_call(struct http_message* msg, int connection) {
-    char res[6] = {0};
-    if (!http_get_var(&msg->uri, "res", res, 6)) {// Get the resolution parameter
+    uint16_t custom_size[2];
+    const int custom = get_custom_size(msg, custom_size); // Any size, instead of a resolution
+    if (custom < 0) {
+        return reply_error_msg(connection, custom);
+    }
+
+    char res[MAX_RES_NAME + 1] = {0};
+    if (!custom && !http_get_var(&msg->uri, "res", res, MAX_RES_NAME)) {// Get the resolution parameter
         return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
@@ -134,27 +1364,130 @@ int handle_read_call(struct http_message* msg, int connection) {
         return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
-    int errcode = 0;
     char* buffer = NULL;
     uint32_t size = 0;
-    pthread_mutex_lock(&mutex);
-
-    if ((errcode =
-            do_read(img_id, resolution_atoi(res),
-         &buffer, &size, &fs_file)) // Read the image from imgFS
-       ) {
+    int errcode = ERR_NONE;
+    struct img_metadata md;
+    char etag[MAX_ETAG + 1];
+    char name[MAX_VARIANT_NAME + 1];
+    char cache[MAX_CACHE_HEADERS];
+    char headers[MAX_CACHE_HEADERS + 64];
+    const struct http_string* if_none_match = http_get_header(msg, "If-None-Match");
+    if (custom) {
+        // A client that already has the variant is answered from the metadata alone
+        if (if_none_match != NULL && view_find(&view, img_id, &md) >= 0) {
+            sized_variant_name(&md, custom_size, name);
+            format_etag(&md, name, etag);
+            if (http_etag_match(if_none_match, etag)) {
+                return reply_304_msg(connection, etag, CUSTOM_POLICY, 0);
+            }
+        }
 
-        pthread_mutex_unlock(&mutex);
-        if (buffer != NULL) {
+        errcode = read_custom_variant(img_id, custom_size, &md, &buffer, &size);
+        if (errcode != ERR_NONE) {
             free(buffer);
+            return reply_error_msg(connection, errcode);
         }
+        sized_variant_name(&md, custom_size, name);
+        format_etag(&md, name, etag);
+        format_cache_headers(etag, CUSTOM_POLICY, 0, cache);
+        snprintf(headers, sizeof(headers), "Content-Type: image/jpeg" HTTP_LINE_DELIM "%s", cache);
+        errcode = http_reply(connection, HTTP_OK, headers, buffer, size);
+        free(buffer);
+        return errcode;
+    }
+
+    const int resolution = imgfs_resolution_atoi(&fs_file, res);
+    if (resolution < 0) {
+        return reply_error_msg(connection, ERR_RESOLUTIONS);
+    }
+
+    struct img_ext_metadata ext;
+    const int index = view_find_ext(&view, img_id, &md, &ext);
+    if (index < 0) {
+        return reply_error_msg(connection, ERR_IMAGE_NOT_FOUND);
+    }
+    return reply_variant(msg, connection, (size_t) index, &md, &ext, resolution, resolution);
+}
+
+int handle_blob_call(struct http_message* msg, int connection) {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    int resolution = ORIG_RES;
+    const int errcode = parse_blob_uri(msg, SHA, &resolution);
+    if (errcode != ERR_NONE) {
         return reply_error_msg(connection, errcode);
     }
-    pthread_mutex_unlock(&mutex);
-    errcode = http_reply(connection,HTTP_OK,
-                         "Content-Type: image/jpeg" HTTP_LINE_DELIM,
-                         buffer, size); // Reply with the image
-    free(buffer);
+
+    struct img_metadata md;
+    struct img_ext_metadata ext;
+    const int index = view_find_sha(&view, SHA, &md, &ext);
+    if (index < 0) {
+        return reply_error_msg(connection, ERR_IMAGE_NOT_FOUND);
+    }
+    return reply_variant(msg, connection, (size_t) index, &md, &ext, resolution, IMMUTABLE_POLICY);
+}
+
+int handle_multiread_call(struct http_message* msg, int connection) {
+    char res[MAX_RES_NAME + 1] = {0};
+    if (http_get_var(&msg->uri, "res", res, MAX_RES_NAME) <= 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+    const int resolution = imgfs_resolution_atoi(&fs_file, res);
+    if (resolution < 0) {
+        return reply_error_msg(connection, ERR_RESOLUTIONS);
+    }
+
+    char* ids_buffer = NULL;
+    const char* img_ids[MAX_IMG_IDS];
+    size_t nb_ids = 0;
+    struct multiread_part parts[MAX_IMG_IDS];
+    memset(parts, 0, sizeof(parts));
+    char* body = NULL;
+    size_t body_len = 0;
+    int errcode = get_img_ids(msg, &ids_buffer, img_ids, &nb_ids);
+    if (errcode == ERR_NONE) {
+        for (size_t i = 0; i < nb_ids; ++i) {
+            parts[i].img_id = img_ids[i];
+        }
+        errcode = read_parts(parts, nb_ids, resolution);
+    }
+    if (errcode == ERR_NONE) {
+        errcode = multipart_body(parts, nb_ids, &body, &body_len);
+    }
+    for (size_t i = 0; i < nb_ids; ++i) {
+        free(parts[i].content);
+    }
+    free(ids_buffer);
+    if (errcode != ERR_NONE) {
+        return reply_error_msg(connection, errcode);
+    }
+
+    errcode = http_reply(connection, HTTP_OK,
+                         "Content-Type: multipart/mixed; boundary=" MULTIPART_BOUNDARY HTTP_LINE_DELIM,
+                         body, body_len);
+    free(body);
+    return errcode;
+}
+
+int handle_sprite_call(struct http_message* msg, int connection, int map) {
+    struct sprite_request req;
+    void* content = NULL;
+    size_t len = 0;
+    int errcode = parse_sprite_request(msg, &req);
+    if (errcode == ERR_NONE
+        && !variant_cache_get(req.key, map ? SPRITE_MAP_NAME : SPRITE_IMAGE_NAME, &content, &len)) {
+        errcode = build_sprite(&req, map, &content, &len);
+    }
+    free_sprite_request(&req);
+    if (errcode != ERR_NONE) {
+        return reply_error_msg(connection, errcode);
+    }
+
+    errcode = http_reply(connection, HTTP_OK,
+                         map ? "Content-Type: application/json" HTTP_LINE_DELIM
+                             : "Content-Type: image/jpeg" HTTP_LINE_DELIM,
+                         content, len);
+    free(content);
     return errcode;
 }
 
@@ -164,38 +1497,111 @@ int handle_delete_call(struct http_message* msg, int connection) {
         return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
-    int errcode = 0;
-    pthread_mutex_lock(&mutex);
-    if ((errcode = do_delete(img_id, &fs_file))) {
-        pthread_mutex_unlock(&mutex);
+    const int errcode = writer_delete(img_id);
+    if (errcode != ERR_NONE) {
         return reply_error_msg(connection, errcode);
     }
-    pthread_mutex_unlock(&mutex);
     return reply_302_msg(connection);
 }
 
+/**********************************************************************
+ * Inserts without uploading: a client sending the SHA of its image with
+ * ?sha= gets it inserted under its name from the stored copy, if any.
+ * Otherwise it is told (404) to send the content.
+ ********************************************************************** */
+static int get_sha_var(const struct http_message* msg, unsigned char SHA[SHA256_DIGEST_LENGTH])
+{
+    char sha[2 * SHA256_DIGEST_LENGTH + 1] = {0};
+    if (http_get_var(&msg->uri, "sha", sha, sizeof(sha) - 1) != 2 * SHA256_DIGEST_LENGTH) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return sha_from_string(sha, SHA);
+}
+
+// Have the variants of a new image ready before they are read, if enabled
+static void prepare_variants(const char* img_id)
+{
+    struct img_metadata md;
+    const int index = view_find(&view, img_id, &md);
+    if (index >= 0) {
+        resize_queue_push((size_t) index, md.SHA);
+    }
+}
+
+static int insert_existing(const struct http_message* msg, const char* name)
+{
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    int errcode = get_sha_var(msg, SHA);
+    if (errcode == ERR_NONE) {
+        errcode = writer_insert_existing(SHA, name);
+    }
+    if (errcode == ERR_NONE) {
+        prepare_variants(name);
+    }
+    return errcode;
+}
+
+static int reply_needs_body(int connection)
+{
+    const char msg[] = "Error: no image with this SHA, send its content\n";
+    return http_reply(connection, HTTP_NOT_FOUND, "", msg, strlen(msg));
+}
+
+// Answers the headers of an insert sent with "Expect: 100-continue" when
+// its content is already stored; other requests get their body read.
+static int expect_insert(const struct http_message* msg, int connection)
+{
+    char name[MAX_IMG_ID + 5] = {0};
+    if (!http_match_uri(msg, URI_ROOT "/insert") || !http_match_verb(&msg->method, "POST")
+        || http_get_var(&msg->uri, "name", name, MAX_IMG_ID + 4) <= 0) {
+        return 0;
+    }
+
+    const int errcode = insert_existing(msg, name);
+    if (errcode == ERR_INVALID_ARGUMENT || errcode == ERR_IMAGE_NOT_FOUND) {
+        return 0; // no SHA, or unknown: the content is needed
+    }
+    if (errcode != ERR_NONE) {
+        reply_error_msg(connection, errcode);
+    } else {
+        reply_302_msg(connection);
+    }
+    return 1;
+}
+
+// HEAD with ?sha=: whether an insert with this SHA needs the content
+static int handle_insert_check(const struct http_message* msg, int connection)
+{
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    if (get_sha_var(msg, SHA) != ERR_NONE) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+    return http_reply(connection, view_find_sha(&view, SHA, NULL, NULL) >= 0
+                      ? HTTP_OK : HTTP_NOT_FOUND, "", "", 0);
+}
+
 int handle_insert_call(struct http_message* msg, int connection) {
     char name[MAX_IMG_ID +5] = {0};
-    if (!http_get_var(&msg->uri, "name", name, MAX_IMG_ID +5)) {
+    if (!http_get_var(&msg->uri, "name", name, MAX_IMG_ID +4)) {
         return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
-    size_t size = msg->body.len;
-    char* buffer = calloc(1, size);
-    if (buffer == NULL) {
-        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    if (msg->body.len == 0) { // already stored, hopefully
+        const int errcode = insert_existing(msg, name);
+        if (errcode == ERR_IMAGE_NOT_FOUND) {
+            return reply_needs_body(connection);
+        }
+        return errcode != ERR_NONE ? reply_error_msg(connection, errcode)
+                                   : reply_302_msg(connection);
     }
 
-    memcpy(buffer, msg->body.val, size);
-    int errcode = 0;
-    pthread_mutex_lock(&mutex);
-    if ((errcode = do_insert(buffer, size, name, &fs_file))) {
-        pthread_mutex_unlock(&mutex);
-        free(buffer);
+    // The body stays valid until we reply, the writer can use it in place
+    const int errcode = writer_insert(msg->body.val, msg->body.len, name);
+    if (errcode != ERR_NONE) {
         return reply_error_msg(connection, errcode);
     }
-    pthread_mutex_unlock(&mutex);
-    free(buffer);
+
+    prepare_variants(name);
     return reply_302_msg(connection);
 }
 
@@ -215,7 +1621,16 @@ int handle_http_message(struct http_message* msg, int connection)
                  (int) msg->uri.len, msg->uri.val);
 
     if (http_match_uri(msg, URI_ROOT "/list")) {        // Handle list call
-        return handle_list_call(connection);
+        return handle_list_call(msg, connection);
+    }
+
+    else if (http_match_uri(msg, URI_ROOT "/stats")) {  // Handle worker pool statistics
+        return handle_stats_call(connection);
+    }
+
+    else if (http_match_uri(msg, URI_ROOT "/insert")
+            && http_match_verb(&msg->method, "HEAD")) {             // Handle insert check
+        return handle_insert_check(msg, connection);
     }
 
     else if (http_match_uri(msg, URI_ROOT "/insert")
@@ -227,6 +1642,22 @@ int handle_http_message(struct http_message* msg, int connection)
         return handle_read_call(msg, connection);
     }
 
+    else if (http_match_uri(msg, BLOB_URI)) {   // Handle content-addressed read call
+        return handle_blob_call(msg, connection);
+    }
+
+    else if (http_match_uri(msg, URI_ROOT "/multiread")) {  // Handle multi-read call
+        return handle_multiread_call(msg, connection);
+    }
+
+    else if (http_match_uri(msg, URI_ROOT "/sprite_map")) {   // Handle sprite map call
+        return handle_sprite_call(msg, connection, 1);
+    }
+
+    else if (http_match_uri(msg, URI_ROOT "/sprite")) { // Handle sprite call
+        return handle_sprite_call(msg, connection, 0);
+    }
+
     else if (http_match_uri(msg, URI_ROOT "/delete")) { // Handle delete call
         return handle_delete_call(msg, connection);
     } 
@@ -23,7 +23,7 @@
  * @param SHA The SHA256 hash.
  * @param sha_string The output string.
  */
-static void sha_to_string(const unsigned char* SHA, char* sha_string) {
+void sha_to_string(const unsigned char* SHA, char* sha_string) {
 
     if (SHA == NULL) return;
     for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
@@ -33,6 +33,28 @@ static void sha_to_string(const unsigned char* SHA, char* sha_string) {
     sha_string[2 * SHA256_DIGEST_LENGTH] = '\0';
 }
 
+int sha_from_string(const char* sha_string, unsigned char* SHA)
+{
+    M_REQUIRE_NON_NULL(sha_string);
+    M_REQUIRE_NON_NULL(SHA);
+
+    for (int i = 0; i < 2 * SHA256_DIGEST_LENGTH; ++i) {
+        const char c = sha_string[i];
+        const int digit = '0' <= c && c <= '9' ? c - '0'
+                          : 'a' <= c && c <= 'f' ? c - 'a' + 10
+                          : 'A' <= c && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (i % 2 == 0) {
+            SHA[i / 2] = (unsigned char) (digit << 4);
+        } else {
+            SHA[i / 2] |= (unsigned char) digit;
+        }
+    }
+    return ERR_NONE;
+}
+
 /*******************************************************************
  * imgFS header display.
  *
@@ -107,14 +129,21 @@ int do_open(const char* fileName, const char* openingMode, struct imgfs_file * i
         return ERR_IO;
     }
 
-    //Reading metadatas
-    struct img_metadata* ptr = calloc((image -> header).max_files,
-                                        sizeof(struct img_metadata));
+    if ((image->header.nb_res != 0
+         && (image->header.nb_res <= NB_RES || image->header.nb_res > MAX_RES))
+        || (image->header.flags & ~IMGFS_FLAGS) != 0) {
+        fclose(image -> file);
+        return ERR_IO;
+    }
+
+    //Reading metadatas, and the additional resolutions with theirs if any
+    const size_t region_size = metadata_region_size(&image->header);
+    struct img_metadata* ptr = calloc(1, region_size > 0 ? region_size : 1);
     if(ptr == NULL) return ERR_IO;
     else  image -> metadata = ptr;
 
-    if (fread(image->metadata, sizeof(struct img_metadata),
-(image -> header).max_files, image -> file) != (image -> header).max_files) {
+    if (fread(image->metadata, region_size, NUM_OF_FILES, image -> file) != NUM_OF_FILES
+        && region_size > 0) {
 
         free(image->metadata);
         fclose(image -> file);
@@ -163,4 +192,239 @@ int resolution_atoi (const char* str)
         return ORIG_RES;
     }
     return -1;
-}
\ No newline at end of file
+}
+
+/*******************************************************************
+ * Convert resolution string to integer, additional resolutions included.
+ *
+ * @param imgfs_file The imgfs_file struct holding the resolution table.
+ * @param str The resolution string.
+ * @return The corresponding resolution integer value, or -1 if the string is invalid.
+ */
+int imgfs_resolution_atoi(const struct imgfs_file* imgfs_file, const char* str)
+{
+    const int resolution = resolution_atoi(str);
+    if (resolution >= 0 || imgfs_file == NULL || str == NULL) {
+        return resolution;
+    }
+
+    const struct imgfs_resolution* extra = extra_resolutions(imgfs_file);
+    for (int res = NB_RES; extra != NULL && res < nb_resolutions(imgfs_file); ++res) {
+        if (!strncmp(str, extra[res - NB_RES].name, MAX_RES_NAME + 1)) {
+            return res;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************
+ * Additional resolutions and previews.
+ *
+ * They follow the metadata array, in memory as on disk.
+ */
+size_t metadata_region_size(const struct imgfs_header* header)
+{
+    size_t size = header->max_files * sizeof(struct img_metadata);
+    if (header->nb_res != 0) {
+        size += NB_EXTRA_RES * sizeof(struct imgfs_resolution)
+                + header->max_files * sizeof(struct img_ext_metadata);
+    }
+    if (header->flags & IMGFS_PREVIEWS) {
+        size += header->max_files * sizeof(struct img_preview);
+    }
+    return size;
+}
+
+int nb_resolutions(const struct imgfs_file* imgfs_file)
+{
+    return imgfs_file->header.nb_res != 0 ? (int) imgfs_file->header.nb_res : NB_RES;
+}
+
+struct imgfs_resolution* extra_resolutions(const struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file->header.nb_res == 0 || imgfs_file->metadata == NULL) {
+        return NULL;
+    }
+    return (struct imgfs_resolution*) (void*) (imgfs_file->metadata + imgfs_file->header.max_files);
+}
+
+struct img_ext_metadata* ext_metadata(const struct imgfs_file* imgfs_file, size_t index)
+{
+    struct imgfs_resolution* extra = extra_resolutions(imgfs_file);
+    if (extra == NULL || index >= imgfs_file->header.max_files) {
+        return NULL;
+    }
+    return (struct img_ext_metadata*) (void*) (extra + NB_EXTRA_RES) + index;
+}
+
+struct img_preview* preview_metadata(const struct imgfs_file* imgfs_file, size_t index)
+{
+    if (!(imgfs_file->header.flags & IMGFS_PREVIEWS) || imgfs_file->metadata == NULL
+        || index >= imgfs_file->header.max_files) {
+        return NULL;
+    }
+    // Last part of the region
+    const size_t previews_size = imgfs_file->header.max_files * sizeof(struct img_preview);
+    char* region = (char*) imgfs_file->metadata;
+    return (struct img_preview*) (void*) (region + metadata_region_size(&imgfs_file->header)
+                                          - previews_size) + index;
+}
+
+int resolution_size(const struct imgfs_file* imgfs_file, int resolution,
+                    uint16_t* width, uint16_t* height)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(width);
+    M_REQUIRE_NON_NULL(height);
+
+    if (resolution < 0 || resolution == ORIG_RES || resolution >= nb_resolutions(imgfs_file)) {
+        return ERR_RESOLUTIONS;
+    }
+    if (resolution < NB_RES) {
+        *width = imgfs_file->header.resized_res[2 * resolution];
+        *height = imgfs_file->header.resized_res[2 * resolution + 1];
+    } else {
+        const struct imgfs_resolution* extra = extra_resolutions(imgfs_file);
+        *width = extra[resolution - NB_RES].width;
+        *height = extra[resolution - NB_RES].height;
+    }
+    return ERR_NONE;
+}
+
+uint32_t variant_size(const struct img_metadata* md, const struct img_ext_metadata* ext,
+                      int resolution)
+{
+    if (resolution >= 0 && resolution < NB_RES) {
+        return md->size[resolution];
+    }
+    return ext != NULL && resolution >= NB_RES && resolution < MAX_RES
+           ? ext->size[resolution - NB_RES] : 0;
+}
+
+uint64_t variant_offset(const struct img_metadata* md, const struct img_ext_metadata* ext,
+                        int resolution)
+{
+    if (resolution >= 0 && resolution < NB_RES) {
+        return md->offset[resolution];
+    }
+    return ext != NULL && resolution >= NB_RES && resolution < MAX_RES
+           ? ext->offset[resolution - NB_RES] : 0;
+}
+
+void set_variant(struct img_metadata* md, struct img_ext_metadata* ext, int resolution,
+                 uint32_t size, uint64_t offset)
+{
+    if (resolution >= 0 && resolution < NB_RES) {
+        md->size[resolution] = size;
+        md->offset[resolution] = offset;
+    } else if (ext != NULL && resolution >= NB_RES && resolution < MAX_RES) {
+        ext->size[resolution - NB_RES] = size;
+        ext->offset[resolution - NB_RES] = offset;
+    }
+}
+
+/*******************************************************************
+ * Write the header to disk.
+ *
+ * Writes the in-memory header at the beginning of the imgFS file.
+ * The stream is not flushed.
+ * @param imgfs_file The imgfs_file struct holding the header.
+ * @return 0 on success, ERR_IO on failure.
+ */
+int write_header(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    if (fseek(imgfs_file->file, 0, SEEK_SET) ||
+        fwrite(&imgfs_file->header, sizeof(struct imgfs_header), NUM_OF_FILES,
+               imgfs_file->file) != NUM_OF_FILES) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Write one metadata slot to disk.
+ *
+ * Writes the in-memory metadata at index to its place in the imgFS file.
+ * The stream is not flushed.
+ * @param imgfs_file The imgfs_file struct holding the metadata.
+ * @param index The index of the slot.
+ * @return 0 on success, ERR_IO on failure.
+ */
+int write_metadata(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    if (index >= imgfs_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const long position = (long) (sizeof(struct imgfs_header) + index * sizeof(struct img_metadata));
+    if (fseek(imgfs_file->file, position, SEEK_SET) ||
+        fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), NUM_OF_FILES,
+               imgfs_file->file) != NUM_OF_FILES) {
+        return ERR_IO;
+    }
+
+    const struct img_ext_metadata* ext = ext_metadata(imgfs_file, index);
+    if (ext != NULL) {
+        const long ext_position = (long) (sizeof(struct imgfs_header)
+                                          + imgfs_file->header.max_files * sizeof(struct img_metadata)
+                                          + NB_EXTRA_RES * sizeof(struct imgfs_resolution)
+                                          + index * sizeof(struct img_ext_metadata));
+        if (fseek(imgfs_file->file, ext_position, SEEK_SET) ||
+            fwrite(ext, sizeof(struct img_ext_metadata), NUM_OF_FILES,
+                   imgfs_file->file) != NUM_OF_FILES) {
+            return ERR_IO;
+        }
+    }
+
+    const struct img_preview* preview = preview_metadata(imgfs_file, index);
+    if (preview != NULL) {
+        const long preview_position = (long) (sizeof(struct imgfs_header)
+                                              + (size_t) ((const char*) preview
+                                                          - (const char*) imgfs_file->metadata));
+        if (fseek(imgfs_file->file, preview_position, SEEK_SET) ||
+            fwrite(preview, sizeof(struct img_preview), NUM_OF_FILES,
+                   imgfs_file->file) != NUM_OF_FILES) {
+            return ERR_IO;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Append image content.
+ *
+ * Writes content at the end of the imgFS file. The stream is not
+ * flushed: the content is not visible to read_blob() before fflush().
+ * @param imgfs_file The imgfs_file struct.
+ * @param content The content to write.
+ * @param size Its size.
+ * @param offset Where to store the position of the content in the file.
+ * @return 0 on success, ERR_IO on failure.
+ */
+int append_content(struct imgfs_file* imgfs_file, const void* content, size_t size,
+                   uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(content);
+    M_REQUIRE_NON_NULL(offset);
+
+    if (fseek(imgfs_file->file, 0, SEEK_END)) {
+        return ERR_IO;
+    }
+
+    const long position = ftell(imgfs_file->file);
+    if (position < 0 || fwrite(content, size, NUM_OF_FILES, imgfs_file->file) != NUM_OF_FILES) {
+        return ERR_IO;
+    }
+
+    *offset = (uint64_t) position;
+    return ERR_NONE;
+}
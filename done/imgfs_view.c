@@ -0,0 +1,222 @@
+/*
+ * @file imgfs_view.c
+ * @brief Copy of the imgFS metadata that can be read without locking
+ *
+ * Classic sequence lock: the writer makes the counter odd, modifies the
+ * slot, then makes it even again; a reader that saw the same even value
+ * before and after its copy got a consistent slot.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "imgfs_view.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void) 0)
+#endif
+
+/*******************************************************************
+ * Sequence lock, reader side
+ */
+static uint32_t read_begin(const struct imgfs_view* view, size_t index)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&view->seq[index], __ATOMIC_ACQUIRE)) & 1u) {
+        cpu_relax();
+    }
+    return seq;
+}
+
+static int read_retry(const struct imgfs_view* view, size_t index, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&view->seq[index], __ATOMIC_RELAXED) != seq;
+}
+
+/*******************************************************************
+ * Allocation
+ */
+int view_init(struct imgfs_view* view, const struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(view);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    view->nb_slots = imgfs_file->header.max_files;
+    view->slots = calloc(view->nb_slots, sizeof(struct img_metadata));
+    view->seq = calloc(view->nb_slots, sizeof(uint32_t));
+    const struct img_ext_metadata* ext = ext_metadata(imgfs_file, 0);
+    view->ext = ext != NULL ? calloc(view->nb_slots, sizeof(struct img_ext_metadata)) : NULL;
+    const struct img_preview* previews = preview_metadata(imgfs_file, 0);
+    view->previews = previews != NULL ? calloc(view->nb_slots, sizeof(struct img_preview)) : NULL;
+    if (view->slots == NULL || view->seq == NULL || (ext != NULL && view->ext == NULL)
+        || (previews != NULL && view->previews == NULL)) {
+        view_free(view);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memcpy(view->slots, imgfs_file->metadata, view->nb_slots * sizeof(struct img_metadata));
+    if (ext != NULL) {
+        memcpy(view->ext, ext, view->nb_slots * sizeof(struct img_ext_metadata));
+    }
+    if (previews != NULL) {
+        memcpy(view->previews, previews, view->nb_slots * sizeof(struct img_preview));
+    }
+    return ERR_NONE;
+}
+
+void view_free(struct imgfs_view* view)
+{
+    if (view == NULL) return;
+    free(view->slots);
+    free(view->ext);
+    free(view->previews);
+    free(view->seq);
+    view->slots = NULL;
+    view->ext = NULL;
+    view->previews = NULL;
+    view->seq = NULL;
+    view->nb_slots = 0;
+}
+
+/*******************************************************************
+ * Writer side
+ */
+size_t view_publish(struct imgfs_view* view, const struct imgfs_file* imgfs_file)
+{
+    if (view == NULL || imgfs_file == NULL || imgfs_file->metadata == NULL) return 0;
+
+    size_t nb_published = 0;
+    for (size_t i = 0; i < view->nb_slots; ++i) {
+        const struct img_metadata* md = &imgfs_file->metadata[i];
+        const struct img_ext_metadata* ext = view->ext != NULL ? ext_metadata(imgfs_file, i) : NULL;
+        const struct img_preview* preview = view->previews != NULL
+                                            ? preview_metadata(imgfs_file, i) : NULL;
+        if (!memcmp(&view->slots[i], md, sizeof(struct img_metadata))
+            && (ext == NULL || !memcmp(&view->ext[i], ext, sizeof(struct img_ext_metadata)))
+            && (preview == NULL || !memcmp(&view->previews[i], preview, sizeof(struct img_preview)))) {
+            continue;
+        }
+
+        const uint32_t seq = view->seq[i];
+        __atomic_store_n(&view->seq[i], seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(&view->slots[i], md, sizeof(struct img_metadata));
+        if (ext != NULL) {
+            memcpy(&view->ext[i], ext, sizeof(struct img_ext_metadata));
+        }
+        if (preview != NULL) {
+            memcpy(&view->previews[i], preview, sizeof(struct img_preview));
+        }
+        __atomic_store_n(&view->seq[i], seq + 2, __ATOMIC_RELEASE);
+        ++nb_published;
+    }
+    return nb_published;
+}
+
+/*******************************************************************
+ * Reader side
+ */
+// Copies slot index and, if not NULL, its additional metadata and preview
+static void read_slot(const struct imgfs_view* view, size_t index, struct img_metadata* md,
+                      struct img_ext_metadata* ext, struct img_preview* preview)
+{
+    if (ext != NULL && view->ext == NULL) {
+        memset(ext, 0, sizeof(struct img_ext_metadata));
+        ext = NULL;
+    }
+    if (preview != NULL && view->previews == NULL) {
+        memset(preview, 0, sizeof(struct img_preview));
+        preview = NULL;
+    }
+
+    uint32_t seq;
+    do {
+        seq = read_begin(view, index);
+        memcpy(md, &view->slots[index], sizeof(struct img_metadata));
+        if (ext != NULL) {
+            memcpy(ext, &view->ext[index], sizeof(struct img_ext_metadata));
+        }
+        if (preview != NULL) {
+            memcpy(preview, &view->previews[index], sizeof(struct img_preview));
+        }
+    } while (read_retry(view, index, seq));
+}
+
+void view_read(const struct imgfs_view* view, size_t index, struct img_metadata* md)
+{
+    read_slot(view, index, md, NULL, NULL);
+}
+
+void view_read_ext(const struct imgfs_view* view, size_t index, struct img_metadata* md,
+                   struct img_ext_metadata* ext)
+{
+    read_slot(view, index, md, ext, NULL);
+}
+
+void view_read_preview(const struct imgfs_view* view, size_t index, struct img_metadata* md,
+                       struct img_preview* preview)
+{
+    read_slot(view, index, md, NULL, preview);
+}
+
+// Whether slot is a valid image with the given ID, or SHA if img_id is NULL
+static int matches(const struct img_metadata* slot, const char* img_id, const unsigned char* SHA)
+{
+    return slot->is_valid == NON_EMPTY
+           && (img_id != NULL ? !strncmp(slot->img_id, img_id, MAX_IMG_ID)
+                              : !memcmp(slot->SHA, SHA, SHA256_DIGEST_LENGTH));
+}
+
+static int find_slot(const struct imgfs_view* view, const char* img_id, const unsigned char* SHA,
+                     struct img_metadata* md, struct img_ext_metadata* ext)
+{
+    for (size_t i = 0; i < view->nb_slots; ++i) {
+        // Unchecked comparison in place to find the candidate: a slot being
+        // written can only be missed if it is being inserted or deleted,
+        // which is then equivalent to looking just before
+        if (!matches(&view->slots[i], img_id, SHA)) {
+            continue;
+        }
+
+        // Then a consistent copy, which may have changed in the meantime
+        struct img_metadata copy;
+        struct img_ext_metadata ext_copy;
+        view_read_ext(view, i, &copy, &ext_copy);
+        if (matches(&copy, img_id, SHA)) {
+            if (md != NULL) {
+                *md = copy;
+            }
+            if (ext != NULL) {
+                *ext = ext_copy;
+            }
+            return (int) i;
+        }
+    }
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+int view_find(const struct imgfs_view* view, const char* img_id, struct img_metadata* md)
+{
+    return view_find_ext(view, img_id, md, NULL);
+}
+
+int view_find_ext(const struct imgfs_view* view, const char* img_id, struct img_metadata* md,
+                  struct img_ext_metadata* ext)
+{
+    if (view == NULL || img_id == NULL) return ERR_INVALID_ARGUMENT;
+
+    return find_slot(view, img_id, NULL, md, ext);
+}
+
+int view_find_sha(const struct imgfs_view* view, const unsigned char* SHA,
+                  struct img_metadata* md, struct img_ext_metadata* ext)
+{
+    if (view == NULL || SHA == NULL) return ERR_INVALID_ARGUMENT;
+
+    return find_slot(view, NULL, SHA, md, ext);
+}
@@ -0,0 +1,94 @@
+/**
+ * @file imgfs_view.h
+ * @brief Copy of the imgFS metadata that can be read without locking.
+ *
+ * Each slot is protected by a sequence counter, odd while the slot is
+ * being written: readers copy the slot and retry if the counter changed
+ * meanwhile. The single writer (whoever modifies the imgfs_file, under
+ * its own lock) republishes the slots that changed with view_publish().
+ *
+ * Slots live in an array allocated once, so there is nothing to reclaim.
+ * The additional metadata and the previews of the slots, if any, are
+ * covered by the same counters.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct img_metadata
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+struct imgfs_view {
+    size_t nb_slots;
+    struct img_metadata* slots;
+    struct img_ext_metadata* ext; // NULL without additional resolutions
+    struct img_preview* previews; // NULL without previews
+    uint32_t* seq;
+};
+
+/**
+ * @brief Allocates the view and publishes all the slots of imgfs_file.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int view_init(struct imgfs_view* view, const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Frees the view. No reader may be using it anymore.
+ */
+void view_free(struct imgfs_view* view);
+
+/**
+ * @brief Publishes the slots of imgfs_file that differ from the view.
+ *        Must not be called concurrently with itself.
+ *
+ * @return The number of slots published.
+ */
+size_t view_publish(struct imgfs_view* view, const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Copies slot index into md, without locking.
+ */
+void view_read(const struct imgfs_view* view, size_t index, struct img_metadata* md);
+
+/**
+ * @brief view_read() that also copies the additional metadata of the slot
+ *        into ext (zeroed if there is none), consistently with md.
+ */
+void view_read_ext(const struct imgfs_view* view, size_t index, struct img_metadata* md,
+                   struct img_ext_metadata* ext);
+
+/**
+ * @brief view_read() that also copies the preview of the slot into
+ *        preview (empty if there is none), consistently with md.
+ */
+void view_read_preview(const struct imgfs_view* view, size_t index, struct img_metadata* md,
+                       struct img_preview* preview);
+
+/**
+ * @brief Looks for the valid image with the given ID, without locking.
+ *
+ * @param md Where to copy its metadata (may be NULL)
+ * @return Its index, or ERR_IMAGE_NOT_FOUND.
+ */
+int view_find(const struct imgfs_view* view, const char* img_id, struct img_metadata* md);
+
+/**
+ * @brief view_find() that also copies the additional metadata of the image
+ *        into ext (may be NULL).
+ */
+int view_find_ext(const struct imgfs_view* view, const char* img_id, struct img_metadata* md,
+                  struct img_ext_metadata* ext);
+
+/**
+ * @brief Looks for a valid image with the given content, without locking:
+ *        the first one if it was inserted under several IDs.
+ *
+ * @param SHA The SHA256 of its content
+ * @param md Where to copy its metadata (may be NULL)
+ * @param ext Where to copy its additional metadata (may be NULL)
+ * @return Its index, or ERR_IMAGE_NOT_FOUND.
+ */
+int view_find_sha(const struct imgfs_view* view, const unsigned char* SHA,
+                  struct img_metadata* md, struct img_ext_metadata* ext);
@@ -0,0 +1,398 @@
+/*
+ * @file imgfs_writer.c
+ * @brief Single thread owning all the modifications of an imgFS file
+ *
+ * The queue is Vyukov's intrusive MPSC queue: producers only exchange the
+ * head pointer, then link the previous head to their node. Between these
+ * two steps, the consumer cannot see the new node (nor the following ones)
+ * and waits; a semaphore counts the submitted operations so that it sleeps
+ * when there are none.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "error.h"
+#include "image_content.h" // store_resized_imgs
+#include "image_preview.h" // create_preview
+#include "imgfs_writer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void) 0)
+#endif
+
+enum write_kind {
+    WRITE_INSERT,
+    WRITE_DELETE,
+    WRITE_RESIZED,
+    WRITE_STOP
+};
+
+struct write_op {
+    enum write_kind kind;
+    const char* img_id;
+    const void* content;      // image to insert
+    size_t content_len;
+    size_t index;             // slot of the resized variants
+    void* const* resized_buffers;
+    const size_t* resized_lengths;
+    const unsigned char* SHA;
+    const struct img_metadata* prepared; // of the image to insert
+    const struct img_preview* preview;   // its preview, may be NULL
+    int errcode;
+    sem_t done;
+    struct write_op* next;
+};
+
+static struct imgfs_file* fs_file = NULL;
+static struct imgfs_view* fs_view = NULL;
+static pthread_t writer_thread;
+
+// Producers push at head, the writer pops at tail; stub keeps the queue non-empty
+static struct write_op stub;
+static struct write_op* head = &stub;
+static struct write_op* tail = &stub;
+static sem_t nb_pending; // operations pushed and not popped yet
+
+static struct writer_stats stats;
+
+// Set once a batch could not be written: the slots it modified in fs_file
+// no longer match the disk, so they are never published, nor is anything else
+static int read_only = 0;
+
+/*******************************************************************
+ * Queue
+ */
+static void push(struct write_op* op)
+{
+    __atomic_store_n(&op->next, NULL, __ATOMIC_RELAXED);
+    struct write_op* prev = __atomic_exchange_n(&head, op, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, op, __ATOMIC_RELEASE);
+}
+
+// Oldest operation, or NULL if a producer is still linking it
+static struct write_op* try_pop(void)
+{
+    struct write_op* first = tail;
+    struct write_op* next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+
+    if (first == &stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        tail = first = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        tail = next;
+        return first;
+    }
+
+    if (first != __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+        return NULL; // first is not the last one, but its successor is not linked yet
+    }
+
+    // first is the last one: put the stub back behind it to take it out
+    push(&stub);
+    next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        tail = next;
+        return first;
+    }
+    return NULL;
+}
+
+// Only called once nb_pending tells that an operation was pushed
+static struct write_op* pop(void)
+{
+    struct write_op* op;
+    while ((op = try_pop()) == NULL) {
+        cpu_relax();
+    }
+    return op;
+}
+
+/*******************************************************************
+ * Writer side
+ */
+
+// Applies op in memory (and appends content); returns the modified slot, or -1
+static long apply(struct write_op* op, int* header_changed)
+{
+    size_t index = 0;
+    switch (op->kind) {
+    case WRITE_INSERT:
+        op->errcode = insert_prepared(op->prepared, op->preview, op->content, op->img_id,
+                                      fs_file, &index);
+        break;
+    case WRITE_DELETE:
+        op->errcode = delete_image(op->img_id, fs_file, &index);
+        break;
+    case WRITE_RESIZED: {
+        index = op->index;
+        if (index >= fs_file->header.max_files) {
+            op->errcode = ERR_IMAGE_NOT_FOUND;
+            return -1;
+        }
+        // Unchanged if they were all stored in the meantime
+        struct img_metadata before = fs_file->metadata[index];
+        struct img_ext_metadata* ext = ext_metadata(fs_file, index);
+        struct img_ext_metadata ext_before = {0};
+        if (ext != NULL) {
+            ext_before = *ext;
+        }
+        op->errcode = store_resized_imgs(fs_file, index, op->SHA,
+                                         op->resized_buffers, op->resized_lengths);
+        if (op->errcode != ERR_NONE
+            || (!memcmp(&before, &fs_file->metadata[index], sizeof(before))
+                && (ext == NULL || !memcmp(&ext_before, ext, sizeof(ext_before))))) {
+            return -1;
+        }
+        return (long) index;
+    }
+    default:
+        op->errcode = ERR_NONE;
+        return -1;
+    }
+
+    if (op->errcode != ERR_NONE) {
+        return -1;
+    }
+    *header_changed = 1;
+    return (long) index;
+}
+
+// Writes the slots modified by a batch, and the header if needed
+static int write_batch(const long* slots, size_t nb_ops, int header_changed)
+{
+    // Content first: it must be readable once the metadata points to it
+    if (fflush(fs_file->file)) {
+        return ERR_IO;
+    }
+
+    for (size_t i = 0; i < nb_ops; ++i) {
+        if (slots[i] < 0) {
+            continue;
+        }
+        int already_written = 0;
+        for (size_t j = 0; j < i && !already_written; ++j) {
+            already_written = slots[j] == slots[i];
+        }
+        if (!already_written && write_metadata(fs_file, (size_t) slots[i]) != ERR_NONE) {
+            return ERR_IO;
+        }
+    }
+
+    if (header_changed && write_header(fs_file) != ERR_NONE) {
+        return ERR_IO;
+    }
+    return fflush(fs_file->file) ? ERR_IO : ERR_NONE;
+}
+
+static void* writer_main(void* unused)
+{
+    (void) unused;
+
+    // Signals are handled by the main thread only: its handler stops us
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct write_op* batch[WRITER_MAX_BATCH];
+    long slots[WRITER_MAX_BATCH];
+    int stop = 0;
+
+    while (!stop) {
+        while (sem_wait(&nb_pending) == -1 && errno == EINTR);
+        size_t nb_ops = 0;
+        do {
+            batch[nb_ops++] = pop();
+        } while (nb_ops < WRITER_MAX_BATCH && sem_trywait(&nb_pending) == 0);
+
+        int header_changed = 0;
+        int modified = 0;
+        for (size_t i = 0; i < nb_ops; ++i) {
+            stop |= batch[i]->kind == WRITE_STOP;
+            if (read_only && batch[i]->kind != WRITE_STOP) {
+                batch[i]->errcode = ERR_IO;
+                slots[i] = -1;
+                continue;
+            }
+            slots[i] = apply(batch[i], &header_changed);
+            modified |= slots[i] >= 0;
+        }
+
+        if (modified) {
+            if (write_batch(slots, nb_ops, header_changed) == ERR_NONE) {
+                view_publish(fs_view, fs_file); // make the changes visible to readers
+            } else {
+                fprintf(stderr, "imgfs writer: write failed, no more modifications\n");
+                read_only = 1; // readers keep the last view, which matches the disk
+                for (size_t i = 0; i < nb_ops; ++i) {
+                    if (slots[i] >= 0) {
+                        batch[i]->errcode = ERR_IO;
+                    }
+                }
+            }
+        }
+
+        __atomic_add_fetch(&stats.nb_ops, nb_ops, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.nb_batches, 1, __ATOMIC_RELAXED);
+        if (nb_ops > __atomic_load_n(&stats.max_batch, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&stats.max_batch, nb_ops, __ATOMIC_RELAXED);
+        }
+
+        for (size_t i = 0; i < nb_ops; ++i) {
+            sem_post(&batch[i]->done);
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************
+ * Request side
+ */
+static int submit(struct write_op* op)
+{
+    if (sem_init(&op->done, 0, 0)) {
+        return ERR_THREADING;
+    }
+    push(op);
+    sem_post(&nb_pending);
+    while (sem_wait(&op->done) == -1 && errno == EINTR);
+    sem_destroy(&op->done);
+    return op->errcode;
+}
+
+int writer_insert(const char* image_buffer, size_t image_size, const char* img_id)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+
+    // Fail early, without hashing, on an ID already in use
+    if (view_find(fs_view, img_id, NULL) >= 0) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    // Hashing, decoding the header and the preview run in parallel on the
+    // request threads, the writer only allocates the slot and appends the content
+    struct img_metadata prepared;
+    const int errcode = prepare_image(image_buffer, image_size, &prepared);
+    if (errcode != ERR_NONE) {
+        return errcode;
+    }
+    // The preview is optional: the image is inserted without one if it fails
+    struct img_preview preview;
+    const int has_preview = (fs_file->header.flags & IMGFS_PREVIEWS)
+                            && create_preview(image_buffer, image_size, &preview) == ERR_NONE;
+
+    struct write_op op = { .kind = WRITE_INSERT, .img_id = img_id, .prepared = &prepared,
+                           .preview = has_preview ? &preview : NULL,
+                           .content = image_buffer, .content_len = image_size };
+    return submit(&op);
+}
+
+int writer_insert_existing(const unsigned char* SHA, const char* img_id)
+{
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(img_id);
+
+    if (view_find(fs_view, img_id, NULL) >= 0) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    // The writer shares the content with the stored copy, if still there
+    struct img_metadata stored;
+    struct img_preview preview;
+    const int index = view_find_sha(fs_view, SHA, &stored, NULL);
+    if (index < 0) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+    struct img_metadata copy;
+    view_read_preview(fs_view, (size_t) index, &copy, &preview);
+    if (memcmp(copy.SHA, SHA, SHA256_DIGEST_LENGTH)) {
+        preview.blurhash[0] = '\0'; // replaced meanwhile
+    }
+
+    struct img_metadata prepared;
+    memset(&prepared, 0, sizeof(prepared));
+    memcpy(prepared.SHA, SHA, SHA256_DIGEST_LENGTH);
+    memcpy(prepared.orig_res, stored.orig_res, sizeof(prepared.orig_res));
+    prepared.size[ORIG_RES] = stored.size[ORIG_RES];
+
+    struct write_op op = { .kind = WRITE_INSERT, .img_id = img_id, .prepared = &prepared,
+                           .preview = preview.blurhash[0] != '\0' ? &preview : NULL };
+    return submit(&op);
+}
+
+int writer_delete(const char* img_id)
+{
+    M_REQUIRE_NON_NULL(img_id);
+
+    struct write_op op = { .kind = WRITE_DELETE, .img_id = img_id };
+    return submit(&op);
+}
+
+int writer_store_resized(size_t index, const unsigned char* SHA,
+                         void* const resized_buffers[MAX_RES],
+                         const size_t resized_lengths[MAX_RES])
+{
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(resized_buffers);
+    M_REQUIRE_NON_NULL(resized_lengths);
+
+    struct write_op op = { .kind = WRITE_RESIZED, .index = index, .SHA = SHA,
+                           .resized_buffers = resized_buffers,
+                           .resized_lengths = resized_lengths };
+    return submit(&op);
+}
+
+/*******************************************************************
+ * Startup and shutdown
+ */
+int writer_start(struct imgfs_file* imgfs_file, struct imgfs_view* view)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(view);
+
+    fs_file = imgfs_file;
+    fs_view = view;
+    memset(&stats, 0, sizeof(stats));
+    read_only = 0;
+    head = tail = &stub;
+    stub.next = NULL;
+
+    if (sem_init(&nb_pending, 0, 0)) {
+        return ERR_THREADING;
+    }
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL)) {
+        sem_destroy(&nb_pending);
+        return ERR_THREADING;
+    }
+    return ERR_NONE;
+}
+
+void writer_stop(void)
+{
+    struct write_op op = { .kind = WRITE_STOP };
+    submit(&op);
+    pthread_join(writer_thread, NULL);
+    sem_destroy(&nb_pending);
+}
+
+void writer_get_stats(struct writer_stats* s)
+{
+    if (s == NULL) return;
+    s->nb_ops = __atomic_load_n(&stats.nb_ops, __ATOMIC_RELAXED);
+    s->nb_batches = __atomic_load_n(&stats.nb_batches, __ATOMIC_RELAXED);
+    s->max_batch = __atomic_load_n(&stats.max_batch, __ATOMIC_RELAXED);
+}
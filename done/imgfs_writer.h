@@ -0,0 +1,75 @@
+/**
+ * @file imgfs_writer.h
+ * @brief Single thread owning all the modifications of an imgFS file.
+ *
+ * Request threads submit their insertions, deletions and resized variants
+ * to a lock-free multi-producer queue and wait for their completion. The
+ * writer applies the operations waiting in the queue one after the other,
+ * then writes the modified slots and the header once for the whole batch
+ * and publishes them to the view with a single view_publish().
+ *
+ * If a batch cannot be written, its operations fail with ERR_IO and so do
+ * all the following ones: the view keeps matching what is on disk.
+ */
+
+#pragma once
+
+#include "imgfs.h"      // for struct imgfs_file
+#include "imgfs_view.h" // for struct imgfs_view
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+#define WRITER_MAX_BATCH 64 // max. operations written together
+
+struct writer_stats {
+    uint64_t nb_ops;     // operations applied since startup
+    uint64_t nb_batches; // groups of operations written together
+    uint64_t max_batch;  // largest of them
+};
+
+/**
+ * @brief Starts the writer thread. From then on, imgfs_file and view
+ *        may only be modified through it, until writer_stop().
+ *
+ * @return Some error code. 0 if no error.
+ */
+int writer_start(struct imgfs_file* imgfs_file, struct imgfs_view* view);
+
+/**
+ * @brief Applies the operations already submitted and joins the writer.
+ *        No operation may be submitted anymore.
+ */
+void writer_stop(void);
+
+/**
+ * @brief do_insert() through the writer. The image is hashed and checked
+ *        by the calling thread, the writer only stores it.
+ */
+int writer_insert(const char* image_buffer, size_t image_size, const char* img_id);
+
+/**
+ * @brief Inserts, under another ID, an image that is already stored:
+ *        no content is needed, only its SHA.
+ *
+ * @return Some error code. 0 if no error, ERR_IMAGE_NOT_FOUND if no
+ *         image has this SHA.
+ */
+int writer_insert_existing(const unsigned char* SHA, const char* img_id);
+
+/**
+ * @brief do_delete() through the writer.
+ */
+int writer_delete(const char* img_id);
+
+/**
+ * @brief commit_resized_imgs() through the writer.
+ */
+int writer_store_resized(size_t index, const unsigned char* SHA,
+                         void* const resized_buffers[MAX_RES],
+                         const size_t resized_lengths[MAX_RES]);
+
+/**
+ * @brief Copies a snapshot of the writer counters into stats.
+ */
+void writer_get_stats(struct writer_stats* stats);
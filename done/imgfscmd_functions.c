@@ -40,9 +40,13 @@ int help(int useless _unused, char** useless_too _unused)
         "        -small_res <X_RES> <Y_RES>: resolution for small images.\n"
         "                                default value is 256x256\n"
         "                                maximum value is 512x512\n"
+        "        -res <NAME> <X_RES> <Y_RES>: additional resolution, read by its name.\n"
+        "                                up to 5 of them\n"
+        "        -previews: store a tiny preview (BlurHash) of each image, listed with it.\n"
         "read   <imgFS_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
         "    read an image from the imgFS and save it to a file.\n"
         "    default resolution is \"original\".\n"
+        "    additional resolutions of the imgFS are also accepted.\n"
         "insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
         "delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n"); // copied and pasted directly
     fflush(stdout);
@@ -91,9 +95,13 @@ int do_create_cmd(int argc, char** argv)
     --argc; ++argv;
 
     struct imgfs_file newfile;
+    struct imgfs_resolution extra[NB_EXTRA_RES];
+    size_t nb_extra = 0;
+    memset(extra, 0, sizeof(extra));
     newfile.header.max_files = default_max_files;
     newfile.header.resized_res[0] = newfile.header.resized_res[1] = default_thumb_res;
     newfile.header.resized_res[2] = newfile.header.resized_res[3] = default_small_res;
+    newfile.header.flags = 0;
 
     // Going through optional arguments
     while (argc > 0) {
@@ -136,11 +144,42 @@ int do_create_cmd(int argc, char** argv)
             }
             // Used "-small_res" and the two values
             argc -= 3; argv += 3;
+
+        // -------------------- ADDITIONAL RES --------------------
+        } else if(strcmp(argv[0], "-res") == 0) {
+            if (argc < 4) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            const size_t name_len = strlen(argv[1]);
+            if (nb_extra == NB_EXTRA_RES || name_len == 0 || name_len > MAX_RES_NAME
+                || resolution_atoi(argv[1]) >= 0) {
+                return ERR_RESOLUTIONS;
+            }
+            for (size_t i = 0; i < nb_extra; ++i) {
+                if (!strcmp(extra[i].name, argv[1])) {
+                    return ERR_RESOLUTIONS;
+                }
+            }
+            strncpy(extra[nb_extra].name, argv[1], MAX_RES_NAME);
+            extra[nb_extra].width = atouint16(argv[2]);
+            extra[nb_extra].height = atouint16(argv[3]);
+            if (extra[nb_extra].width == 0 || extra[nb_extra].height == 0) {
+                return ERR_RESOLUTIONS;
+            }
+            ++nb_extra;
+            // Used "-res", the name and the two values
+            argc -= 4; argv += 4;
+
+        // -------------------- PREVIEWS --------------------
+        } else if(strcmp(argv[0], "-previews") == 0) {
+            newfile.header.flags |= IMGFS_PREVIEWS;
+            // Used "-previews"
+            argc -= 1; argv += 1;
         } else {
             return ERR_INVALID_ARGUMENT;
         }
     }
-    int create_error = do_create(imgfs_filename, &newfile);
+    int create_error = do_create_with_res(imgfs_filename, &newfile, nb_extra, extra);
     if (create_error != ERR_NONE) {
         return create_error;
     }
@@ -182,14 +221,31 @@ int do_read_cmd(int argc, char **argv) {
     M_REQUIRE_NON_NULL(argv);
     if (argc != 2 && argc != 3) return ERR_NOT_ENOUGH_ARGUMENTS;
     const char * const img_id = argv[1];
-    const int resolution = (argc == 3) ? resolution_atoi(argv[2]) : ORIG_RES;
+    // Additional resolutions are only known once the imgFS is open
+    if (argc == 3 && resolution_atoi(argv[2]) == -1
+        && (strlen(argv[2]) == 0 || strlen(argv[2]) > MAX_RES_NAME)) {
+        return ERR_RESOLUTIONS;
+    }
 
-    if (resolution == -1) return ERR_RESOLUTIONS;
     struct imgfs_file myfile;
     zero_init_var(myfile);
     int error = do_open(argv[0], "rb+", &myfile);
     if (error != ERR_NONE) return error;
 
+    const int resolution = (argc == 3) ? imgfs_resolution_atoi(&myfile, argv[2]) : ORIG_RES;
+    if (resolution == -1) {
+        do_close(&myfile);
+        return ERR_RESOLUTIONS;
+    }
+    char res_name[MAX_RES_NAME + 1] = "orig";
+    if (resolution == THUMB_RES) {
+        strcpy(res_name, "thumb");
+    } else if (resolution == SMALL_RES) {
+        strcpy(res_name, "small");
+    } else if (resolution >= NB_RES) {
+        strncpy(res_name, extra_resolutions(&myfile)[resolution - NB_RES].name, MAX_RES_NAME);
+    }
+
     char *image_buffer = NULL;
     uint32_t image_size = 0;
 
@@ -201,7 +257,7 @@ int do_read_cmd(int argc, char **argv) {
 
     // Extracting to a separate image file.
     char* tmp_name = NULL;
-    create_name(img_id, resolution, &tmp_name);
+    create_name(img_id, res_name, &tmp_name);
     if (tmp_name == NULL) return ERR_OUT_OF_MEMORY;
     error = write_disk_image(tmp_name, image_buffer, image_size);
     free(tmp_name);
@@ -243,21 +299,16 @@ int do_insert_cmd(int argc, char **argv) {
 
 
 // Helper function to create a new file name based on image ID and resolution
-static void create_name(const char* img_id, int resolution, char** new_name){
+static void create_name(const char* img_id, const char* res_name, char** new_name){
 
-    *new_name = calloc(1, MAX_IMG_ID + 6 + 4);
+    *new_name = calloc(1, MAX_IMG_ID + MAX_RES_NAME + 2 + 4);
     if (*new_name == NULL) {
         return;
     }
 
     strcat(*new_name, img_id);
-    if (resolution == THUMB_RES) {
-        strcat(*new_name, "_thumb");
-    } else if (resolution == SMALL_RES) {
-        strcat(*new_name, "_small");
-    } else {
-        strcat(*new_name, "_orig");
-    }
+    strcat(*new_name, "_");
+    strcat(*new_name, res_name);
     strcat(*new_name, ".jpg");
 }
 
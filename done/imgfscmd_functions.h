@@ -37,7 +37,7 @@ int do_insert_cmd(int argc, char* argv[]);
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
 
-static void create_name(const char* img_id, int resolution, char** new_name);
+static void create_name(const char* img_id, const char* res_name, char** new_name);
 
 static int write_disk_image(const char *filename, const char *image_buffer, uint32_t image_size);
 
@@ -0,0 +1,117 @@
+/*
+ * @file recv_buffer.c
+ * @brief Growable receive buffers backed by a pool of small slabs
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "recv_buffer.h"
+
+// Free slabs are chained through their first bytes
+struct free_slab {
+    struct free_slab* next;
+};
+
+static struct free_slab* free_slabs = NULL;
+static size_t nb_free_slabs = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************
+ * Take a slab from the pool or allocate a new one
+ */
+int recv_buffer_acquire(struct recv_buffer* buf)
+{
+    M_REQUIRE_NON_NULL(buf);
+
+    pthread_mutex_lock(&pool_lock);
+    struct free_slab* slab = free_slabs;
+    if (slab != NULL) {
+        free_slabs = slab->next;
+        --nb_free_slabs;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (slab == NULL) {
+        slab = malloc(RECV_SLAB_SIZE);
+        if (slab == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+
+    buf->data = (char*) slab;
+    buf->data[0] = '\0';
+    buf->capacity = RECV_SLAB_SIZE;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Grow the buffer, keeping its content
+ */
+int recv_buffer_reserve(struct recv_buffer* buf, size_t capacity, size_t used)
+{
+    M_REQUIRE_NON_NULL(buf);
+    if (used > buf->capacity) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (capacity <= buf->capacity) {
+        return ERR_NONE;
+    }
+
+    char* data = malloc(capacity);
+    if (data == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (buf->data != NULL) {
+        memcpy(data, buf->data, used);
+    }
+
+    recv_buffer_release(buf);
+    buf->data = data;
+    buf->capacity = capacity;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Return the memory
+ */
+void recv_buffer_release(struct recv_buffer* buf)
+{
+    if (buf == NULL || buf->data == NULL) return;
+
+    int pooled = 0;
+    if (buf->capacity == RECV_SLAB_SIZE) {
+        pthread_mutex_lock(&pool_lock);
+        if (nb_free_slabs < RECV_POOL_CACHED) {
+            struct free_slab* slab = (struct free_slab*) (void*) buf->data;
+            slab->next = free_slabs;
+            free_slabs = slab;
+            ++nb_free_slabs;
+            pooled = 1;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    if (!pooled) {
+        free(buf->data);
+    }
+    buf->data = NULL;
+    buf->capacity = 0;
+}
+
+/*******************************************************************
+ * Empty the pool
+ */
+void recv_buffer_pool_clear(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    while (free_slabs != NULL) {
+        struct free_slab* next = free_slabs->next;
+        free(free_slabs);
+        free_slabs = next;
+    }
+    nb_free_slabs = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
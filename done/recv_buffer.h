@@ -0,0 +1,44 @@
+/**
+ * @file recv_buffer.h
+ * @brief Growable receive buffers backed by a pool of small slabs.
+ *
+ * A connection only holds a buffer while a request is being received.
+ * It starts with a RECV_SLAB_SIZE slab and is enlarged only when the
+ * request announces a bigger body.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+
+#define RECV_SLAB_SIZE   8192 // 2^13 -> enough for the headers of usual requests
+#define RECV_POOL_CACHED 1024 // max. number of free slabs kept for reuse
+
+struct recv_buffer {
+    char* data;
+    size_t capacity;
+};
+
+/**
+ * @brief Gives buf a slab of RECV_SLAB_SIZE bytes, reusing a pooled one if any.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int recv_buffer_acquire(struct recv_buffer* buf);
+
+/**
+ * @brief Makes sure buf can hold capacity bytes, keeping its first used bytes.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int recv_buffer_reserve(struct recv_buffer* buf, size_t capacity, size_t used);
+
+/**
+ * @brief Gives the memory of buf back (slabs return to the pool).
+ */
+void recv_buffer_release(struct recv_buffer* buf);
+
+/**
+ * @brief Frees the slabs kept in the pool.
+ */
+void recv_buffer_pool_clear(void);
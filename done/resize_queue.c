@@ -0,0 +1,163 @@
+/*
+ * @file resize_queue.c
+ * @brief Background generation of the variants of newly inserted images
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "resize_queue.h"
+
+struct resize_job {
+    size_t index;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+};
+
+// Ring buffer; workers take the newest job, a full queue drops the oldest one
+static struct resize_job jobs[RESIZE_QUEUE_SIZE];
+static size_t head = 0;
+static size_t count = 0;
+
+static pthread_t* workers = NULL;
+static size_t nb_workers = 0;
+static resize_fn resize = NULL;
+static int running = 0;
+
+// Protects the ring buffer, running and the statistics
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct resize_queue_stats stats;
+
+/*******************************************************************
+ * Worker main loop
+ */
+static void* worker_main(void* unused)
+{
+    (void) unused;
+
+    // Signals are handled by the main thread only
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&queue_lock);
+    while (running) {
+        if (count == 0) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+            continue;
+        }
+
+        --count;
+        const struct resize_job job = jobs[(head + count) % RESIZE_QUEUE_SIZE];
+        pthread_mutex_unlock(&queue_lock);
+
+        resize(job.index, job.SHA);
+
+        pthread_mutex_lock(&queue_lock);
+        ++stats.nb_done;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/*******************************************************************
+ * Start the workers
+ */
+int resize_queue_init(size_t nb_threads, resize_fn fn)
+{
+    M_REQUIRE_NON_NULL(fn);
+    if (workers != NULL) {
+        return ERR_THREADING;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    head = count = 0;
+    if (nb_threads == 0) {
+        return ERR_NONE;
+    }
+
+    workers = calloc(nb_threads, sizeof(pthread_t));
+    if (workers == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    resize = fn;
+    running = 1;
+    for (nb_workers = 0; nb_workers < nb_threads; ++nb_workers) {
+        if (pthread_create(&workers[nb_workers], NULL, worker_main, NULL)) {
+            // Stop the ones already started
+            resize_queue_shutdown();
+            return ERR_THREADING;
+        }
+    }
+    stats.nb_workers = nb_workers;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Queue an image
+ */
+void resize_queue_push(size_t index, const unsigned char* SHA)
+{
+    if (SHA == NULL) return;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!running) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+
+    if (count == RESIZE_QUEUE_SIZE) {
+        head = (head + 1) % RESIZE_QUEUE_SIZE;
+        --count;
+        ++stats.nb_dropped;
+    }
+
+    struct resize_job* job = &jobs[(head + count) % RESIZE_QUEUE_SIZE];
+    job->index = index;
+    memcpy(job->SHA, SHA, SHA256_DIGEST_LENGTH);
+    ++count;
+    ++stats.nb_queued;
+
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*******************************************************************
+ * Statistics snapshot
+ */
+void resize_queue_get_stats(struct resize_queue_stats* out)
+{
+    if (out == NULL) return;
+    pthread_mutex_lock(&queue_lock);
+    *out = stats;
+    out->depth = count;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*******************************************************************
+ * Stop the workers
+ */
+void resize_queue_shutdown(void)
+{
+    if (workers == NULL) return;
+
+    pthread_mutex_lock(&queue_lock);
+    running = 0;
+    count = 0;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (size_t i = 0; i < nb_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+    workers = NULL;
+    nb_workers = 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file resize_queue.h
+ * @brief Background generation of the variants of newly inserted images.
+ *
+ * A bounded queue of images feeds a few dedicated threads. The most
+ * recently inserted images are served first, as they are the most likely
+ * to be read soon; when the queue is full, the oldest one is dropped and
+ * will be resized on its first read, as before.
+ */
+
+#pragma once
+
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <stddef.h>      // size_t
+#include <stdint.h>      // uint64_t
+
+#define RESIZE_QUEUE_SIZE 256 // max. images waiting
+
+/**
+ * @brief Generates the variants of the image at index, if the slot still
+ *        holds the image with that SHA.
+ */
+typedef void (*resize_fn)(size_t index, const unsigned char* SHA);
+
+struct resize_queue_stats {
+    size_t nb_workers;
+    size_t depth;        // images currently waiting
+    uint64_t nb_queued;  // images queued since startup
+    uint64_t nb_done;    // images processed
+    uint64_t nb_dropped; // images dropped because the queue was full
+};
+
+/**
+ * @brief Starts nb_workers threads calling fn on the queued images.
+ *        Nothing is started if nb_workers is 0: resize_queue_push()
+ *        then does nothing.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int resize_queue_init(size_t nb_workers, resize_fn fn);
+
+/**
+ * @brief Queues an image, dropping the oldest one if the queue is full.
+ */
+void resize_queue_push(size_t index, const unsigned char* SHA);
+
+/**
+ * @brief Copies a snapshot of the queue counters into stats.
+ */
+void resize_queue_get_stats(struct resize_queue_stats* stats);
+
+/**
+ * @brief Waits for the images being processed, drops the waiting ones
+ *        and joins the threads.
+ */
+void resize_queue_shutdown(void);
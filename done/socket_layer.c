@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include "socket_layer.h"
 #include <sys/types.h>      // Needed for using various data types and structs
 #include <sys/socket.h>     // Needed for socket functions
@@ -84,11 +85,17 @@ ssize_t tcp_send(int active_socket, const char *response, size_t response_len) {
         return ERR_INVALID_ARGUMENT;    // Return error if response length is invalid
     }
 
-    // Send data to the socket
-    ssize_t bytes_sent = send(active_socket, response, response_len, 0);
-    if (bytes_sent == -1) {
-        perror("fail in sending");
-        return ERR_IO;  // Return error if send fails
+    // Send data to the socket, a large response may take several calls;
+    // a client gone in the meantime must not kill the server with SIGPIPE
+    size_t bytes_sent = 0;
+    while (bytes_sent < response_len) {
+        ssize_t n = send(active_socket, response + bytes_sent, response_len - bytes_sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("fail in sending");
+            return ERR_IO;  // Return error if send fails
+        }
+        bytes_sent += (size_t) n;
     }
-    return bytes_sent;  // Return the number of bytes sent
+    return (ssize_t) bytes_sent;  // Return the number of bytes sent
 }
\ No newline at end of file
@@ -0,0 +1,310 @@
+/*
+ * @file thread_pool.c
+ * @brief Bounded worker pool with per-worker deques and work stealing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "util.h" // MAX
+#include "thread_pool.h"
+
+#define CHEAP_ONLY_RATIO 4 // one worker out of CHEAP_ONLY_RATIO never runs expensive jobs
+
+struct job {
+    job_fn fn;
+    void* arg;
+    uint64_t enqueued_us;
+};
+
+// Fixed-size ring buffer; the owner takes the oldest job, thieves the newest one
+struct deque {
+    struct job jobs[THREAD_POOL_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+};
+
+struct worker {
+    pthread_t thread;
+    size_t id;
+    struct deque queues[NB_JOB_CLASSES];
+};
+
+static struct worker* workers = NULL;
+static size_t nb_workers = 0;
+static size_t nb_cheap_only = 0;
+static size_t next_worker = 0;
+static int running = 0;
+
+// Protects pending[], running, next_worker and the statistics below
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static size_t pending[NB_JOB_CLASSES];
+static struct thread_pool_stats stats;
+
+static __thread struct worker* current_worker = NULL;
+
+/*******************************************************************
+ * Monotonic clock in microseconds
+ */
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + (uint64_t) ts.tv_nsec / 1000u;
+}
+
+/*******************************************************************
+ * Deque operations
+ */
+static int deque_push(struct deque* dq, const struct job* job)
+{
+    int err = ERR_NONE;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == THREAD_POOL_QUEUE_SIZE) {
+        err = ERR_THREADING;
+    } else {
+        dq->jobs[(dq->head + dq->count) % THREAD_POOL_QUEUE_SIZE] = *job;
+        ++dq->count;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return err;
+}
+
+static int deque_pop_front(struct deque* dq, struct job* job)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        *job = dq->jobs[dq->head];
+        dq->head = (dq->head + 1) % THREAD_POOL_QUEUE_SIZE;
+        --dq->count;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int deque_pop_back(struct deque* dq, struct job* job)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        --dq->count;
+        *job = dq->jobs[(dq->head + dq->count) % THREAD_POOL_QUEUE_SIZE];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/*******************************************************************
+ * Takes a job of the given class, first from our own deque, then by
+ * stealing from the other workers.
+ */
+static int take_job(struct worker* self, enum job_class job_class, struct job* job)
+{
+    if (deque_pop_front(&self->queues[job_class], job)) {
+        return 1;
+    }
+
+    for (size_t i = 1; i < nb_workers; ++i) {
+        struct worker* victim = &workers[(self->id + i) % nb_workers];
+        if (deque_pop_back(&victim->queues[job_class], job)) {
+            pthread_mutex_lock(&pool_lock);
+            ++stats.nb_steals;
+            pthread_mutex_unlock(&pool_lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************
+ * Worker main loop
+ */
+static void* worker_main(void* arg)
+{
+    // Signals are handled by the main thread only
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct worker* self = arg;
+    current_worker = self;
+    const int cheap_only = self->id < nb_cheap_only;
+
+    pthread_mutex_lock(&pool_lock);
+    while (running) {
+        const int has_work = pending[JOB_CHEAP] > 0
+                             || (!cheap_only && pending[JOB_EXPENSIVE] > 0);
+        if (!has_work) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        struct job job;
+        enum job_class job_class = JOB_CHEAP;
+        int found = take_job(self, JOB_CHEAP, &job);
+        if (!found && !cheap_only) {
+            job_class = JOB_EXPENSIVE;
+            found = take_job(self, JOB_EXPENSIVE, &job);
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        if (!found) {
+            continue; // another worker was faster
+        }
+
+        --pending[job_class];
+        const uint64_t wait_us = now_us() - job.enqueued_us;
+        ++stats.nb_jobs[job_class];
+        stats.total_wait_us[job_class] += wait_us;
+        stats.max_wait_us[job_class] = MAX(stats.max_wait_us[job_class], wait_us);
+        pthread_mutex_unlock(&pool_lock);
+
+        job.fn(job.arg);
+
+        pthread_mutex_lock(&pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    current_worker = NULL;
+    return NULL;
+}
+
+/*******************************************************************
+ * Start the workers
+ */
+int thread_pool_init(size_t nb_threads)
+{
+    if (workers != NULL) {
+        return ERR_THREADING;
+    }
+
+    nb_workers = MAX(nb_threads, 2u);
+    nb_cheap_only = MAX(nb_workers / CHEAP_ONLY_RATIO, 1u);
+    workers = calloc(nb_workers, sizeof(struct worker));
+    if (workers == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    memset(pending, 0, sizeof(pending));
+    stats.nb_workers = nb_workers;
+    stats.nb_cheap_only = nb_cheap_only;
+
+    for (size_t i = 0; i < nb_workers; ++i) {
+        workers[i].id = i;
+        for (int c = 0; c < NB_JOB_CLASSES; ++c) {
+            pthread_mutex_init(&workers[i].queues[c].lock, NULL);
+        }
+    }
+
+    running = 1;
+    for (size_t i = 0; i < nb_workers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+            // Stop the ones already started
+            nb_workers = i;
+            thread_pool_shutdown(NULL);
+            return ERR_THREADING;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Queue a job
+ */
+int thread_pool_submit(enum job_class job_class, job_fn fn, void* arg)
+{
+    M_REQUIRE_NON_NULL(fn);
+    if (job_class < 0 || job_class >= NB_JOB_CLASSES) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct job job = { fn, arg, now_us() };
+
+    pthread_mutex_lock(&pool_lock);
+    if (!running) {
+        pthread_mutex_unlock(&pool_lock);
+        return ERR_THREADING;
+    }
+    struct worker* target = current_worker;
+    if (target == NULL) {
+        target = &workers[next_worker];
+        next_worker = (next_worker + 1) % nb_workers;
+    }
+    // Counted before it is visible: a worker may take it as soon as it is pushed
+    ++pending[job_class];
+    pthread_mutex_unlock(&pool_lock);
+
+    int err = deque_push(&target->queues[job_class], &job);
+
+    pthread_mutex_lock(&pool_lock);
+    if (err != ERR_NONE) {
+        --pending[job_class];
+    } else {
+        // Broadcast as the first waiter may be a cheap-only worker
+        pthread_cond_broadcast(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return err;
+}
+
+/*******************************************************************
+ * Statistics snapshot
+ */
+void thread_pool_get_stats(struct thread_pool_stats* out)
+{
+    if (out == NULL) return;
+    pthread_mutex_lock(&pool_lock);
+    *out = stats;
+    for (int c = 0; c < NB_JOB_CLASSES; ++c) {
+        out->queue_depth[c] = pending[c];
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*******************************************************************
+ * Stop the workers
+ */
+void thread_pool_shutdown(job_fn drop)
+{
+    if (workers == NULL) return;
+
+    pthread_mutex_lock(&pool_lock);
+    running = 0;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (size_t i = 0; i < nb_workers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // Nothing can be submitted anymore: release what is left
+    for (size_t i = 0; i < nb_workers; ++i) {
+        for (int c = 0; c < NB_JOB_CLASSES; ++c) {
+            struct job job;
+            while (deque_pop_front(&workers[i].queues[c], &job)) {
+                if (drop != NULL) {
+                    drop(job.arg);
+                }
+            }
+            pthread_mutex_destroy(&workers[i].queues[c].lock);
+        }
+    }
+    memset(pending, 0, sizeof(pending));
+
+    free(workers);
+    workers = NULL;
+    nb_workers = 0;
+}
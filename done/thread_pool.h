@@ -0,0 +1,63 @@
+/**
+ * @file thread_pool.h
+ * @brief Bounded worker pool with per-worker deques and work stealing.
+ *
+ * Jobs are split in two classes so that cheap requests (listing, reading
+ * an already stored variant) never wait behind expensive ones (resizing,
+ * inserting). A fraction of the workers only ever runs cheap jobs.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+#define THREAD_POOL_QUEUE_SIZE 1024 // max. pending jobs per worker and per class
+
+enum job_class {
+    JOB_CHEAP,
+    JOB_EXPENSIVE,
+    NB_JOB_CLASSES
+};
+
+typedef void (*job_fn)(void* arg);
+
+struct thread_pool_stats {
+    size_t nb_workers;
+    size_t nb_cheap_only;                   // workers that never run expensive jobs
+    size_t queue_depth[NB_JOB_CLASSES];     // jobs currently waiting
+    uint64_t nb_jobs[NB_JOB_CLASSES];       // jobs started since startup
+    uint64_t total_wait_us[NB_JOB_CLASSES]; // sum of queueing delays
+    uint64_t max_wait_us[NB_JOB_CLASSES];   // worst queueing delay
+    uint64_t nb_steals;                     // jobs taken from another worker's deque
+};
+
+/**
+ * @brief Starts nb_workers threads (at least 2).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int thread_pool_init(size_t nb_workers);
+
+/**
+ * @brief Queues fn(arg) for execution.
+ *
+ * When called from a worker, the job goes to that worker's own deque,
+ * otherwise the deques are filled round-robin.
+ *
+ * @return Some error code. 0 if no error, ERR_THREADING if the pool is
+ *         not running or the target queue is full.
+ */
+int thread_pool_submit(enum job_class job_class, job_fn fn, void* arg);
+
+/**
+ * @brief Copies a snapshot of the pool counters into stats.
+ */
+void thread_pool_get_stats(struct thread_pool_stats* stats);
+
+/**
+ * @brief Stops and joins all workers. Pending jobs do not run: drop (if
+ *        not NULL) is called on the argument of each of them instead, to
+ *        release it.
+ */
+void thread_pool_shutdown(job_fn drop);
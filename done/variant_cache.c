@@ -0,0 +1,221 @@
+/*
+ * @file variant_cache.c
+ * @brief Bounded in-memory cache of encoded image variants
+ *
+ * A chained hash table finds the entries, a doubly linked list keeps them
+ * from the most to the least recently used. One mutex protects both: the
+ * critical sections only link, unlink and copy.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "variant_cache.h"
+
+#define NB_BUCKETS 1024 // power of 2
+
+struct entry {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    char name[MAX_VARIANT_NAME + 1];
+    void* content;
+    size_t size;
+    struct entry* bucket_next;
+    struct entry* prev; // more recently used
+    struct entry* next; // less recently used
+};
+
+static struct entry** buckets = NULL;
+static struct entry* most_recent = NULL;
+static struct entry* least_recent = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct variant_cache_stats stats;
+
+/*******************************************************************
+ * Hash table and recency list
+ */
+static size_t bucket_of(const unsigned char* SHA, const char* name)
+{
+    // The SHA is already uniformly distributed
+    size_t h = 0;
+    memcpy(&h, SHA, sizeof(h));
+    for (const char* p = name; *p != '\0'; ++p) {
+        h = h * 31u + (unsigned char) *p;
+    }
+    return h & (NB_BUCKETS - 1);
+}
+
+static struct entry** find(const unsigned char* SHA, const char* name)
+{
+    struct entry** e = &buckets[bucket_of(SHA, name)];
+    while (*e != NULL && (memcmp((*e)->SHA, SHA, SHA256_DIGEST_LENGTH)
+                          || strncmp((*e)->name, name, MAX_VARIANT_NAME))) {
+        e = &(*e)->bucket_next;
+    }
+    return e;
+}
+
+static void list_unlink(struct entry* e)
+{
+    if (e->prev != NULL) e->prev->next = e->next;
+    else most_recent = e->next;
+    if (e->next != NULL) e->next->prev = e->prev;
+    else least_recent = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void list_push_front(struct entry* e)
+{
+    e->prev = NULL;
+    e->next = most_recent;
+    if (most_recent != NULL) most_recent->prev = e;
+    else least_recent = e;
+    most_recent = e;
+}
+
+// Unlinks *slot (from find()) and frees it
+static void remove_entry(struct entry** slot)
+{
+    struct entry* e = *slot;
+    *slot = e->bucket_next;
+    list_unlink(e);
+    stats.size -= e->size;
+    --stats.nb_entries;
+    free(e->content);
+    free(e);
+}
+
+/*******************************************************************
+ * Allocation
+ */
+int variant_cache_init(size_t capacity)
+{
+    if (buckets != NULL) {
+        return ERR_RUNTIME;
+    }
+    buckets = calloc(NB_BUCKETS, sizeof(struct entry*));
+    if (buckets == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = capacity;
+    return ERR_NONE;
+}
+
+void variant_cache_free(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    while (least_recent != NULL) {
+        remove_entry(find(least_recent->SHA, least_recent->name));
+    }
+    free(buckets);
+    buckets = NULL;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*******************************************************************
+ * Lookup and insertion
+ */
+int variant_cache_get(const unsigned char SHA[SHA256_DIGEST_LENGTH], const char* name,
+                      void** content, size_t* size)
+{
+    if (SHA == NULL || name == NULL) return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    struct entry* e = buckets == NULL ? NULL : *find(SHA, name);
+    if (content == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return e != NULL;
+    }
+
+    if (e == NULL) {
+        ++stats.nb_misses;
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+
+    ++stats.nb_hits;
+    list_unlink(e);
+    list_push_front(e);
+
+    *content = malloc(e->size);
+    if (*content == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    memcpy(*content, e->content, e->size);
+    if (size != NULL) {
+        *size = e->size;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 1;
+}
+
+int variant_cache_put(const unsigned char SHA[SHA256_DIGEST_LENGTH], const char* name,
+                      const void* content, size_t size)
+{
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(content);
+
+    if (strlen(name) > MAX_VARIANT_NAME) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (size > stats.capacity / 8) {
+        return ERR_NONE; // would evict too much
+    }
+
+    // Copy outside of the lock
+    struct entry* e = calloc(1, sizeof(struct entry));
+    void* copy = malloc(size);
+    if (e == NULL || copy == NULL) {
+        free(e);
+        free(copy);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(copy, content, size);
+    memcpy(e->SHA, SHA, SHA256_DIGEST_LENGTH);
+    strncpy(e->name, name, MAX_VARIANT_NAME);
+    e->content = copy;
+    e->size = size;
+
+    pthread_mutex_lock(&cache_lock);
+    if (buckets == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        free(copy);
+        free(e);
+        return ERR_RUNTIME;
+    }
+
+    struct entry** slot = find(SHA, name);
+    if (*slot != NULL) {
+        remove_entry(slot);
+    }
+
+    while (least_recent != NULL && stats.size + size > stats.capacity) {
+        remove_entry(find(least_recent->SHA, least_recent->name));
+        ++stats.nb_evictions;
+    }
+
+    // Evictions may have freed the entry slot pointed into
+    struct entry** head = &buckets[bucket_of(SHA, name)];
+    e->bucket_next = *head;
+    *head = e;
+    list_push_front(e);
+    stats.size += size;
+    ++stats.nb_entries;
+    pthread_mutex_unlock(&cache_lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Statistics snapshot
+ */
+void variant_cache_get_stats(struct variant_cache_stats* out)
+{
+    if (out == NULL) return;
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file variant_cache.h
+ * @brief Bounded in-memory cache of encoded image variants that have no
+ *        place in the imgFS metadata (other formats, other sizes).
+ *
+ * Entries are identified by the SHA of the original and a short name of
+ * the variant (e.g. "webp/thumb"), so they can never be served for
+ * another image, even after a slot is reused. The least recently used
+ * entries are evicted once the total size exceeds the capacity.
+ */
+
+#pragma once
+
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <stddef.h>      // size_t
+#include <stdint.h>      // uint64_t
+
+#define VARIANT_CACHE_SIZE (64u << 20) // default capacity, in bytes
+#define MAX_VARIANT_NAME 31
+
+struct variant_cache_stats {
+    size_t nb_entries;
+    size_t size;           // bytes currently cached
+    size_t capacity;
+    uint64_t nb_hits;
+    uint64_t nb_misses;
+    uint64_t nb_evictions;
+};
+
+/**
+ * @brief Creates the cache with the given capacity in bytes.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int variant_cache_init(size_t capacity);
+
+/**
+ * @brief Frees all the entries.
+ */
+void variant_cache_free(void);
+
+/**
+ * @brief Looks for a variant.
+ *
+ * @param content Where to store a newly allocated copy (may be NULL to
+ *        only test its presence, which does not count as a hit or miss)
+ * @param size Where to store its size (may be NULL)
+ * @return 1 if found, 0 otherwise.
+ */
+int variant_cache_get(const unsigned char SHA[SHA256_DIGEST_LENGTH], const char* name,
+                      void** content, size_t* size);
+
+/**
+ * @brief Stores a copy of a variant, replacing the previous one if any.
+ *        Variants larger than an eighth of the capacity are not cached.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int variant_cache_put(const unsigned char SHA[SHA256_DIGEST_LENGTH], const char* name,
+                      const void* content, size_t size);
+
+/**
+ * @brief Copies a snapshot of the cache counters into stats.
+ */
+void variant_cache_get_stats(struct variant_cache_stats* stats);
@@ -82,6 +82,28 @@ START_TEST(http_match_verb_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_get_var_bounded)
+{
+    start_test_print;
+
+    char buf[10];
+
+    // A URI followed by its headers and by a pipelined request
+    const char *str = "/imgfs/read?res=orig&img_id=pic1 HTTP/1.1\r\nCookie: auth=1\r\n\r\n"
+                      "GET /imgfs/read?res=orig&img_id=pic1&w=100 HTTP/1.1\r\n\r\n";
+    struct http_string http_str = {.val = str, .len = strlen("/imgfs/read?res=orig&img_id=pic1")};
+
+    ck_assert_int_eq(http_get_var(&http_str, "h", buf, 9), 0);
+    ck_assert_int_eq(http_get_var(&http_str, "w", buf, 9), 0);
+    ck_assert_int_eq(http_get_var(&http_str, "id", buf, 9), 0); // suffix of img_id
+    ck_assert_int_eq(http_get_var(&http_str, "img_id", buf, 9), 4);
+    ck_assert_str_eq(buf, "pic1");
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(http_get_var_null_params)
 {
@@ -279,6 +301,159 @@ START_TEST(http_parse_message_full_headers_full_content)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parser_feed_resumes)
+{
+    start_test_print;
+
+    const char *str = "POST /imgfs/insert?&name=papillon.jpg HTTP/1.1" HTTP_LINE_DELIM
+                      "Host: localhost:8000" HTTP_LINE_DELIM "Content-Length: 12" HTTP_HDR_END_DELIM
+                      "Hello world!";
+    const size_t len = strlen(str);
+    struct http_parser parser;
+    struct http_message msg;
+    http_parser_init(&parser);
+
+    // one byte at a time, each time from a new buffer
+    char *previous = NULL;
+    for (size_t i = 1; i < len; ++i) {
+        char *buffer = malloc(i);
+        ck_assert_ptr_nonnull(buffer);
+        memcpy(buffer, str, i);
+        ck_assert_int_eq(http_parser_feed(&parser, buffer, i, &msg), 0);
+        free(previous);
+        previous = buffer;
+    }
+    free(previous);
+
+    ck_assert_int_eq(parser.state, HTTP_PARSE_BODY);
+    ck_assert_int_eq(parser.content_len, 12);
+    ck_assert_int_eq(http_parser_feed(&parser, str, len, &msg), 1);
+    ck_assert_int_eq(parser.headers_len + parser.content_len, len);
+
+    ck_assert_http_str_eq(msg.method, "POST");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/insert?&name=papillon.jpg");
+    ck_assert_int_eq(msg.num_headers, 2);
+    ck_assert_has_header(&msg, "Host", "localhost:8000");
+    ck_assert_has_header(&msg, "Content-Length", "12");
+    ck_assert_http_str_eq(msg.body, "Hello world!");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_body_not_parsed_as_headers)
+{
+    start_test_print;
+
+    const char *str = "POST /imgfs/insert?&name=a HTTP/1.1" HTTP_LINE_DELIM
+                      "Content-Length: 10" HTTP_HDR_END_DELIM "key: value";
+    struct http_parser parser;
+    struct http_message msg;
+    http_parser_init(&parser);
+
+    ck_assert_int_eq(http_parser_feed(&parser, str, strlen(str), &msg), 1);
+    ck_assert_int_eq(msg.num_headers, 1);
+    ck_assert_http_str_eq(msg.body, "key: value");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_get_header_case_insensitive)
+{
+    start_test_print;
+
+    const char *str = "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM
+                      "Host: localhost:8000" HTTP_LINE_DELIM "connection: close" HTTP_HDR_END_DELIM
+                      "GET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM;
+    struct http_parser parser;
+    struct http_message msg;
+    http_parser_init(&parser);
+
+    ck_assert_int_eq(http_parser_feed(&parser, str, strlen(str), &msg), 1);
+    // the pipelined request that follows is not part of this one
+    ck_assert_int_lt(parser.headers_len + parser.content_len, strlen(str));
+
+    const struct http_string *value = http_get_header(&msg, "Connection");
+    ck_assert_ptr_nonnull(value);
+    ck_assert_http_str_eq((*value), "close");
+    ck_assert_ptr_null(http_get_header(&msg, "Content-Length"));
+    ck_assert_ptr_null(http_get_header(NULL, "Host"));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_range_valid)
+{
+    start_test_print;
+
+    struct http_range ranges[MAX_RANGES];
+    struct http_string value = {0};
+#define set_value(str) do { value.val = str; value.len = strlen(str); } while (0)
+
+    set_value("bytes=100-199");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 1);
+    ck_assert_uint_eq(ranges[0].first, 100);
+    ck_assert_uint_eq(ranges[0].last, 199);
+
+    // open-ended, suffix, clamped, and one past the end that is dropped
+    set_value("bytes=900-, -50,990-2000, 1000-1001");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 3);
+    ck_assert_uint_eq(ranges[0].first, 900);
+    ck_assert_uint_eq(ranges[0].last, 999);
+    ck_assert_uint_eq(ranges[1].first, 950);
+    ck_assert_uint_eq(ranges[1].last, 999);
+    ck_assert_uint_eq(ranges[2].first, 990);
+    ck_assert_uint_eq(ranges[2].last, 999);
+
+    set_value("bytes=-5000");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 1);
+    ck_assert_uint_eq(ranges[0].first, 0);
+
+    set_value("bytes=1000-");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 0);
+
+    set_value("bytes=0-1,2-3");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, 1), ERR_INVALID_ARGUMENT);
+    set_value("items=0-1");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), ERR_INVALID_ARGUMENT);
+    set_value("bytes=5-4");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), ERR_INVALID_ARGUMENT);
+    set_value("bytes=-");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), ERR_INVALID_ARGUMENT);
+#undef set_value
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_etag_match_valid)
+{
+    start_test_print;
+
+    const char *str = "\"a-jpeg/0\", W/\"b-webp/0\" ,\"c\"";
+    struct http_string value = {.val = str, .len = strlen(str)};
+
+    ck_assert_int_eq(http_etag_match(&value, "\"a-jpeg/0\""), 1);
+    ck_assert_int_eq(http_etag_match(&value, "\"b-webp/0\""), 1);
+    ck_assert_int_eq(http_etag_match(&value, "\"c\""), 1);
+    ck_assert_int_eq(http_etag_match(&value, "\"a\""), 0);
+    ck_assert_int_eq(http_etag_match(NULL, "\"a\""), 0);
+
+    value.val = " * ";
+    value.len = strlen(value.val);
+    ck_assert_int_eq(http_etag_match(&value, "\"a\""), 1);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -294,6 +469,7 @@ Suite *http_test_suite()
     Add_Test(s, http_get_var_not_found);
     Add_Test(s, http_get_var_too_big);
     Add_Test(s, http_get_var_valid);
+    Add_Test(s, http_get_var_bounded);
 
     Add_Test(s, http_parse_message_null_params);
     Add_Test(s, http_parse_message_partial_headers);
@@ -301,6 +477,12 @@ Suite *http_test_suite()
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
 
+    Add_Test(s, http_parser_feed_resumes);
+    Add_Test(s, http_parser_feed_body_not_parsed_as_headers);
+    Add_Test(s, http_get_header_case_insensitive);
+    Add_Test(s, http_parse_range_valid);
+    Add_Test(s, http_etag_match_valid);
+
     return s;
 }
 
@@ -1,7 +1,10 @@
 #include "image_content.h"
+#include "image_format.h"
+#include "image_preview.h"
 #include "imgfs.h"
 #include "test.h"
 #include <check.h>
+#include <string.h>
 #include <vips/vips.h>
 
 #if VIPS_MINOR_VERSION >= 15
@@ -262,6 +265,72 @@ START_TEST(lazily_resize_valid_fallible)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(blurhash_encode_correct)
+{
+    start_test_print;
+
+    // horizontal red and vertical green gradients
+    uint8_t pixels[6][8][3];
+    for (int y = 0; y < 6; ++y) {
+        for (int x = 0; x < 8; ++x) {
+            pixels[y][x][0] = (uint8_t) (x * 255 / 7);
+            pixels[y][x][1] = (uint8_t) (y * 255 / 5);
+            pixels[y][x][2] = 128;
+        }
+    }
+
+    char hash[MAX_PREVIEW + 1];
+    ck_assert_invalid_arg(blurhash_encode(NULL, 8, 6, 3, 4, 3, hash));
+    ck_assert_invalid_arg(blurhash_encode(&pixels[0][0][0], 8, 6, 3, 5, 3, hash)); // too long
+    ck_assert_err_none(blurhash_encode(&pixels[0][0][0], 8, 6, 3, 4, 3, hash));
+    ck_assert_str_eq(hash, "LyI5er3AfQxtz4NKfQnSeXf7fQf7");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+#define accepts(header, format) image_format_accepted(header, strlen(header), format)
+
+START_TEST(image_format_accepted_valid)
+{
+    start_test_print;
+
+    ck_assert_int_eq(image_format_accepted(NULL, 0, FORMAT_JPEG), 1);
+    ck_assert_int_eq(image_format_accepted(NULL, 0, FORMAT_WEBP), 0);
+    ck_assert_int_eq(accepts("", FORMAT_WEBP), 0);
+
+    ck_assert_int_eq(accepts("image/avif,image/webp,image/apng,*/*;q=0.8", FORMAT_WEBP), 1);
+    ck_assert_int_eq(accepts("image/avif,image/webp,image/apng,*/*;q=0.8", FORMAT_AVIF), 1);
+    ck_assert_int_eq(accepts("image/webp;q=0", FORMAT_WEBP), 0);
+    ck_assert_int_eq(accepts("image/webp; q=0.0", FORMAT_WEBP), 0);
+    ck_assert_int_eq(accepts("text/html, image/AVIF ;q=0.5", FORMAT_AVIF), 1);
+    ck_assert_int_eq(accepts("image/webp;level=1;q=0.2", FORMAT_WEBP), 1);
+    ck_assert_int_eq(accepts("image/webpx", FORMAT_WEBP), 0);
+    ck_assert_int_eq(accepts("image/*", FORMAT_WEBP), 0); // only explicit ones
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_format_of_valid)
+{
+    start_test_print;
+
+    const unsigned char jpeg[12] = { 0xFF, 0xD8, 0xFF, 0xE0 };
+    ck_assert_int_eq(image_format_of(jpeg, sizeof(jpeg)), FORMAT_JPEG);
+    ck_assert_int_eq(image_format_of("RIFF\x10\0\0\0WEBPVP8 ", 16), FORMAT_WEBP);
+    ck_assert_int_eq(image_format_of("\0\0\0\x1c" "ftypavif", 12), FORMAT_AVIF);
+    ck_assert_int_eq(image_format_of("GIF89a......", 12), NB_FORMATS);
+    ck_assert_int_eq(image_format_of(jpeg, 3), NB_FORMATS);
+    ck_assert_int_eq(image_format_of(NULL, 0), NB_FORMATS);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -275,6 +344,9 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, lazily_resize_already_exists);
     Add_Test(s, lazily_resize_valid);
     Add_Test(s, lazily_resize_valid_fallible);
+    Add_Test(s, blurhash_encode_correct);
+    Add_Test(s, image_format_accepted_valid);
+    Add_Test(s, image_format_of_valid);
 
     return s;
 }
@@ -64,6 +64,79 @@ START_TEST(do_create_correct)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_create_with_res_correct)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    const struct imgfs_resolution extra[2] = { { "medium", 512, 384 }, { "retina", 1024, 768 } };
+
+    ck_assert_err(do_create_with_res(dump, &file, NB_EXTRA_RES + 1, extra), ERR_RESOLUTIONS);
+    ck_assert_err_none(do_create_with_res(dump, &file, 2, extra));
+    ck_assert_int_eq(file.header.nb_res, NB_RES + 2);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(nb_resolutions(&file), NB_RES + 2);
+    ck_assert_int_eq(imgfs_resolution_atoi(&file, "thumb"), THUMB_RES);
+    ck_assert_int_eq(imgfs_resolution_atoi(&file, "medium"), NB_RES);
+    ck_assert_int_eq(imgfs_resolution_atoi(&file, "retina"), NB_RES + 1);
+    ck_assert_int_eq(imgfs_resolution_atoi(&file, "other"), -1);
+
+    uint16_t width = 0, height = 0;
+    ck_assert_err_none(resolution_size(&file, NB_RES + 1, &width, &height));
+    ck_assert_int_eq(width, 1024);
+    ck_assert_int_eq(height, 768);
+    ck_assert_err(resolution_size(&file, ORIG_RES, &width, &height), ERR_RESOLUTIONS);
+    ck_assert_err(resolution_size(&file, NB_RES + 2, &width, &height), ERR_RESOLUTIONS);
+
+    struct img_ext_metadata empty_ext = {0};
+    for (size_t i = 0; i < 10; ++i) {
+        ck_assert_mem_eq(ext_metadata(&file, i), &empty_ext, sizeof(empty_ext));
+    }
+    ck_assert_ptr_null(ext_metadata(&file, 10));
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_create_with_previews_correct)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 },
+                               .header.flags = IMGFS_FLAGS + 1 };
+
+    ck_assert_invalid_arg(do_create(dump, &file));
+    file.header.flags = IMGFS_PREVIEWS;
+    ck_assert_err_none(do_create(dump, &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.flags, IMGFS_PREVIEWS);
+    ck_assert_int_eq(nb_resolutions(&file), NB_RES);
+    ck_assert_ptr_null(ext_metadata(&file, 0));
+
+    struct img_preview empty_preview = {0};
+    for (size_t i = 0; i < 10; ++i) {
+        ck_assert_mem_eq(preview_metadata(&file, i), &empty_preview, sizeof(empty_preview));
+    }
+    ck_assert_ptr_null(preview_metadata(&file, 10));
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_create_cmd_null_params)
 {
@@ -283,6 +356,8 @@ Suite *imgfs_do_create_test_suite()
 
     Add_Test(s, do_create_null_params);
     Add_Test(s, do_create_correct);
+    Add_Test(s, do_create_with_res_correct);
+    Add_Test(s, do_create_with_previews_correct);
 
     Add_Test(s, do_create_cmd_null_params);
     Add_Test(s, do_create_cmd_invalid_flag);
@@ -62,6 +62,65 @@ START_TEST(do_insert_duplicate_id)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(insert_image_failure_keeps_slot_empty)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876];
+    struct imgfs_file file;
+    size_t index = 0;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+
+    ck_assert_err(insert_image(image, 72876, "pic1", &file, &index), ERR_DUPLICATE_ID);
+    ck_assert_int_eq(file.metadata[2].is_valid, EMPTY);
+    ck_assert_int_eq(file.header.nb_files, 2);
+
+    // then the slot is used by the next insertion, which does not touch the disk metadata
+    ck_assert_err_none(insert_image(image, 72876, "pic3", &file, &index));
+    ck_assert_int_eq(index, 2);
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_int_eq(file.header.version, 3);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(insert_prepared_without_content)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    size_t index = 0;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // same content as pic1, which is stored
+    struct img_metadata prepared = file.metadata[0];
+    ck_assert_err_none(insert_prepared(&prepared, NULL, NULL, "pic3", &file, &index));
+    ck_assert_int_eq(file.metadata[index].offset[ORIG_RES], file.metadata[0].offset[ORIG_RES]);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    // unknown content: nothing to share
+    prepared.SHA[0] ^= 0xff;
+    ck_assert_err(insert_prepared(&prepared, NULL, NULL, "pic4", &file, &index), ERR_IMAGE_NOT_FOUND);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_insert_invalid_image)
 {
@@ -346,6 +405,8 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_null_params);
     Add_Test(s, do_insert_full);
     Add_Test(s, do_insert_duplicate_id);
+    Add_Test(s, insert_image_failure_keeps_slot_empty);
+    Add_Test(s, insert_prepared_without_content);
     Add_Test(s, do_insert_invalid_image);
     Add_Test(s, do_insert_invalid_file_mode);
     Add_Test(s, do_insert_duplicate);
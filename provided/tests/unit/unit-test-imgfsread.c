@@ -134,6 +134,35 @@ START_TEST(do_read_resize_invalid_mode)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(read_blob_valid)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    char expected_buffer[72876];
+    char *buffer = NULL;
+
+    read_file(expected_buffer, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    const struct img_metadata *md = &file.metadata[0];
+    ck_assert_int_eq(md->size[ORIG_RES], 72876);
+    // the stream position must not matter
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_err_none(read_blob(&file, md->offset[ORIG_RES], md->size[ORIG_RES], &buffer));
+    ck_assert_mem_eq(expected_buffer, buffer, 72876);
+    free(buffer);
+
+    ck_assert_err(read_blob(&file, md->offset[ORIG_RES] + 100000000, 16, &buffer), ERR_IO);
+    ck_assert_ptr_null(buffer);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_read_test_suite()
 {
@@ -144,6 +173,7 @@ Suite *imgfs_read_test_suite()
     Add_Test(s, do_read_valid);
     Add_Test(s, do_read_resize);
     Add_Test(s, do_read_resize_invalid_mode);
+    Add_Test(s, read_blob_valid);
 
     return s;
 }
@@ -52,6 +52,39 @@ START_TEST(get_resolution_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(get_resolution_header_only)
+{
+    start_test_print;
+
+    // SOI, an APP0 segment, fill bytes and a progressive frame header (SOF2):
+    // enough for the dimensions, even though there is nothing to decode
+    const unsigned char header[] = {
+        0xFF, 0xD8,
+        0xFF, 0xE0, 0x00, 0x06, 'J', 'F', 'I', 'F',
+        0xFF, 0xFF,
+        0xFF, 0xC2, 0x00, 0x0B, 0x08, 0x03, 0x20, 0x04, 0xB0, 0x01, 0x01, 0x11, 0x00
+    };
+
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, (const char*) header, sizeof(header)));
+    ck_assert_uint_eq(height, 800);
+    ck_assert_uint_eq(width, 1200);
+
+    // Start of scan without a frame header: left to vips, which rejects it
+    const unsigned char no_frame[] = {
+        0xFF, 0xD8,
+        0xFF, 0xE0, 0x00, 0x06, 'J', 'F', 'I', 'F',
+        0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00,
+        0xFF, 0xD9
+    };
+    ck_assert_err(get_resolution(&height, &width, (const char*) no_frame, sizeof(no_frame)),
+                  ERR_IMGLIB);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_get_resolution_test_suite()
 {
@@ -60,6 +93,7 @@ Suite *imgfs_get_resolution_test_suite()
     Add_Test(s, get_resolution_null);
     Add_Test(s, get_resolution_invalid_buffer);
     Add_Test(s, get_resolution_valid);
+    Add_Test(s, get_resolution_header_only);
 
     return s;
 }
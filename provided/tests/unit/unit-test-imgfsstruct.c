@@ -5,6 +5,9 @@
 #define SIZE_imgfs_header 64
 #define SIZE_img_metadata 216
 #define SIZE_imgfs_file   80
+#define SIZE_imgfs_resolution 16
+#define SIZE_img_ext_metadata 64
+#define SIZE_img_preview 32
 
 #define OFFSET_imgfs_header_name        0
 #define OFFSET_imgfs_header_version     32
@@ -95,6 +98,29 @@ START_TEST(imgfs_file)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(imgfs_resolution)
+{
+    start_test_print;
+
+    test_size(imgfs_resolution);
+    test_size(img_ext_metadata);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(img_preview)
+{
+    start_test_print;
+
+    test_size(img_preview);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_structures_test_suite()
 {
@@ -103,6 +129,8 @@ Suite *imgfs_structures_test_suite()
     Add_Test(s, imgfs_header);
     Add_Test(s, img_metadata);
     Add_Test(s, imgfs_file);
+    Add_Test(s, imgfs_resolution);
+    Add_Test(s, img_preview);
 
     return s;
 }
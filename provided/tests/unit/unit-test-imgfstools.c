@@ -137,6 +137,34 @@ START_TEST(do_close_null_file)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(sha_string_round_trip)
+{
+    start_test_print;
+
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    unsigned char read[SHA256_DIGEST_LENGTH];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        SHA[i] = (unsigned char) (i * 37 + 5);
+    }
+    char sha_string[2 * SHA256_DIGEST_LENGTH + 1];
+    sha_to_string(SHA, sha_string);
+
+    ck_assert_err_none(sha_from_string(sha_string, read));
+    ck_assert_mem_eq(read, SHA, SHA256_DIGEST_LENGTH);
+
+    sha_string[0] = 'A'; // upper case is accepted
+    ck_assert_err_none(sha_from_string(sha_string, read));
+    ck_assert_uint_eq(read[0] >> 4, 0xA);
+
+    sha_string[2 * SHA256_DIGEST_LENGTH - 1] = 'g';
+    ck_assert_err(sha_from_string(sha_string, read), ERR_INVALID_ARGUMENT);
+    ck_assert_err(sha_from_string("00", read), ERR_INVALID_ARGUMENT);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_tools_suite_RES()
 {
@@ -151,6 +179,8 @@ Suite *imgfs_tools_suite_RES()
     Add_Test(s, do_close_null_param);
     Add_Test(s, do_close_null_file);
 
+    Add_Test(s, sha_string_round_trip);
+
     return s;
 }
 